@@ -0,0 +1,305 @@
+// Offline renderer: renders every frame of a scene file headless and writes a numbered BMP sequence.
+// Frames are independent, so each worker owns a whole gfx instance and claims frames one at a time.
+// usage: batch_render <scene file> [workers]
+//
+// Scene file, one item per line, '#' starts a comment:
+//   size <width> <height>
+//   frames <count>
+//   fov <degrees>
+//   output <path prefix>                           writes <prefix>00000.bmp, <prefix>00001.bmp, ...
+//   mesh <name> <obj file> <plain|uv> [texture jpg] uv for faces written as f v/vt, plain for f v
+//   chunked <name> <chunk file> [texture jpg]      mapped, from tools/obj2chunks
+//   object <mesh name> <wire|solid|textured> <x> <y> <z> [yaw] [yaw per frame]
+//   light <x> <y> <z> <nx> <ny> <nz> <r> <g> <b> <power>
+//   camera <frame> <x> <y> <z> <target x> <target y> <target z>
+// Camera keys are interpolated linearly; without any the camera sits at the origin looking down +z.
+
+#include <Windows.h>
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <memory>
+#include "p_gfx.h"
+
+using namespace _3D;
+
+struct scene_mesh {
+	std::string name;
+	std::unique_ptr<mesh3d> mesh;
+	std::unique_ptr<chunked_mesh> chunks;
+	std::unique_ptr<Texture> tex;
+};
+
+struct scene_object {
+	int mesh;
+	Draw_Type type;
+	vec3d pos;
+	float yaw;
+	float spin;
+};
+
+struct cam_key {
+	int frame;
+	vec3d pos;
+	vec3d target;
+};
+
+struct batch_scene {
+	int width = 640;
+	int height = 480;
+	int frames = 1;
+	float fov = 70.0f;
+	std::string output = "frame_";
+	std::vector<scene_mesh> meshes;
+	std::vector<scene_object> objects;
+	std::vector<plane_Light> lights;
+	std::vector<cam_key> cameras;
+};
+
+static bool load_Scene(const char* path, batch_scene& sc)
+{
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		fprintf(stderr, "batch_render: cannot open %s\n", path);
+		return false;
+	}
+
+	// meshes and textures decode in parallel while the rest of the file is read
+	asset_loader loader;
+	std::vector<std::pair<std::string, std::shared_future<bool>>> loads;
+
+	std::string line;
+	int line_no = 0;
+	while (std::getline(file, line)) {
+		line_no++;
+		size_t hash = line.find('#');
+		if (hash != std::string::npos) line.erase(hash);
+
+		std::istringstream s(line);
+		std::string key;
+		if (!(s >> key))continue;
+
+		bool ok = true;
+		if (key == "size") ok = (bool)(s >> sc.width >> sc.height) && sc.width > 0 && sc.height > 0;
+		else if (key == "frames") ok = (bool)(s >> sc.frames) && sc.frames > 0;
+		else if (key == "fov") ok = (bool)(s >> sc.fov);
+		else if (key == "output") ok = (bool)(s >> sc.output);
+		else if (key == "mesh") {
+			scene_mesh m;
+			std::string obj, format, tex;
+			ok = (bool)(s >> m.name >> obj >> format) && (format == "plain" || format == "uv");
+			if (ok) {
+				m.mesh.reset(new mesh3d);
+				if (s >> tex) {
+					m.tex.reset(new Texture);
+					loads.emplace_back(tex, loader.load_Texture(m.tex.get(), tex.c_str()));
+				}
+				loads.emplace_back(obj, loader.load_Mesh(m.mesh.get(), obj.c_str(), format == "uv", m.tex.get()));
+				sc.meshes.push_back(std::move(m));
+			}
+		}
+		else if (key == "chunked") {
+			scene_mesh m;
+			std::string file, tex;
+			ok = (bool)(s >> m.name >> file);
+			if (ok) {
+				m.chunks.reset(new chunked_mesh);
+				if (!m.chunks->open(file.c_str())) {
+					fprintf(stderr, "batch_render: cannot open %s\n", file.c_str());
+					return false;
+				}
+				if (s >> tex) {
+					m.tex.reset(new Texture);
+					loads.emplace_back(tex, loader.load_Texture(m.tex.get(), tex.c_str()));
+					m.chunks->bind_Texture(m.tex.get());
+				}
+				sc.meshes.push_back(std::move(m));
+			}
+		}
+		else if (key == "object") {
+			scene_object o = { -1, SOLID, {}, 0.0f, 0.0f };
+			std::string name, type;
+			ok = (bool)(s >> name >> type >> o.pos.x >> o.pos.y >> o.pos.z);
+			if (ok) {
+				s >> o.yaw >> o.spin;
+				for (int i = 0; i < (int)sc.meshes.size(); i++)
+					if (sc.meshes[i].name == name) o.mesh = i;
+				if (type == "wire") o.type = WIRE_FRAME;
+				else if (type == "textured") o.type = TEXTURED;
+				else if (type == "solid") o.type = SOLID;
+				else ok = false;
+				if (o.mesh < 0) {
+					fprintf(stderr, "batch_render: %s:%d: unknown mesh %s\n", path, line_no, name.c_str());
+					return false;
+				}
+				if (ok && o.type == TEXTURED && !sc.meshes[o.mesh].tex) {
+					fprintf(stderr, "batch_render: %s:%d: %s has no texture, drawing it solid\n", path, line_no, name.c_str());
+					o.type = SOLID;
+				}
+				if (ok) sc.objects.push_back(o);
+			}
+		}
+		else if (key == "light") {
+			float px, py, pz, nx, ny, nz, power;
+			int r, g, b;
+			ok = (bool)(s >> px >> py >> pz >> nx >> ny >> nz >> r >> g >> b >> power);
+			if (ok) {
+				plane_Light l;
+				l.set_Position(px, py, pz);
+				l.set_Normal(nx, ny, nz);
+				l.set_Color((unsigned char)r, (unsigned char)g, (unsigned char)b);
+				l.set_Power(power);
+				sc.lights.push_back(l);
+			}
+		}
+		else if (key == "camera") {
+			cam_key k;
+			ok = (bool)(s >> k.frame >> k.pos.x >> k.pos.y >> k.pos.z >> k.target.x >> k.target.y >> k.target.z);
+			if (ok) {
+				size_t at = 0;
+				while (at < sc.cameras.size() && sc.cameras[at].frame < k.frame) at++;
+				sc.cameras.insert(sc.cameras.begin() + at, k);
+			}
+		}
+		else ok = false;
+
+		if (!ok) {
+			fprintf(stderr, "batch_render: %s:%d: cannot parse \"%s\"\n", path, line_no, line.c_str());
+			return false;
+		}
+	}
+
+	bool ok = true;
+	for (auto& l : loads) {
+		if (!l.second.get()) {
+			fprintf(stderr, "batch_render: cannot load %s\n", l.first.c_str());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static void camera_At(const batch_scene& sc, int frame, vec3d& pos, vec3d& target)
+{
+	pos = { 0, 0, 0 };
+	target = { 0, 0, 1 };
+	if (sc.cameras.empty())return;
+
+	const cam_key* a = &sc.cameras.front();
+	const cam_key* b = a;
+	for (const cam_key& k : sc.cameras) {
+		if (k.frame <= frame) a = &k;
+		if (k.frame >= frame) { b = &k; break; }
+		b = &k;
+	}
+
+	float t = (b->frame > a->frame) ? (float)(frame - a->frame) / (b->frame - a->frame) : 0.0f;
+	t = min(max(t, 0.0f), 1.0f);
+	pos = { a->pos.x + (b->pos.x - a->pos.x) * t, a->pos.y + (b->pos.y - a->pos.y) * t, a->pos.z + (b->pos.z - a->pos.z) * t };
+	target = { a->target.x + (b->target.x - a->target.x) * t, a->target.y + (b->target.y - a->target.y) * t, a->target.z + (b->target.z - a->target.z) * t };
+}
+
+// 32 bit bottom-up BMP, the layout scr_Buff already has apart from the row order
+static bool write_BMP(const char* path, const bgra8* pixels, int width, int height)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f)return false;
+
+	unsigned int data_size = (unsigned int)width * height * 4;
+	unsigned char header[54] = { 'B', 'M' };
+	auto put32 = [&](int at, unsigned int v) { for (int i = 0; i < 4; i++) header[at + i] = (unsigned char)(v >> (8 * i)); };
+	put32(2, 54 + data_size);
+	put32(10, 54);
+	put32(14, 40);
+	put32(18, width);
+	put32(22, height);
+	header[26] = 1;
+	header[28] = 32;
+	put32(34, data_size);
+
+	bool ok = fwrite(header, 1, 54, f) == 54;
+	for (int i = height - 1; i >= 0 && ok; i--)
+		ok = fwrite(&pixels[i * width], sizeof(bgra8), width, f) == (size_t)width;
+	if (fclose(f) != 0) ok = false;
+	return ok;
+}
+
+static void render_Worker(batch_scene* sc, int threads, std::atomic<int>* next_frame, std::atomic<bool>* failed)
+{
+	gfx renderer(sc->width, sc->height);
+	renderer.set_Thread_Count(threads);
+	if (!renderer.Init()) {
+		*failed = true;
+		return;
+	}
+
+	mat4x4 proj_mat = Projection_mat4(sc->fov, (float)sc->height / sc->width, 0.5f, 1000.0f);
+	renderer.set_Projection_Matrices(&proj_mat);
+	std::vector<plane_Light> lights = sc->lights;
+	char path[1024];
+
+	for (int f = (*next_frame)++; f < sc->frames && !*failed; f = (*next_frame)++) {
+		vec3d cam_pos, target, up = { 0, 1, 0 };
+		camera_At(*sc, f, cam_pos, target);
+		mat4x4 mat_camera = pointAt_mat(cam_pos, target, up);
+		mat4x4 mat_view = rt_mat_inverse(mat_camera);
+
+		renderer.ClearScreen({ 50,50,50,0 });
+		renderer.set_Frame_Variables(&mat_view, &cam_pos, nullptr);
+		renderer.set_Lights(lights.data(), (int)lights.size());
+
+		for (const scene_object& o : sc->objects) {
+			mat4x4 world_mat = YRotation_mat4(o.yaw + o.spin * f) * Translation_mat4(o.pos.x, o.pos.y, o.pos.z);
+			const scene_mesh& m = sc->meshes[o.mesh];
+			bool drawn = m.chunks ? renderer.Draw_Chunked(m.chunks.get(), world_mat, o.type) : renderer.Draw_obj(m.mesh.get(), world_mat, o.type);
+			if (!drawn) {
+				*failed = true;
+				return;
+			}
+		}
+
+		snprintf(path, sizeof(path), "%s%05d.bmp", sc->output.c_str(), f);
+		if (!write_BMP(path, renderer.get_Frame(), sc->width, sc->height)) {
+			fprintf(stderr, "batch_render: cannot write %s\n", path);
+			*failed = true;
+			return;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: batch_render <scene file> [workers]\n");
+		return 1;
+	}
+
+	batch_scene sc;
+	if (!load_Scene(argv[1], sc))return 1;
+
+	// every gfx runs rasterizer threads of its own, so the cores are shared out between them
+	int cores = max((int)std::thread::hardware_concurrency(), 1);
+	int workers = (argc == 3) ? atoi(argv[2]) : cores / 2;
+	workers = min(max(workers, 1), sc.frames);
+	int threads = max(cores / workers, 1);
+
+	std::atomic<int> next_frame(0);
+	std::atomic<bool> failed(false);
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> pool;
+	for (int w = 0; w < workers; w++)
+		pool.emplace_back(render_Worker, &sc, threads, &next_frame, &failed);
+	for (std::thread& t : pool) t.join();
+
+	if (failed) {
+		fprintf(stderr, "batch_render: rendering failed\n");
+		return 1;
+	}
+
+	auto stop = std::chrono::steady_clock::now();
+	double secs = std::chrono::duration<double>(stop - start).count();
+	printf("%d frames with %d workers in %.2f s (%.1f fps)\n", sc.frames, workers, secs, sc.frames / secs);
+	return 0;
+}
@@ -29,6 +29,8 @@ int WINAPI wWinMain(HINSTANCE hInstance , HINSTANCE  hPrevInstance, LPWSTR  lpCm
 		d2d_demo.~gfx();
 		return -1;
 	}
+	// the camera only moves on key presses, so most frames redraw little or nothing
+	d2d_demo.set_Render_Mode(RENDER_INCREMENTAL);
 	d2d_demo.ClearScreen({ 200,200,200,200 });
 	MSG msg = { 0 };
 	
@@ -40,38 +42,34 @@ int WINAPI wWinMain(HINSTANCE hInstance , HINSTANCE  hPrevInstance, LPWSTR  lpCm
 	auto durt = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
 	std::string win_title = "_3D_  ";
 	
+	// drawn as they finish loading; the loader is declared last so it is
+	// destroyed, and done with them, before any of the assets
 	Texture sptl;
-	sptl.load_image_data("sptl_inv.jpg");
 	mesh3d crwn;
-	crwn.load_obj("fancy.obj",true);
-	crwn.bind_Texture(&sptl);
 
 	/*Texture face;
-	if (!face.load_image_data("face_inv.jpg"))return -1;
-	mesh3d head;
-	head.load_obj("tex_head+.obj", true);
-	head.bind_Texture(&face);*/
+	mesh3d head;*/
 
 	mesh3d car;
-	car.load_obj("car.obj", false);
-
 	mesh3d tree;
-	tree.load_obj("tree.obj", true);
-
 	mesh3d plane;
-	plane.load_obj("plane.obj", true);
 	Texture concrete;
-	concrete.load_image_data("concrete.jpg");
-	plane.bind_Texture(&concrete);
-
 	mesh3d man;
-	man.load_obj("man.obj", true);
 	Texture cloth;
-	cloth.load_image_data("cloth.jpg");
-	man.bind_Texture(&cloth);
-
 	Texture giraffe;
-	giraffe.load_image_data("grf.jpg");
+
+	asset_loader loader;
+	loader.load_Texture(&sptl, "sptl_inv.jpg");
+	loader.load_Mesh(&crwn, "fancy.obj", true, &sptl);
+	/*loader.load_Texture(&face, "face_inv.jpg");
+	loader.load_Mesh(&head, "tex_head+.obj", true, &face);*/
+	loader.load_Mesh(&car, "car.obj", false);
+	loader.load_Mesh(&tree, "tree.obj", true);
+	loader.load_Texture(&concrete, "concrete.jpg");
+	loader.load_Mesh(&plane, "plane.obj", true, &concrete);
+	loader.load_Texture(&cloth, "cloth.jpg");
+	loader.load_Mesh(&man, "man.obj", true, &cloth);
+	loader.load_Texture(&giraffe, "grf.jpg");
 
 	/*Texture body;
 	body.load_image_data("body2.jpg");
@@ -151,13 +149,6 @@ int WINAPI wWinMain(HINSTANCE hInstance , HINSTANCE  hPrevInstance, LPWSTR  lpCm
 		world_mat = world_mat * trans_mat;
 		if (!d2d_demo.Draw_obj(&plane, world_mat, TEXTURED))return -1;
 
-		d2d_demo.Draw_String("abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz", 800, 10, { 10,10,200,0 });
-		/*d2d_demo.Draw_String("abcdefghijklmnopqrstuvwxyz", 10, 10, { 10,10,200,0 });
-		d2d_demo.Draw_String("ABCDEFGHIJKLMNOPQRSTUVWXYZ", 10, 50, { 200,10,10,0 });
-		d2d_demo.Draw_String("0123456789", 10, 100, { 10,200,10,0 });
-		d2d_demo.Draw_Image(&giraffe, 400, 100);*/
-
-
 		trans_mat = Translation_mat4(-2.0f, 0.25f, 5.0f);
 		world_mat = Identity4();
 		matRotY = YRotation_mat4(0);
@@ -172,6 +163,12 @@ int WINAPI wWinMain(HINSTANCE hInstance , HINSTANCE  hPrevInstance, LPWSTR  lpCm
 		world_mat = world_mat * trans_mat;
 		if (!d2d_demo.Draw_obj(&car, world_mat, SOLID))return -1;
 
+		d2d_demo.Draw_String("abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz", 800, 10, { 10,10,200,0 });
+		/*d2d_demo.Draw_String("abcdefghijklmnopqrstuvwxyz", 10, 10, { 10,10,200,0 });
+		d2d_demo.Draw_String("ABCDEFGHIJKLMNOPQRSTUVWXYZ", 10, 50, { 200,10,10,0 });
+		d2d_demo.Draw_String("0123456789", 10, 100, { 10,200,10,0 });
+		d2d_demo.Draw_Image(&giraffe, 400, 100);*/
+
 		d2d_demo.UpdateScreen();
 		d2d_demo.End_draw();
 
@@ -189,4 +186,4 @@ int WINAPI wWinMain(HINSTANCE hInstance , HINSTANCE  hPrevInstance, LPWSTR  lpCm
 
 	
 	return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
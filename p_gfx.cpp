@@ -1,5 +1,11 @@
 #include "p_gfx.h"
 
+// generated at build time by tools/sht2glyphs; without it the sheets are read from dpnds/ at startup
+#if __has_include("font_glyphs.h")
+#include "font_glyphs.h"
+#define EMBEDDED_FONT
+#endif
+
 using namespace _3D;
 
 HWND Create_Window(const wchar_t* title, int wd, int ht, HINSTANCE hInst, int nCmd, int* error, WNDPROC winproc)
@@ -28,6 +34,849 @@ HWND Create_Window(const wchar_t* title, int wd, int ht, HINSTANCE hInst, int nC
 	return wHandle;
 }
 
+// Runtime SIMD dispatch ///////////
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static void cpu_Id(int leaf, int sub, int regs[4]) { __cpuidex(regs, leaf, sub); }
+static uint64_t os_Xsave_Mask() { return _xgetbv(0); }
+#else
+#include <cpuid.h>
+static void cpu_Id(int leaf, int sub, int regs[4])
+{
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, sub, a, b, c, d);
+	regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+}
+static uint64_t os_Xsave_Mask()
+{
+	unsigned int lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+static Simd_Level detect_Simd_Level()
+{
+	int r[4];
+	cpu_Id(0, 0, r);
+	int max_leaf = r[0];
+	cpu_Id(1, 0, r);
+	if (!(r[3] & (1 << 26)))return SIMD_SCALAR;
+
+	// AVX2 here also means FMA and F16C, and the OS saving the YMM registers
+	bool osxsave = (r[2] & (1 << 27)) != 0;
+	bool avx = osxsave && (r[2] & (1 << 28)) && (r[2] & (1 << 12)) && (r[2] & (1 << 29));
+	uint64_t xcr0 = osxsave ? os_Xsave_Mask() : 0;
+	if (!avx || (xcr0 & 0x6) != 0x6 || max_leaf < 7)return SIMD_SSE2;
+
+	cpu_Id(7, 0, r);
+	if (!(r[1] & (1 << 5)))return SIMD_SSE2;
+
+	// AVX-512 F and BW, with the opmask and ZMM state enabled
+	if ((r[1] & (1 << 16)) && (r[1] & (1 << 30)) && (xcr0 & 0xE6) == 0xE6)return SIMD_AVX512;
+	return SIMD_AVX2;
+}
+
+static float half_To_Float(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1F, mant = h & 0x3FF, bits;
+	if (exp == 0x1F) bits = sign | 0x7F800000 | (mant ? 0x400000 | (mant << 13) : 0);
+	else if (exp != 0) bits = sign | ((exp + 112) << 23) | (mant << 13);
+	else if (mant == 0) bits = sign;
+	else {
+		exp = 113;
+		while (!(mant & 0x400)) { mant <<= 1; exp--; }
+		bits = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// round to nearest even, as _cvtss_sh(f, 0) does
+static uint16_t float_To_Half(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+	uint32_t ax = x & 0x7FFFFFFF;
+	if (ax > 0x7F800000)return sign | 0x7E00 | (uint16_t)((ax >> 13) & 0x3FF);
+	if (ax >= 0x477FF000)return sign | 0x7C00;
+	if (ax < 0x38800000) {
+		float v;
+		memcpy(&v, &ax, sizeof(v));
+		return sign | (uint16_t)lrintf(v * 16777216.0f);
+	}
+	return sign | (uint16_t)((ax + 0xC8000FFF + ((ax >> 13) & 1)) >> 13);
+}
+
+// The variants below must match the scalar kernels bit for bit; GCC would otherwise fuse
+// their multiplies and adds where the AVX-512 target brings FMA in with it.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// glyph rows: set bits of row (already limited to the visible columns) become color
+static void glyph_Row_Scalar(int* dst, uint64_t row, int c0, int c1, int color)
+{
+	for (int j = c0; j < c1; j++)
+		if ((row >> j) & 1) dst[j] = color;
+}
+
+static void glyph_Row_SSE2(int* dst, uint64_t row, int c0, int c1, int color)
+{
+	const __m128i _lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128i _col = _mm_set1_epi32(color);
+	int j = c0;
+	for (; j + 4 <= c1; j += 4) {
+		int bits = (int)((row >> j) & 0xF);
+		if (!bits)continue;
+		__m128i msk = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(bits), _lane_bits), _lane_bits);
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[j]);
+		_mm_storeu_si128((__m128i*)&dst[j], _mm_or_si128(_mm_and_si128(msk, _col), _mm_andnot_si128(msk, d)));
+	}
+	glyph_Row_Scalar(dst, row, j, c1, color);
+}
+
+GFX_TARGET("avx2")
+static void glyph_Row_AVX2(int* dst, uint64_t row, int c0, int c1, int color)
+{
+	const __m256i _lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256i _col = _mm256_set1_epi32(color);
+	for (int j = c0; j < c1; j += 8) {
+		int bits = (int)((row >> j) & 0xFF);
+		if (!bits)continue;
+		__m256i msk = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), _lane_bits), _lane_bits);
+		_mm256_maskstore_epi32(&dst[j], msk, _col);
+	}
+}
+
+GFX_TARGET("avx512f")
+static void glyph_Row_AVX512(int* dst, uint64_t row, int c0, int c1, int color)
+{
+	const __m512i _col = _mm512_set1_epi32(color);
+	for (int j = c0; j < c1; j += 16) {
+		__mmask16 bits = (__mmask16)((row >> j) & 0xFFFF);
+		if (bits) _mm512_mask_storeu_epi32(&dst[j], bits, _col);
+	}
+}
+
+// dst = (src * a + dst * (255 - a)) / 255
+static void blend_Row_Scalar(bgra8* dst, const bgra8* src, int n)
+{
+	for (int j = 0; j < n; j++) {
+		int a = src[j].a;
+		int v = src[j].b * a + dst[j].b * (255 - a) + 128; dst[j].b = (v + (v >> 8)) >> 8;
+		v = src[j].g * a + dst[j].g * (255 - a) + 128; dst[j].g = (v + (v >> 8)) >> 8;
+		v = src[j].r * a + dst[j].r * (255 - a) + 128; dst[j].r = (v + (v >> 8)) >> 8;
+		v = src[j].a * a + dst[j].a * (255 - a) + 128; dst[j].a = (v + (v >> 8)) >> 8;
+	}
+}
+
+static void blend_Row_SSE2(bgra8* dst, const bgra8* src, int n)
+{
+	const __m128i _zero = _mm_setzero_si128();
+	const __m128i _max = _mm_set1_epi16(255);
+	const __m128i _half = _mm_set1_epi16(128);
+	int j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)&src[j]);
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[j]);
+		__m128i s_lo = _mm_unpacklo_epi8(s, _zero), s_hi = _mm_unpackhi_epi8(s, _zero);
+		__m128i d_lo = _mm_unpacklo_epi8(d, _zero), d_hi = _mm_unpackhi_epi8(d, _zero);
+		__m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+		__m128i r_lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo), _mm_mullo_epi16(d_lo, _mm_sub_epi16(_max, a_lo))), _half);
+		__m128i r_hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi), _mm_mullo_epi16(d_hi, _mm_sub_epi16(_max, a_hi))), _half);
+		r_lo = _mm_srli_epi16(_mm_add_epi16(r_lo, _mm_srli_epi16(r_lo, 8)), 8);
+		r_hi = _mm_srli_epi16(_mm_add_epi16(r_hi, _mm_srli_epi16(r_hi, 8)), 8);
+		_mm_storeu_si128((__m128i*)&dst[j], _mm_packus_epi16(r_lo, r_hi));
+	}
+	blend_Row_Scalar(&dst[j], &src[j], n - j);
+}
+
+GFX_TARGET("avx2")
+static void blend_Row_AVX2(bgra8* dst, const bgra8* src, int n)
+{
+	// unpack and pack both work per 128 bit lane, so pixel order survives the round trip
+	const __m256i _zero = _mm256_setzero_si256();
+	const __m256i _max = _mm256_set1_epi16(255);
+	const __m256i _half = _mm256_set1_epi16(128);
+	int j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)&src[j]);
+		__m256i d = _mm256_loadu_si256((const __m256i*)&dst[j]);
+		__m256i s_lo = _mm256_unpacklo_epi8(s, _zero), s_hi = _mm256_unpackhi_epi8(s, _zero);
+		__m256i d_lo = _mm256_unpacklo_epi8(d, _zero), d_hi = _mm256_unpackhi_epi8(d, _zero);
+		__m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+		__m256i r_lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_lo, a_lo), _mm256_mullo_epi16(d_lo, _mm256_sub_epi16(_max, a_lo))), _half);
+		__m256i r_hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_hi, a_hi), _mm256_mullo_epi16(d_hi, _mm256_sub_epi16(_max, a_hi))), _half);
+		r_lo = _mm256_srli_epi16(_mm256_add_epi16(r_lo, _mm256_srli_epi16(r_lo, 8)), 8);
+		r_hi = _mm256_srli_epi16(_mm256_add_epi16(r_hi, _mm256_srli_epi16(r_hi, 8)), 8);
+		_mm256_storeu_si256((__m256i*)&dst[j], _mm256_packus_epi16(r_lo, r_hi));
+	}
+	blend_Row_SSE2(&dst[j], &src[j], n - j);
+}
+
+GFX_TARGET("avx512f,avx512bw")
+static void blend_Row_AVX512(bgra8* dst, const bgra8* src, int n)
+{
+	const __m512i _zero = _mm512_setzero_si512();
+	const __m512i _max = _mm512_set1_epi16(255);
+	const __m512i _half = _mm512_set1_epi16(128);
+	for (int j = 0; j < n; j += 16) {
+		// the last step loads and stores only the pixels that are left
+		__mmask16 live = (n - j >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - j)) - 1);
+		__m512i s = _mm512_maskz_loadu_epi32(live, &src[j]);
+		__m512i d = _mm512_maskz_loadu_epi32(live, &dst[j]);
+		__m512i s_lo = _mm512_unpacklo_epi8(s, _zero), s_hi = _mm512_unpackhi_epi8(s, _zero);
+		__m512i d_lo = _mm512_unpacklo_epi8(d, _zero), d_hi = _mm512_unpackhi_epi8(d, _zero);
+		__m512i a_lo = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m512i a_hi = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+		__m512i r_lo = _mm512_add_epi16(_mm512_add_epi16(_mm512_mullo_epi16(s_lo, a_lo), _mm512_mullo_epi16(d_lo, _mm512_sub_epi16(_max, a_lo))), _half);
+		__m512i r_hi = _mm512_add_epi16(_mm512_add_epi16(_mm512_mullo_epi16(s_hi, a_hi), _mm512_mullo_epi16(d_hi, _mm512_sub_epi16(_max, a_hi))), _half);
+		r_lo = _mm512_srli_epi16(_mm512_add_epi16(r_lo, _mm512_srli_epi16(r_lo, 8)), 8);
+		r_hi = _mm512_srli_epi16(_mm512_add_epi16(r_hi, _mm512_srli_epi16(r_hi, 8)), 8);
+		_mm512_mask_storeu_epi32(&dst[j], live, _mm512_packus_epi16(r_lo, r_hi));
+	}
+}
+
+// Depth tested flat span: w runs from sw to ew with t = k * tstep, rgb is written and
+// alpha kept wherever w is nearer than the depth buffer. All the span kernels work on
+// k in [k0, n), so a scissored span gets the same w as the whole one would.
+static void solid_Span_Scalar(bgra8* dst, float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	for (int k = k0; k < n; k++) {
+		float t = (float)k * tstep;
+		float w = (1.0f - t) * sw + t * ew;
+		if (w > depth[k]) {
+			dst[k].r = col.r; dst[k].g = col.g; dst[k].b = col.b;
+			depth[k] = w;
+		}
+	}
+}
+
+static void solid_Span_SSE2(bgra8* dst, float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m128 _sw = _mm_set1_ps(sw), _ew = _mm_set1_ps(ew), _step = _mm_set1_ps(tstep), _one = _mm_set1_ps(1.0f);
+	const __m128i _rgb = _mm_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m128i _alpha = _mm_set1_epi32((int)0xFF000000);
+	__m128i _k = _mm_add_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(k0));
+	int k = k0;
+	for (; k + 4 <= n; k += 4, _k = _mm_add_epi32(_k, _mm_set1_epi32(4))) {
+		__m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_k), _step);
+		__m128 w = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_one, t), _sw), _mm_mul_ps(t, _ew));
+		__m128 z = _mm_loadu_ps(&depth[k]);
+		__m128 m = _mm_cmpgt_ps(w, z);
+		if (!_mm_movemask_ps(m))continue;
+		_mm_storeu_ps(&depth[k], _mm_or_ps(_mm_and_ps(m, w), _mm_andnot_ps(m, z)));
+		__m128i mi = _mm_castps_si128(m);
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[k]);
+		__m128i c = _mm_or_si128(_mm_and_si128(d, _alpha), _rgb);
+		_mm_storeu_si128((__m128i*)&dst[k], _mm_or_si128(_mm_and_si128(mi, c), _mm_andnot_si128(mi, d)));
+	}
+	solid_Span_Scalar(dst, depth, k, n, sw, ew, tstep, col);
+}
+
+GFX_TARGET("avx2")
+static void solid_Span_AVX2(bgra8* dst, float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m256 _sw = _mm256_set1_ps(sw), _ew = _mm256_set1_ps(ew), _step = _mm256_set1_ps(tstep), _one = _mm256_set1_ps(1.0f);
+	const __m256i _rgb = _mm256_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m256i _alpha = _mm256_set1_epi32((int)0xFF000000);
+	__m256i _k = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(k0));
+	int k = k0;
+	for (; k + 8 <= n; k += 8, _k = _mm256_add_epi32(_k, _mm256_set1_epi32(8))) {
+		__m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_k), _step);
+		__m256 w = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_one, t), _sw), _mm256_mul_ps(t, _ew));
+		__m256 z = _mm256_loadu_ps(&depth[k]);
+		__m256 m = _mm256_cmp_ps(w, z, _CMP_GT_OQ);
+		if (!_mm256_movemask_ps(m))continue;
+		_mm256_storeu_ps(&depth[k], _mm256_blendv_ps(z, w, m));
+		__m256i d = _mm256_loadu_si256((const __m256i*)&dst[k]);
+		__m256i c = _mm256_or_si256(_mm256_and_si256(d, _alpha), _rgb);
+		_mm256_storeu_si256((__m256i*)&dst[k], _mm256_blendv_epi8(d, c, _mm256_castps_si256(m)));
+	}
+	solid_Span_Scalar(dst, depth, k, n, sw, ew, tstep, col);
+}
+
+GFX_TARGET("avx512f")
+static void solid_Span_AVX512(bgra8* dst, float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m512 _sw = _mm512_set1_ps(sw), _ew = _mm512_set1_ps(ew), _step = _mm512_set1_ps(tstep), _one = _mm512_set1_ps(1.0f);
+	const __m512i _rgb = _mm512_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m512i _alpha = _mm512_set1_epi32((int)0xFF000000);
+	__m512i _k = _mm512_add_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(k0));
+	for (int k = k0; k < n; k += 16, _k = _mm512_add_epi32(_k, _mm512_set1_epi32(16))) {
+		__mmask16 live = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+		__m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_k), _step);
+		__m512 w = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(_one, t), _sw), _mm512_mul_ps(t, _ew));
+		__m512 z = _mm512_maskz_loadu_ps(live, &depth[k]);
+		__mmask16 m = _mm512_mask_cmp_ps_mask(live, w, z, _CMP_GT_OQ);
+		if (!m)continue;
+		_mm512_mask_storeu_ps(&depth[k], m, w);
+		__m512i d = _mm512_maskz_loadu_epi32(m, &dst[k]);
+		_mm512_mask_storeu_epi32(&dst[k], m, _mm512_or_si512(_mm512_and_si512(d, _alpha), _rgb));
+	}
+}
+
+// Depth only span for the prepass, w as solid_Span computes it
+static void depth_Span_Scalar(float* depth, int k0, int n, float sw, float ew, float tstep)
+{
+	for (int k = k0; k < n; k++) {
+		float t = (float)k * tstep;
+		float w = (1.0f - t) * sw + t * ew;
+		if (w > depth[k]) depth[k] = w;
+	}
+}
+
+static void depth_Span_SSE2(float* depth, int k0, int n, float sw, float ew, float tstep)
+{
+	const __m128 _sw = _mm_set1_ps(sw), _ew = _mm_set1_ps(ew), _step = _mm_set1_ps(tstep), _one = _mm_set1_ps(1.0f);
+	__m128i _k = _mm_add_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(k0));
+	int k = k0;
+	for (; k + 4 <= n; k += 4, _k = _mm_add_epi32(_k, _mm_set1_epi32(4))) {
+		__m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_k), _step);
+		__m128 w = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_one, t), _sw), _mm_mul_ps(t, _ew));
+		__m128 z = _mm_loadu_ps(&depth[k]);
+		__m128 m = _mm_cmpgt_ps(w, z);
+		_mm_storeu_ps(&depth[k], _mm_or_ps(_mm_and_ps(m, w), _mm_andnot_ps(m, z)));
+	}
+	depth_Span_Scalar(depth, k, n, sw, ew, tstep);
+}
+
+GFX_TARGET("avx2")
+static void depth_Span_AVX2(float* depth, int k0, int n, float sw, float ew, float tstep)
+{
+	const __m256 _sw = _mm256_set1_ps(sw), _ew = _mm256_set1_ps(ew), _step = _mm256_set1_ps(tstep), _one = _mm256_set1_ps(1.0f);
+	__m256i _k = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(k0));
+	int k = k0;
+	for (; k + 8 <= n; k += 8, _k = _mm256_add_epi32(_k, _mm256_set1_epi32(8))) {
+		__m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_k), _step);
+		__m256 w = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_one, t), _sw), _mm256_mul_ps(t, _ew));
+		__m256 z = _mm256_loadu_ps(&depth[k]);
+		_mm256_storeu_ps(&depth[k], _mm256_blendv_ps(z, w, _mm256_cmp_ps(w, z, _CMP_GT_OQ)));
+	}
+	depth_Span_Scalar(depth, k, n, sw, ew, tstep);
+}
+
+GFX_TARGET("avx512f")
+static void depth_Span_AVX512(float* depth, int k0, int n, float sw, float ew, float tstep)
+{
+	const __m512 _sw = _mm512_set1_ps(sw), _ew = _mm512_set1_ps(ew), _step = _mm512_set1_ps(tstep), _one = _mm512_set1_ps(1.0f);
+	__m512i _k = _mm512_add_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(k0));
+	for (int k = k0; k < n; k += 16, _k = _mm512_add_epi32(_k, _mm512_set1_epi32(16))) {
+		__mmask16 live = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+		__m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_k), _step);
+		__m512 w = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(_one, t), _sw), _mm512_mul_ps(t, _ew));
+		__m512 z = _mm512_maskz_loadu_ps(live, &depth[k]);
+		_mm512_mask_storeu_ps(&depth[k], _mm512_mask_cmp_ps_mask(live, w, z, _CMP_GT_OQ), w);
+	}
+}
+
+// Shading pass after the prepass: rgb is written where w equals the stored depth, which
+// is left as it is
+static void solid_Span_Equal_Scalar(bgra8* dst, const float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	for (int k = k0; k < n; k++) {
+		float t = (float)k * tstep;
+		float w = (1.0f - t) * sw + t * ew;
+		if (w == depth[k]) { dst[k].r = col.r; dst[k].g = col.g; dst[k].b = col.b; }
+	}
+}
+
+static void solid_Span_Equal_SSE2(bgra8* dst, const float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m128 _sw = _mm_set1_ps(sw), _ew = _mm_set1_ps(ew), _step = _mm_set1_ps(tstep), _one = _mm_set1_ps(1.0f);
+	const __m128i _rgb = _mm_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m128i _alpha = _mm_set1_epi32((int)0xFF000000);
+	__m128i _k = _mm_add_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(k0));
+	int k = k0;
+	for (; k + 4 <= n; k += 4, _k = _mm_add_epi32(_k, _mm_set1_epi32(4))) {
+		__m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_k), _step);
+		__m128 w = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_one, t), _sw), _mm_mul_ps(t, _ew));
+		__m128i mi = _mm_castps_si128(_mm_cmpeq_ps(w, _mm_loadu_ps(&depth[k])));
+		if (!_mm_movemask_epi8(mi))continue;
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[k]);
+		__m128i c = _mm_or_si128(_mm_and_si128(d, _alpha), _rgb);
+		_mm_storeu_si128((__m128i*)&dst[k], _mm_or_si128(_mm_and_si128(mi, c), _mm_andnot_si128(mi, d)));
+	}
+	solid_Span_Equal_Scalar(dst, depth, k, n, sw, ew, tstep, col);
+}
+
+GFX_TARGET("avx2")
+static void solid_Span_Equal_AVX2(bgra8* dst, const float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m256 _sw = _mm256_set1_ps(sw), _ew = _mm256_set1_ps(ew), _step = _mm256_set1_ps(tstep), _one = _mm256_set1_ps(1.0f);
+	const __m256i _rgb = _mm256_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m256i _alpha = _mm256_set1_epi32((int)0xFF000000);
+	__m256i _k = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(k0));
+	int k = k0;
+	for (; k + 8 <= n; k += 8, _k = _mm256_add_epi32(_k, _mm256_set1_epi32(8))) {
+		__m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_k), _step);
+		__m256 w = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_one, t), _sw), _mm256_mul_ps(t, _ew));
+		__m256 m = _mm256_cmp_ps(w, _mm256_loadu_ps(&depth[k]), _CMP_EQ_OQ);
+		if (!_mm256_movemask_ps(m))continue;
+		__m256i d = _mm256_loadu_si256((const __m256i*)&dst[k]);
+		__m256i c = _mm256_or_si256(_mm256_and_si256(d, _alpha), _rgb);
+		_mm256_storeu_si256((__m256i*)&dst[k], _mm256_blendv_epi8(d, c, _mm256_castps_si256(m)));
+	}
+	solid_Span_Equal_Scalar(dst, depth, k, n, sw, ew, tstep, col);
+}
+
+GFX_TARGET("avx512f")
+static void solid_Span_Equal_AVX512(bgra8* dst, const float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col)
+{
+	const __m512 _sw = _mm512_set1_ps(sw), _ew = _mm512_set1_ps(ew), _step = _mm512_set1_ps(tstep), _one = _mm512_set1_ps(1.0f);
+	const __m512i _rgb = _mm512_set1_epi32(*(const int*)&col & 0x00FFFFFF);
+	const __m512i _alpha = _mm512_set1_epi32((int)0xFF000000);
+	__m512i _k = _mm512_add_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(k0));
+	for (int k = k0; k < n; k += 16, _k = _mm512_add_epi32(_k, _mm512_set1_epi32(16))) {
+		__mmask16 live = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+		__m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_k), _step);
+		__m512 w = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(_one, t), _sw), _mm512_mul_ps(t, _ew));
+		__mmask16 m = _mm512_mask_cmp_ps_mask(live, w, _mm512_maskz_loadu_ps(live, &depth[k]), _CMP_EQ_OQ);
+		if (!m)continue;
+		__m512i d = _mm512_maskz_loadu_epi32(m, &dst[k]);
+		_mm512_mask_storeu_epi32(&dst[k], m, _mm512_or_si512(_mm512_and_si512(d, _alpha), _rgb));
+	}
+}
+
+// Visibility pass: id and w are written where w is nearer, nothing is shaded
+static void id_Span_Scalar(uint32_t* ids, float* depth, int k0, int n, float sw, float ew, float tstep, uint32_t id)
+{
+	for (int k = k0; k < n; k++) {
+		float t = (float)k * tstep;
+		float w = (1.0f - t) * sw + t * ew;
+		if (w > depth[k]) { depth[k] = w; ids[k] = id; }
+	}
+}
+
+static void id_Span_SSE2(uint32_t* ids, float* depth, int k0, int n, float sw, float ew, float tstep, uint32_t id)
+{
+	const __m128 _sw = _mm_set1_ps(sw), _ew = _mm_set1_ps(ew), _step = _mm_set1_ps(tstep), _one = _mm_set1_ps(1.0f);
+	const __m128i _id = _mm_set1_epi32((int)id);
+	__m128i _k = _mm_add_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(k0));
+	int k = k0;
+	for (; k + 4 <= n; k += 4, _k = _mm_add_epi32(_k, _mm_set1_epi32(4))) {
+		__m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_k), _step);
+		__m128 w = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_one, t), _sw), _mm_mul_ps(t, _ew));
+		__m128 z = _mm_loadu_ps(&depth[k]);
+		__m128 m = _mm_cmpgt_ps(w, z);
+		if (!_mm_movemask_ps(m))continue;
+		__m128i mi = _mm_castps_si128(m);
+		__m128i d = _mm_loadu_si128((const __m128i*)&ids[k]);
+		_mm_storeu_ps(&depth[k], _mm_or_ps(_mm_and_ps(m, w), _mm_andnot_ps(m, z)));
+		_mm_storeu_si128((__m128i*)&ids[k], _mm_or_si128(_mm_and_si128(mi, _id), _mm_andnot_si128(mi, d)));
+	}
+	id_Span_Scalar(ids, depth, k, n, sw, ew, tstep, id);
+}
+
+GFX_TARGET("avx2")
+static void id_Span_AVX2(uint32_t* ids, float* depth, int k0, int n, float sw, float ew, float tstep, uint32_t id)
+{
+	const __m256 _sw = _mm256_set1_ps(sw), _ew = _mm256_set1_ps(ew), _step = _mm256_set1_ps(tstep), _one = _mm256_set1_ps(1.0f);
+	const __m256i _id = _mm256_set1_epi32((int)id);
+	__m256i _k = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(k0));
+	int k = k0;
+	for (; k + 8 <= n; k += 8, _k = _mm256_add_epi32(_k, _mm256_set1_epi32(8))) {
+		__m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_k), _step);
+		__m256 w = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_one, t), _sw), _mm256_mul_ps(t, _ew));
+		__m256 z = _mm256_loadu_ps(&depth[k]);
+		__m256 m = _mm256_cmp_ps(w, z, _CMP_GT_OQ);
+		if (!_mm256_movemask_ps(m))continue;
+		__m256i d = _mm256_loadu_si256((const __m256i*)&ids[k]);
+		_mm256_storeu_ps(&depth[k], _mm256_blendv_ps(z, w, m));
+		_mm256_storeu_si256((__m256i*)&ids[k], _mm256_blendv_epi8(d, _id, _mm256_castps_si256(m)));
+	}
+	id_Span_Scalar(ids, depth, k, n, sw, ew, tstep, id);
+}
+
+GFX_TARGET("avx512f")
+static void id_Span_AVX512(uint32_t* ids, float* depth, int k0, int n, float sw, float ew, float tstep, uint32_t id)
+{
+	const __m512 _sw = _mm512_set1_ps(sw), _ew = _mm512_set1_ps(ew), _step = _mm512_set1_ps(tstep), _one = _mm512_set1_ps(1.0f);
+	const __m512i _id = _mm512_set1_epi32((int)id);
+	__m512i _k = _mm512_add_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(k0));
+	for (int k = k0; k < n; k += 16, _k = _mm512_add_epi32(_k, _mm512_set1_epi32(16))) {
+		__mmask16 live = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+		__m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_k), _step);
+		__m512 w = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(_one, t), _sw), _mm512_mul_ps(t, _ew));
+		__m512 z = _mm512_maskz_loadu_ps(live, &depth[k]);
+		__mmask16 m = _mm512_mask_cmp_ps_mask(live, w, z, _CMP_GT_OQ);
+		if (!m)continue;
+		_mm512_mask_storeu_ps(&depth[k], m, w);
+		_mm512_mask_storeu_epi32(&ids[k], m, _id);
+	}
+}
+
+// Sort-last merge of one worker's buffers: rgb and depth are taken where src_depth is nearer
+static void composite_Row_Scalar(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int k0, int n)
+{
+	for (int k = k0; k < n; k++) {
+		if (src_depth[k] <= depth[k])continue;
+		depth[k] = src_depth[k];
+		dst[k].r = src[k].r; dst[k].g = src[k].g; dst[k].b = src[k].b;
+	}
+}
+
+static void composite_Row_Scalar(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int n)
+{
+	composite_Row_Scalar(dst, depth, src, src_depth, 0, n);
+}
+
+static void composite_Row_SSE2(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int n)
+{
+	const __m128i _alpha = _mm_set1_epi32((int)0xFF000000);
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 w = _mm_loadu_ps(&src_depth[k]);
+		__m128 z = _mm_loadu_ps(&depth[k]);
+		__m128 m = _mm_cmpgt_ps(w, z);
+		if (!_mm_movemask_ps(m))continue;
+		__m128i mi = _mm_castps_si128(m);
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[k]);
+		__m128i c = _mm_or_si128(_mm_and_si128(d, _alpha), _mm_andnot_si128(_alpha, _mm_loadu_si128((const __m128i*)&src[k])));
+		_mm_storeu_ps(&depth[k], _mm_or_ps(_mm_and_ps(m, w), _mm_andnot_ps(m, z)));
+		_mm_storeu_si128((__m128i*)&dst[k], _mm_or_si128(_mm_and_si128(mi, c), _mm_andnot_si128(mi, d)));
+	}
+	composite_Row_Scalar(dst, depth, src, src_depth, k, n);
+}
+
+GFX_TARGET("avx2")
+static void composite_Row_AVX2(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int n)
+{
+	const __m256i _alpha = _mm256_set1_epi32((int)0xFF000000);
+	int k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 w = _mm256_loadu_ps(&src_depth[k]);
+		__m256 z = _mm256_loadu_ps(&depth[k]);
+		__m256 m = _mm256_cmp_ps(w, z, _CMP_GT_OQ);
+		if (!_mm256_movemask_ps(m))continue;
+		__m256i d = _mm256_loadu_si256((const __m256i*)&dst[k]);
+		__m256i c = _mm256_or_si256(_mm256_and_si256(d, _alpha), _mm256_andnot_si256(_alpha, _mm256_loadu_si256((const __m256i*)&src[k])));
+		_mm256_storeu_ps(&depth[k], _mm256_blendv_ps(z, w, m));
+		_mm256_storeu_si256((__m256i*)&dst[k], _mm256_blendv_epi8(d, c, _mm256_castps_si256(m)));
+	}
+	composite_Row_Scalar(dst, depth, src, src_depth, k, n);
+}
+
+GFX_TARGET("avx512f")
+static void composite_Row_AVX512(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int n)
+{
+	const __m512i _alpha = _mm512_set1_epi32((int)0xFF000000);
+	for (int k = 0; k < n; k += 16) {
+		__mmask16 live = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+		__m512 w = _mm512_maskz_loadu_ps(live, &src_depth[k]);
+		__mmask16 m = _mm512_mask_cmp_ps_mask(live, w, _mm512_maskz_loadu_ps(live, &depth[k]), _CMP_GT_OQ);
+		if (!m)continue;
+		__m512i d = _mm512_maskz_loadu_epi32(m, &dst[k]);
+		__m512i c = _mm512_maskz_loadu_epi32(m, &src[k]);
+		_mm512_mask_storeu_ps(&depth[k], m, w);
+		_mm512_mask_storeu_epi32(&dst[k], m, _mm512_or_si512(_mm512_and_si512(d, _alpha), _mm512_andnot_si512(_alpha, c)));
+	}
+}
+
+static void decode_UV_Scalar(const uint16_t uv[3][2], vec2d out[3])
+{
+	for (int v = 0; v < 3; v++) {
+		out[v].u = half_To_Float(uv[v][0]);
+		out[v].v = half_To_Float(uv[v][1]);
+		out[v].w = 1.0f;
+		out[v].pad = 0.0f;
+	}
+}
+
+GFX_TARGET("f16c")
+static void decode_UV_F16C(const uint16_t uv[3][2], vec2d out[3])
+{
+	__m128 uv_wpad = _mm_setr_ps(1.0f, 0.0f, 1.0f, 0.0f);
+	int uv2;
+	memcpy(&uv2, uv[2], sizeof(int));
+	__m128 uv01 = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)uv[0]));
+	__m128 uv22 = _mm_cvtph_ps(_mm_cvtsi32_si128(uv2));
+	_mm_storeu_ps(&out[0].u, _mm_movelh_ps(uv01, uv_wpad));
+	_mm_storeu_ps(&out[1].u, _mm_movehl_ps(uv_wpad, uv01));
+	_mm_storeu_ps(&out[2].u, _mm_movelh_ps(uv22, uv_wpad));
+}
+
+// Batch math over vec_soa spans: points take the whole row vector * m, normals the upper
+// 3x3 with w passed through. Same operation order as the single vector functions.
+static void transform_Soa_Scalar(const float* const in[4], float* const out[4], int n, const mat4x4& m, bool points)
+{
+	for (int k = 0; k < n; k++) {
+		float x = in[0][k], y = in[1][k], z = in[2][k], w = in[3][k];
+		for (int c = 0; c < 3; c++) {
+			float o = x * m.mat[0][c] + y * m.mat[1][c] + z * m.mat[2][c];
+			out[c][k] = points ? o + w * m.mat[3][c] : o;
+		}
+		out[3][k] = points ? x * m.mat[0][3] + y * m.mat[1][3] + z * m.mat[2][3] + w * m.mat[3][3] : w;
+	}
+}
+
+static void normalise_Soa_Scalar(float* const v[3], int n)
+{
+	for (int k = 0; k < n; k++) {
+		float l = sqrtf(v[0][k] * v[0][k] + v[1][k] * v[1][k] + v[2][k] * v[2][k]);
+		v[0][k] /= l; v[1][k] /= l; v[2][k] /= l;
+	}
+}
+
+// out is a plain array, so the vector kernels leave [k, n) to this one instead of writing into the padding
+static void dot_Soa_Range(const float* const a[3], const float* const b[3], float* out, int k, int n)
+{
+	for (; k < n; k++)
+		out[k] = a[0][k] * b[0][k] + a[1][k] * b[1][k] + a[2][k] * b[2][k];
+}
+
+static void dot_Soa_Scalar(const float* const a[3], const float* const b[3], float* out, int n)
+{
+	dot_Soa_Range(a, b, out, 0, n);
+}
+
+static void face_Normals_Soa_Scalar(const float* const p0[3], const float* const p1[3], const float* const p2[3], float* const out[4], int n)
+{
+	for (int k = 0; k < n; k++) {
+		float ax = p1[0][k] - p0[0][k], ay = p1[1][k] - p0[1][k], az = p1[2][k] - p0[2][k];
+		float bx = p2[0][k] - p0[0][k], by = p2[1][k] - p0[1][k], bz = p2[2][k] - p0[2][k];
+		float x = ay * bz - az * by, y = az * bx - ax * bz, z = ax * by - ay * bx;
+		float l = sqrtf(x * x + y * y + z * z);
+		out[0][k] = x / l; out[1][k] = y / l; out[2][k] = z / l; out[3][k] = 0.0f;
+	}
+}
+
+static void transform_Soa_SSE2(const float* const in[4], float* const out[4], int n, const mat4x4& m, bool points)
+{
+	for (int k = 0; k < n; k += 4) {
+		__m128 x = _mm_load_ps(&in[0][k]), y = _mm_load_ps(&in[1][k]), z = _mm_load_ps(&in[2][k]), w = _mm_load_ps(&in[3][k]);
+		for (int c = 0; c < 4; c++) {
+			if (c == 3 && !points) { _mm_store_ps(&out[3][k], w); break; }
+			__m128 o = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m.mat[0][c])), _mm_mul_ps(y, _mm_set1_ps(m.mat[1][c]))), _mm_mul_ps(z, _mm_set1_ps(m.mat[2][c])));
+			if (points) o = _mm_add_ps(o, _mm_mul_ps(w, _mm_set1_ps(m.mat[3][c])));
+			_mm_store_ps(&out[c][k], o);
+		}
+	}
+}
+
+static void normalise_Soa_SSE2(float* const v[3], int n)
+{
+	for (int k = 0; k < n; k += 4) {
+		__m128 x = _mm_load_ps(&v[0][k]), y = _mm_load_ps(&v[1][k]), z = _mm_load_ps(&v[2][k]);
+		__m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		_mm_store_ps(&v[0][k], _mm_div_ps(x, l));
+		_mm_store_ps(&v[1][k], _mm_div_ps(y, l));
+		_mm_store_ps(&v[2][k], _mm_div_ps(z, l));
+	}
+}
+
+static void dot_Soa_SSE2(const float* const a[3], const float* const b[3], float* out, int n)
+{
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 d = _mm_add_ps(_mm_mul_ps(_mm_load_ps(&a[0][k]), _mm_load_ps(&b[0][k])), _mm_mul_ps(_mm_load_ps(&a[1][k]), _mm_load_ps(&b[1][k])));
+		_mm_storeu_ps(&out[k], _mm_add_ps(d, _mm_mul_ps(_mm_load_ps(&a[2][k]), _mm_load_ps(&b[2][k]))));
+	}
+	dot_Soa_Range(a, b, out, k, n);
+}
+
+static void face_Normals_Soa_SSE2(const float* const p0[3], const float* const p1[3], const float* const p2[3], float* const out[4], int n)
+{
+	for (int k = 0; k < n; k += 4) {
+		__m128 x0 = _mm_load_ps(&p0[0][k]), y0 = _mm_load_ps(&p0[1][k]), z0 = _mm_load_ps(&p0[2][k]);
+		__m128 ax = _mm_sub_ps(_mm_load_ps(&p1[0][k]), x0), ay = _mm_sub_ps(_mm_load_ps(&p1[1][k]), y0), az = _mm_sub_ps(_mm_load_ps(&p1[2][k]), z0);
+		__m128 bx = _mm_sub_ps(_mm_load_ps(&p2[0][k]), x0), by = _mm_sub_ps(_mm_load_ps(&p2[1][k]), y0), bz = _mm_sub_ps(_mm_load_ps(&p2[2][k]), z0);
+		__m128 x = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+		__m128 y = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+		__m128 z = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+		__m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		_mm_store_ps(&out[0][k], _mm_div_ps(x, l));
+		_mm_store_ps(&out[1][k], _mm_div_ps(y, l));
+		_mm_store_ps(&out[2][k], _mm_div_ps(z, l));
+		_mm_store_ps(&out[3][k], _mm_setzero_ps());
+	}
+}
+
+GFX_TARGET("avx2")
+static void transform_Soa_AVX2(const float* const in[4], float* const out[4], int n, const mat4x4& m, bool points)
+{
+	for (int k = 0; k < n; k += 8) {
+		__m256 x = _mm256_load_ps(&in[0][k]), y = _mm256_load_ps(&in[1][k]), z = _mm256_load_ps(&in[2][k]), w = _mm256_load_ps(&in[3][k]);
+		for (int c = 0; c < 4; c++) {
+			if (c == 3 && !points) { _mm256_store_ps(&out[3][k], w); break; }
+			__m256 o = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(m.mat[0][c])), _mm256_mul_ps(y, _mm256_set1_ps(m.mat[1][c]))), _mm256_mul_ps(z, _mm256_set1_ps(m.mat[2][c])));
+			if (points) o = _mm256_add_ps(o, _mm256_mul_ps(w, _mm256_set1_ps(m.mat[3][c])));
+			_mm256_store_ps(&out[c][k], o);
+		}
+	}
+}
+
+GFX_TARGET("avx2")
+static void normalise_Soa_AVX2(float* const v[3], int n)
+{
+	for (int k = 0; k < n; k += 8) {
+		__m256 x = _mm256_load_ps(&v[0][k]), y = _mm256_load_ps(&v[1][k]), z = _mm256_load_ps(&v[2][k]);
+		__m256 l = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+		_mm256_store_ps(&v[0][k], _mm256_div_ps(x, l));
+		_mm256_store_ps(&v[1][k], _mm256_div_ps(y, l));
+		_mm256_store_ps(&v[2][k], _mm256_div_ps(z, l));
+	}
+}
+
+GFX_TARGET("avx2")
+static void dot_Soa_AVX2(const float* const a[3], const float* const b[3], float* out, int n)
+{
+	int k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(&a[0][k]), _mm256_load_ps(&b[0][k])), _mm256_mul_ps(_mm256_load_ps(&a[1][k]), _mm256_load_ps(&b[1][k])));
+		_mm256_storeu_ps(&out[k], _mm256_add_ps(d, _mm256_mul_ps(_mm256_load_ps(&a[2][k]), _mm256_load_ps(&b[2][k]))));
+	}
+	dot_Soa_Range(a, b, out, k, n);
+}
+
+GFX_TARGET("avx2")
+static void face_Normals_Soa_AVX2(const float* const p0[3], const float* const p1[3], const float* const p2[3], float* const out[4], int n)
+{
+	for (int k = 0; k < n; k += 8) {
+		__m256 x0 = _mm256_load_ps(&p0[0][k]), y0 = _mm256_load_ps(&p0[1][k]), z0 = _mm256_load_ps(&p0[2][k]);
+		__m256 ax = _mm256_sub_ps(_mm256_load_ps(&p1[0][k]), x0), ay = _mm256_sub_ps(_mm256_load_ps(&p1[1][k]), y0), az = _mm256_sub_ps(_mm256_load_ps(&p1[2][k]), z0);
+		__m256 bx = _mm256_sub_ps(_mm256_load_ps(&p2[0][k]), x0), by = _mm256_sub_ps(_mm256_load_ps(&p2[1][k]), y0), bz = _mm256_sub_ps(_mm256_load_ps(&p2[2][k]), z0);
+		__m256 x = _mm256_sub_ps(_mm256_mul_ps(ay, bz), _mm256_mul_ps(az, by));
+		__m256 y = _mm256_sub_ps(_mm256_mul_ps(az, bx), _mm256_mul_ps(ax, bz));
+		__m256 z = _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(ay, bx));
+		__m256 l = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+		_mm256_store_ps(&out[0][k], _mm256_div_ps(x, l));
+		_mm256_store_ps(&out[1][k], _mm256_div_ps(y, l));
+		_mm256_store_ps(&out[2][k], _mm256_div_ps(z, l));
+		_mm256_store_ps(&out[3][k], _mm256_setzero_ps());
+	}
+}
+
+GFX_TARGET("avx512f")
+static void transform_Soa_AVX512(const float* const in[4], float* const out[4], int n, const mat4x4& m, bool points)
+{
+	for (int k = 0; k < n; k += 16) {
+		__m512 x = _mm512_load_ps(&in[0][k]), y = _mm512_load_ps(&in[1][k]), z = _mm512_load_ps(&in[2][k]), w = _mm512_load_ps(&in[3][k]);
+		for (int c = 0; c < 4; c++) {
+			if (c == 3 && !points) { _mm512_store_ps(&out[3][k], w); break; }
+			__m512 o = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(m.mat[0][c])), _mm512_mul_ps(y, _mm512_set1_ps(m.mat[1][c]))), _mm512_mul_ps(z, _mm512_set1_ps(m.mat[2][c])));
+			if (points) o = _mm512_add_ps(o, _mm512_mul_ps(w, _mm512_set1_ps(m.mat[3][c])));
+			_mm512_store_ps(&out[c][k], o);
+		}
+	}
+}
+
+GFX_TARGET("avx512f")
+static void normalise_Soa_AVX512(float* const v[3], int n)
+{
+	for (int k = 0; k < n; k += 16) {
+		__m512 x = _mm512_load_ps(&v[0][k]), y = _mm512_load_ps(&v[1][k]), z = _mm512_load_ps(&v[2][k]);
+		__m512 l = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), _mm512_mul_ps(z, z)));
+		_mm512_store_ps(&v[0][k], _mm512_div_ps(x, l));
+		_mm512_store_ps(&v[1][k], _mm512_div_ps(y, l));
+		_mm512_store_ps(&v[2][k], _mm512_div_ps(z, l));
+	}
+}
+
+GFX_TARGET("avx512f")
+static void dot_Soa_AVX512(const float* const a[3], const float* const b[3], float* out, int n)
+{
+	int k = 0;
+	for (; k + 16 <= n; k += 16) {
+		__m512 d = _mm512_add_ps(_mm512_mul_ps(_mm512_load_ps(&a[0][k]), _mm512_load_ps(&b[0][k])), _mm512_mul_ps(_mm512_load_ps(&a[1][k]), _mm512_load_ps(&b[1][k])));
+		_mm512_storeu_ps(&out[k], _mm512_add_ps(d, _mm512_mul_ps(_mm512_load_ps(&a[2][k]), _mm512_load_ps(&b[2][k]))));
+	}
+	dot_Soa_Range(a, b, out, k, n);
+}
+
+GFX_TARGET("avx512f")
+static void face_Normals_Soa_AVX512(const float* const p0[3], const float* const p1[3], const float* const p2[3], float* const out[4], int n)
+{
+	for (int k = 0; k < n; k += 16) {
+		__m512 x0 = _mm512_load_ps(&p0[0][k]), y0 = _mm512_load_ps(&p0[1][k]), z0 = _mm512_load_ps(&p0[2][k]);
+		__m512 ax = _mm512_sub_ps(_mm512_load_ps(&p1[0][k]), x0), ay = _mm512_sub_ps(_mm512_load_ps(&p1[1][k]), y0), az = _mm512_sub_ps(_mm512_load_ps(&p1[2][k]), z0);
+		__m512 bx = _mm512_sub_ps(_mm512_load_ps(&p2[0][k]), x0), by = _mm512_sub_ps(_mm512_load_ps(&p2[1][k]), y0), bz = _mm512_sub_ps(_mm512_load_ps(&p2[2][k]), z0);
+		__m512 x = _mm512_sub_ps(_mm512_mul_ps(ay, bz), _mm512_mul_ps(az, by));
+		__m512 y = _mm512_sub_ps(_mm512_mul_ps(az, bx), _mm512_mul_ps(ax, bz));
+		__m512 z = _mm512_sub_ps(_mm512_mul_ps(ax, by), _mm512_mul_ps(ay, bx));
+		__m512 l = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), _mm512_mul_ps(z, z)));
+		_mm512_store_ps(&out[0][k], _mm512_div_ps(x, l));
+		_mm512_store_ps(&out[1][k], _mm512_div_ps(y, l));
+		_mm512_store_ps(&out[2][k], _mm512_div_ps(z, l));
+		_mm512_store_ps(&out[3][k], _mm512_setzero_ps());
+	}
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+struct simd_kernels {
+	Simd_Level level;
+	void (*glyph_Row)(int* dst, uint64_t row, int c0, int c1, int color);
+	void (*blend_Row)(bgra8* dst, const bgra8* src, int n);
+	void (*solid_Span)(bgra8* dst, float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col);
+	void (*depth_Span)(float* depth, int k0, int n, float sw, float ew, float tstep);
+	void (*solid_Span_Equal)(bgra8* dst, const float* depth, int k0, int n, float sw, float ew, float tstep, bgra8 col);
+	void (*id_Span)(uint32_t* ids, float* depth, int k0, int n, float sw, float ew, float tstep, uint32_t id);
+	void (*composite_Row)(bgra8* dst, float* depth, const bgra8* src, const float* src_depth, int n);
+	void (*decode_UV)(const uint16_t uv[3][2], vec2d out[3]);
+	void (*transform_Soa)(const float* const in[4], float* const out[4], int n, const mat4x4& m, bool points);
+	void (*normalise_Soa)(float* const v[3], int n);
+	void (*dot_Soa)(const float* const a[3], const float* const b[3], float* out, int n);
+	void (*face_Normals_Soa)(const float* const p0[3], const float* const p1[3], const float* const p2[3], float* const out[4], int n);
+};
+
+static simd_kernels pick_Kernels(Simd_Level level)
+{
+	switch (level) {
+	case SIMD_AVX512: return { level, glyph_Row_AVX512, blend_Row_AVX512,
+		solid_Span_AVX512, depth_Span_AVX512, solid_Span_Equal_AVX512, id_Span_AVX512,
+		composite_Row_AVX512, decode_UV_F16C,
+		transform_Soa_AVX512, normalise_Soa_AVX512, dot_Soa_AVX512, face_Normals_Soa_AVX512 };
+	case SIMD_AVX2: return { level, glyph_Row_AVX2, blend_Row_AVX2,
+		solid_Span_AVX2, depth_Span_AVX2, solid_Span_Equal_AVX2, id_Span_AVX2,
+		composite_Row_AVX2, decode_UV_F16C,
+		transform_Soa_AVX2, normalise_Soa_AVX2, dot_Soa_AVX2, face_Normals_Soa_AVX2 };
+	case SIMD_SSE2: return { level, glyph_Row_SSE2, blend_Row_SSE2,
+		solid_Span_SSE2, depth_Span_SSE2, solid_Span_Equal_SSE2, id_Span_SSE2,
+		composite_Row_SSE2, decode_UV_Scalar,
+		transform_Soa_SSE2, normalise_Soa_SSE2, dot_Soa_SSE2, face_Normals_Soa_SSE2 };
+	default: return { SIMD_SCALAR, glyph_Row_Scalar, blend_Row_Scalar,
+		solid_Span_Scalar, depth_Span_Scalar, solid_Span_Equal_Scalar, id_Span_Scalar,
+		composite_Row_Scalar, decode_UV_Scalar,
+		transform_Soa_Scalar, normalise_Soa_Scalar, dot_Soa_Scalar, face_Normals_Soa_Scalar };
+	}
+}
+
+static Simd_Level env_Simd_Level()
+{
+	Simd_Level cpu = detect_Simd_Level();
+	const char* env = getenv("GFX_SIMD");
+	if (env == nullptr)return cpu;
+
+	const char* names[4] = { "scalar", "sse2", "avx2", "avx512" };
+	for (int i = 0; i < 4; i++)
+		if (strcmp(env, names[i]) == 0)return min((Simd_Level)i, cpu);
+	return cpu;
+}
+
+static simd_kernels simd = pick_Kernels(env_Simd_Level());
+
+Simd_Level get_Simd_Level()
+{
+	return simd.level;
+}
+
+Simd_Level set_Simd_Level(Simd_Level level)
+{
+	simd = pick_Kernels(min(level, detect_Simd_Level()));
+	return simd.level;
+}
+
 gfx::gfx(HWND handle, bool sync)
 {
 	win_handle = handle;
@@ -38,6 +887,23 @@ gfx::gfx(HWND handle, bool sync)
 	wWidth = rect.right - rect.left;
 
 	vsync = sync;
+	init_State();
+}
+
+// Headless, for offline rendering: Init only starts the worker and fonts, and
+// UpdateScreen/Begin_draw/End_draw must not be called.
+gfx::gfx(int width, int height)
+{
+	win_handle = NULL;
+	wHeight = max(height, 1);
+	wWidth = max(width, 1);
+
+	vsync = false;
+	init_State();
+}
+
+void gfx::init_State()
+{
 	factory = NULL;
 	render_target = NULL;
 	bitmap = NULL;
@@ -47,23 +913,53 @@ gfx::gfx(HWND handle, bool sync)
 	memset(scr_Buff, 200, sizeof(bgra8) * wHeight * wWidth);
 	zBuffer = new float[wHeight * wWidth];
 	memset(zBuffer, 1.0f, sizeof(float) * wHeight * wWidth);
+	vis_Buffer = new uint32_t[wHeight * wWidth];
+	inc_color = new bgra8[wHeight * wWidth];
 
 	projection_mat = Identity4();
 	camera_mat = Identity4();
 	camera_pos = { 0 };
+	obj_cam_pos = { 0 };
+	obj_scale = 1.0f;
 
 	model_mat = Identity4();
 	dtype = TEXTURED;
 	obj_tex = nullptr;
-	th_data[0] = { nullptr, nullptr, 0 };
-	th_data[1] = { nullptr, nullptr, 0 };
-	ready = false;
+	render_mode = RENDER_FORWARD;
+	raster_pass = PASS_FULL;
+	raster_x0 = 0;
+	raster_x1 = wWidth;
+	raster_y0 = 0;
+	raster_y1 = wHeight;
+	inc_open = false;
+	inc_valid = false;
+	inc_clear = 0;
+	inc_prev_clear = 0;
+	n_threads = min(max((int)std::thread::hardware_concurrency(), 1), MAX_THREADS);
+	memset(th_stats, 0, sizeof(th_stats));
+	job_mesh = nullptr;
+	next_meshlet = 0;
+	job_gen = 0;
+	pending = 0;
 	kp_running = false;
-	done = false;
+	worker_task = nullptr;
+
+	sink_file = nullptr;
+	sink_format = FRAME_RAW_BGRA;
+	sink_running = false;
+	sink_error = false;
+	yuv_Buff = nullptr;
 	
-	capital_alphs = nullptr;
-	smaller_alphs = nullptr;
-	digits = nullptr;
+	glyph_rows = nullptr;
+	font_file_rows = nullptr;
+
+	occ_Width = max(wWidth / OCC_SCALE, 1);
+	occ_Height = max(wHeight / OCC_SCALE, 1);
+	occ_Buffer = new float[occ_Width * occ_Height];
+	occ_Temp = new float[occ_Width * occ_Height];
+	memset(occ_Buffer, 0, sizeof(float) * occ_Width * occ_Height);
+	occ_enabled = false;
+	occ_dirty = false;
 }
 
 gfx::~gfx()
@@ -72,17 +968,25 @@ gfx::~gfx()
 	if (render_target)render_target->Release();
 	if (bitmap)bitmap->Release();
 
+	if (sink_file)close_Frame_Sink();
 	delete[] scr_Buff;
 	delete[] zBuffer;
-	delete[] capital_alphs;
-	delete[] smaller_alphs;
-	delete[] digits;
+	delete[] vis_Buffer;
+	delete[] inc_color;
+	delete[] font_file_rows;
+	delete[] occ_Buffer;
+	delete[] occ_Temp;
 	gfx_terminate();
 }
 
 bool gfx::Init()
 {
-	
+	if (!win_handle) {
+		start_Workers();
+		init_font_system();
+		return true;
+	}
+
 	HRESULT res = D2D1CreateFactory(D2D1_FACTORY_TYPE_MULTI_THREADED, &factory);
 	if (res != S_OK)return false;
 
@@ -103,8 +1007,7 @@ bool gfx::Init()
 	res = render_target->CreateBitmap(size, D2D1::BitmapProperties(D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_IGNORE)), &bitmap);
 	bmp_Size = bitmap->GetSize();
 
-	kp_running = true;
-	draw_thd = std::thread(&gfx::pooled_draw, this, 0);
+	start_Workers();
 
 	init_font_system();
 
@@ -113,72 +1016,268 @@ bool gfx::Init()
 
 void gfx::Line(const int x1, const int y1, const int x2, const int y2, const bgra8 color)
 {
-	int dx = (x2 - x1) > 0 ? (x2 - x1) : -(x2 - x1);
-	int sx = x1 < x2 ? 1 : -1;
-	int dy = (y2 - y1) > 0 ? -(y2 - y1) : (y2 - y1);
-	int sy = y1 < y2 ? 1 : -1;
-	int err = dx + dy;
-	int e2 = 0;
-	int x = x1;
-	int y = y1;
-
-	while (true) {
-		if (x == x2 && y == y2) break;
+	line2d ln = { x1, y1, x2, y2, color };
+	if (clip_Line(ln)) raster_Line(ln, 0, wHeight);
+}
 
-		if (y >= 0 && y < wHeight && x >= 0 && x < wWidth) {
-			scr_Buff[(y * wWidth) + x] = color;
-		}
+void gfx::Circle(int x0, int y0, int radius, bgra8 color)
+{
+	if (radius <= 0)return;
 
-		e2 = 2 * err;
+	circle2d c = { x0, y0, radius, color };
+	raster_Circle(c, 0, wHeight);
+}
 
-		if (e2 >= dy) {
-			err += dy;
-			x += sx;
-		}
-		if (e2 <= dx) {
-			err += dx;
-			y += sy;
-		}
-	}
+static inline int out_Code(double x, double y, double xmax, double ymax)
+{
+	int code = 0;
+	if (x < 0.0) code |= 1;
+	else if (x > xmax) code |= 2;
+	if (y < 0.0) code |= 4;
+	else if (y > ymax) code |= 8;
+	return code;
 }
 
-void gfx::Circle(int x0, int y0, int radius, bgra8 color)
+// Cohen-Sutherland against the screen; false when nothing is left to draw
+bool gfx::clip_Line(line2d& ln)
 {
-	if (radius <= 0 || x0 <= 0 || y0 <= 0)return;
+	double xmax = wWidth - 1, ymax = wHeight - 1;
+	double x1 = ln.x1, y1 = ln.y1, x2 = ln.x2, y2 = ln.y2;
+	int c1 = out_Code(x1, y1, xmax, ymax);
+	int c2 = out_Code(x2, y2, xmax, ymax);
+
+	while (c1 | c2) {
+		if (c1 & c2)return false;
+
+		int c = c1 ? c1 : c2;
+		double x, y;
+		if (c & 8) { x = x1 + (x2 - x1) * (ymax - y1) / (y2 - y1); y = ymax; }
+		else if (c & 4) { x = x1 - (x2 - x1) * y1 / (y2 - y1); y = 0.0; }
+		else if (c & 2) { y = y1 + (y2 - y1) * (xmax - x1) / (x2 - x1); x = xmax; }
+		else { y = y1 - (y2 - y1) * x1 / (x2 - x1); x = 0.0; }
+
+		if (c == c1) { x1 = x; y1 = y; c1 = out_Code(x1, y1, xmax, ymax); }
+		else { x2 = x; y2 = y; c2 = out_Code(x2, y2, xmax, ymax); }
+	}
 
-	int f = 1 - radius;
-	int ddF_x = 0;
-	int ddF_y = -2 * radius;
-	int x = 0;
-	int y = radius;
+	ln.x1 = min(max((int)floor(x1 + 0.5), 0), wWidth - 1);
+	ln.y1 = min(max((int)floor(y1 + 0.5), 0), wHeight - 1);
+	ln.x2 = min(max((int)floor(x2 + 0.5), 0), wWidth - 1);
+	ln.y2 = min(max((int)floor(y2 + 0.5), 0), wHeight - 1);
+	return true;
+}
 
-	scr_Buff[((y0 + radius) * wWidth) + x0] = color;
-	scr_Buff[((y0 - radius) * wWidth) + x0] = color;
-	scr_Buff[((y0)*wWidth) + x0 + radius] = color;
-	scr_Buff[((y0)*wWidth) + x0 - radius] = color;
+static inline int floor_Div(int a, int b)
+{
+	int q = a / b;
+	return q - ((a % b != 0) & ((a < 0) != (b < 0)));
+}
 
-	while (x < y) {
+static inline int ceil_Div(int a, int b)
+{
+	return -floor_Div(-a, b);
+}
 
-		if (f >= 0)
-		{
-			y--;
-			ddF_y += 2;
-			f += ddF_y;
+// Draws the rows [band_y0, band_y1) of an already clipped line. The minor coordinate is
+// y1 + floor((2*dy*t + dx) / (2*dx)) along the major axis, so every band produces exactly
+// the pixels a full-screen pass would, and the span inside the band is solved up front.
+// The columns are limited to [raster_x0, raster_x1) the same way.
+void gfx::raster_Line(const line2d& ln, int band_y0, int band_y1)
+{
+	int x1 = ln.x1, y1 = ln.y1, x2 = ln.x2, y2 = ln.y2;
+	bgra8 color = ln.color;
+
+	if (_abs_(x2 - x1) >= _abs_(y2 - y1)) {
+		if (x2 < x1) { _swap_(x1, x2); _swap_(y1, y2); }
+		int dx = x2 - x1, dy = y2 - y1;
+		if (dx == 0) {
+			if (y1 >= band_y0 && y1 < band_y1 && x1 >= raster_x0 && x1 < raster_x1) scr_Buff[(y1 * wWidth) + x1] = color;
+			return;
+		}
+
+		int lo = band_y0 - y1, hi = band_y1 - y1;
+		int xs = x1, xe = x2;
+		if (dy > 0) {
+			xs = max(xs, x1 + ceil_Div(2 * dx * lo - dx, 2 * dy));
+			xe = min(xe, x1 + floor_Div(2 * dx * hi - dx - 1, 2 * dy));
+		}
+		else if (dy < 0) {
+			xs = max(xs, x1 + ceil_Div(2 * dx * hi - dx - 1, 2 * dy));
+			xe = min(xe, x1 + floor_Div(2 * dx * lo - dx, 2 * dy));
+		}
+		else if (lo > 0 || hi <= 0)return;
+		xs = max(xs, raster_x0);
+		xe = min(xe, raster_x1 - 1);
+		if (xs > xe)return;
+
+		int den = 2 * dx, step = 2 * dy;
+		int num = step * (xs - x1) + dx;
+		int q = floor_Div(num, den);
+		int r = num - q * den;
+		int off = ((y1 + q) * wWidth) + xs;
+		int n = xe - xs + 1;
+
+		if (dy >= 0) {
+			for (int i = 0; i < n; i++) {
+				scr_Buff[off] = color;
+				r += step;
+				int c = r >= den;
+				r -= c * den;
+				off += 1 + c * wWidth;
+			}
+		}
+		else {
+			for (int i = 0; i < n; i++) {
+				scr_Buff[off] = color;
+				r += step;
+				int c = r < 0;
+				r += c * den;
+				off += 1 - c * wWidth;
+			}
+		}
+	}
+	else {
+		if (y2 < y1) { _swap_(x1, x2); _swap_(y1, y2); }
+		int dx = x2 - x1, dy = y2 - y1;
+
+		int ys = max(y1, band_y0), ye = min(y2, band_y1 - 1);
+
+		// rows whose pixel falls inside the scissor columns, as above with x and y swapped
+		int lo = raster_x0 - x1, hi = raster_x1 - x1;
+		if (dx > 0) {
+			ys = max(ys, y1 + ceil_Div(2 * dy * lo - dy, 2 * dx));
+			ye = min(ye, y1 + floor_Div(2 * dy * hi - dy - 1, 2 * dx));
+		}
+		else if (dx < 0) {
+			ys = max(ys, y1 + ceil_Div(2 * dy * hi - dy - 1, 2 * dx));
+			ye = min(ye, y1 + floor_Div(2 * dy * lo - dy, 2 * dx));
 		}
-		x++;
-		ddF_x += 2;
-		f += ddF_x + 1;
+		else if (lo > 0 || hi <= 0)return;
+		if (ys > ye)return;
+
+		int den = 2 * dy, step = 2 * dx;
+		int num = step * (ys - y1) + dy;
+		int q = floor_Div(num, den);
+		int r = num - q * den;
+		int off = (ys * wWidth) + x1 + q;
+		int n = ye - ys + 1;
+
+		if (dx >= 0) {
+			for (int i = 0; i < n; i++) {
+				scr_Buff[off] = color;
+				r += step;
+				int c = r >= den;
+				r -= c * den;
+				off += wWidth + c;
+			}
+		}
+		else {
+			for (int i = 0; i < n; i++) {
+				scr_Buff[off] = color;
+				r += step;
+				int c = r < 0;
+				r += c * den;
+				off += wWidth - c;
+			}
+		}
+	}
+}
+
+// Midpoint circle limited to the rows [band_y0, band_y1). Circles that sit wholly inside
+// the band and the screen skip the per-pixel test.
+void gfx::raster_Circle(const circle2d& c, int band_y0, int band_y1)
+{
+	int x0 = c.x, y0 = c.y, radius = c.radius;
+	bgra8 color = c.color;
+	if (radius < 0)return;
+	if (y0 + radius < band_y0 || y0 - radius >= band_y1)return;
+	if (x0 + radius < 0 || x0 - radius >= wWidth)return;
+
+	// the band can also sit entirely inside the ring
+	long long fx = max(_abs_((long long)x0), _abs_((long long)x0 - (wWidth - 1)));
+	long long fy = max(_abs_((long long)y0 - band_y0), _abs_((long long)y0 - (band_y1 - 1)));
+	if (fx * fx + fy * fy < ((long long)radius - 1) * ((long long)radius - 1) && radius > 1)return;
+
+	bool inside = x0 - radius >= 0 && x0 + radius < wWidth && y0 - radius >= band_y0 && y0 + radius < band_y1;
+
+	auto walk = [&](auto plot) {
+		int f = 1 - radius;
+		int ddF_x = 0;
+		int ddF_y = -2 * radius;
+		int x = 0;
+		int y = radius;
+
+		plot(x0, y0 + radius);
+		plot(x0, y0 - radius);
+		plot(x0 + radius, y0);
+		plot(x0 - radius, y0);
+
+		while (x < y) {
+			if (f >= 0) {
+				y--;
+				ddF_y += 2;
+				f += ddF_y;
+			}
+			x++;
+			ddF_x += 2;
+			f += ddF_x + 1;
+
+			plot(x0 + x, y0 + y);
+			plot(x0 - x, y0 + y);
+			plot(x0 + x, y0 - y);
+			plot(x0 - x, y0 - y);
+			plot(x0 + y, y0 + x);
+			plot(x0 - y, y0 + x);
+			plot(x0 + y, y0 - x);
+			plot(x0 - y, y0 - x);
+		}
+	};
+
+	if (inside) {
+		walk([&](int px, int py) { scr_Buff[(py * wWidth) + px] = color; });
+	}
+	else {
+		walk([&](int px, int py) {
+			if ((unsigned)px < (unsigned)wWidth && py >= band_y0 && py < band_y1)
+				scr_Buff[(py * wWidth) + px] = color;
+		});
+	}
+}
 
-		scr_Buff[((y0 + y) * wWidth) + (x0 + x)] = color;
-		scr_Buff[((y0 + y) * wWidth) + (x0 - x)] = color;
-		scr_Buff[((y0 - y) * wWidth) + (x0 + x)] = color;
-		scr_Buff[((y0 - y) * wWidth) + (x0 - x)] = color;
-		scr_Buff[((y0 + x) * wWidth) + (x0 + y)] = color;
-		scr_Buff[((y0 + x) * wWidth) + (x0 - y)] = color;
-		scr_Buff[((y0 - x) * wWidth) + (x0 + y)] = color;
-		scr_Buff[((y0 - x) * wWidth) + (x0 - y)] = color;
+void gfx::Draw_Lines(const line2d* lines, int count)
+{
+	if (count <= 0)return;
+	Flush_Draws();
 
+	clipped_lines.clear();
+	for (int i = 0; i < count; i++) {
+		line2d ln = lines[i];
+		if (clip_Line(ln)) clipped_lines.push_back(ln);
 	}
+	if (clipped_lines.empty())return;
+
+	// each worker owns a horizontal band of the rows being drawn, so no pixel is written by two threads
+	run_Workers([this](int id) {
+		int band_y0 = raster_y0 + (raster_y1 - raster_y0) * id / n_threads;
+		int band_y1 = raster_y0 + (raster_y1 - raster_y0) * (id + 1) / n_threads;
+		for (const line2d& ln : clipped_lines) {
+			if (max(ln.y1, ln.y2) < band_y0 || min(ln.y1, ln.y2) >= band_y1)continue;
+			raster_Line(ln, band_y0, band_y1);
+		}
+	});
+}
+
+void gfx::Draw_Circles(const circle2d* circles, int count)
+{
+	if (count <= 0)return;
+	Flush_Draws();
+
+	run_Workers([this, circles, count](int id) {
+		int band_y0 = wHeight * id / n_threads;
+		int band_y1 = wHeight * (id + 1) / n_threads;
+		for (int i = 0; i < count; i++)
+			raster_Circle(circles[i], band_y0, band_y1);
+	});
 }
 
 void gfx::Triangle(const int& x1, const int& y1, const int& x2, const int& y2, const int& x3, const int& y3, const bgra8& color)
@@ -190,54 +1289,55 @@ void gfx::Triangle(const int& x1, const int& y1, const int& x2, const int& y2, c
 
 void gfx::init_font_system()
 {
-	capital_alphs = new bool[26 * 35 * 35];
-	smaller_alphs = new bool[26 * 35 * 35];
-	digits = new bool[10 * 35 * 35];
-
-	FILE* f_sheet_cap = fopen("dpnds/a-z_capital.sht", "rb");
-	FILE* f_sheet_sma = fopen("dpnds/a-z_smaller.sht", "rb");
-	char* temp_buff = new char[35 * 35];
-
-	for (int k = 0; k < 26; k++) {
-		fread(temp_buff, sizeof(char), 35 * 35, f_sheet_cap);
-		for (int i = 0; i < 35; i++)
-			for (int j = 0; j < 35; j++) {
-				if (temp_buff[i * 35 + j] == 'Y')
-					capital_alphs[k * 35 * 35 + i * 35 + j] = true;
-				else
-					capital_alphs[k * 35 * 35 + i * 35 + j] = false;
-			}
+#ifdef EMBEDDED_FONT
+	glyph_rows = embedded_glyph_rows;
+#else
+	if (!set_Font_Path("dpnds")) glyph_rows = nullptr;
+#endif
+}
 
-		fread(temp_buff, sizeof(char), 35 * 35, f_sheet_sma);
-		for (int i = 0; i < 35; i++)
-			for (int j = 0; j < 35; j++) {
-				if (temp_buff[i * 35 + j] == 'Y')
-					smaller_alphs[k * 35 * 35 + i * 35 + j] = true;
-				else
-					smaller_alphs[k * 35 * 35 + i * 35 + j] = false;
+bool gfx::set_Font_Path(const char* dir)
+{
+	// one 64-bit mask per glyph row, bit j => column j. Glyph order: a-z, A-Z, 0-9
+	const char* sheets[3] = { "a-z_smaller.sht", "a-z_capital.sht", "dgt_punc.sht" };
+	const int count[3] = { 26, 26, 10 };
+	uint64_t* rows = new uint64_t[NUM_GLYPHS * GLYPH_SIZE];
+	char temp_buff[GLYPH_SIZE * GLYPH_SIZE];
+	int glyph = 0;
+
+	for (int s = 0; s < 3; s++) {
+		std::string path = std::string(dir) + "/" + sheets[s];
+		FILE* f_sheet = fopen(path.c_str(), "rb");
+		if (!f_sheet) {
+			delete[] rows;
+			return false;
+		}
+		for (int k = 0; k < count[s]; k++, glyph++) {
+			if (fread(temp_buff, sizeof(char), GLYPH_SIZE * GLYPH_SIZE, f_sheet) != GLYPH_SIZE * GLYPH_SIZE) {
+				fclose(f_sheet);
+				delete[] rows;
+				return false;
 			}
-	}
-	fclose(f_sheet_cap); fclose(f_sheet_sma);
-
-	FILE* f_sheet_dgt = fopen("dpnds/dgt_punc.sht", "rb");
-	for (int k = 0; k < 10; k++) {
-		fread(temp_buff, sizeof(char), 35 * 35, f_sheet_dgt);
-		for (int i = 0; i < 35; i++)
-			for (int j = 0; j < 35; j++) {
-				if (temp_buff[i * 35 + j] == 'Y')
-					digits[k * 35 * 35 + i * 35 + j] = true;
-				else
-					digits[k * 35 * 35 + i * 35 + j] = false;
+			for (int i = 0; i < GLYPH_SIZE; i++) {
+				uint64_t row = 0;
+				for (int j = 0; j < GLYPH_SIZE; j++)
+					if (temp_buff[i * GLYPH_SIZE + j] == 'Y') row |= (1ull << j);
+				rows[glyph * GLYPH_SIZE + i] = row;
 			}
+		}
+		fclose(f_sheet);
 	}
-	fclose(f_sheet_dgt);
-	delete[] temp_buff;
+
+	delete[] font_file_rows;
+	font_file_rows = rows;
+	glyph_rows = font_file_rows;
+	return true;
 }
 
-void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
+int gfx::Textured_Triangle(bgra8* frame, float* depth, int x1, int y1, float u1, float v1, float w1,
 	int x2, int y2, float u2, float v2, float w2,
 	int x3, int y3, float u3, float v3, float w3,
-	float _If, float _I1, float _I2, float _I3)
+	float _If, float _I1, float _I2, float _I3, bgra8 light_col)
 {
 
 	if (y2 < y1)
@@ -263,11 +1363,12 @@ void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
 
 	
 
+	const Raster_Pass pass = raster_pass;
+	int covered = 0;
 	const int t_wd = obj_tex->i_width;
 	const int t_ht = obj_tex->i_height;
 	float dy1 = _abs_(y2 - y1);
 	float dy2 = _abs_(y3 - y1);
-	bgra8 light_col = light.get_Color();
 
 	float tex_w = 0;
 	float dx1_step = 0, dx2_step = 0,
@@ -297,7 +1398,7 @@ void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
 		dw1_step = (w2 - w1) / dy1;
 		
 
-		for (int i = (int)y1; i <= (int)y2; i++)
+		for (int i = max((int)y1, raster_y0); i <= min((int)y2, raster_y1 - 1); i++)
 		{	
 			int ax = x1 + (float)(i - y1) * dx1_step;
 			float tex_su = u1 + (float)(i - y1) * du1_step;
@@ -324,29 +1425,36 @@ void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
 			_Icx = (ix2 - ix1) / (bx - ax);
 			approx_I = ((bx - (ax - 1)) * ix1 + ((ax - 1) - ax) * ix2) / (bx - ax);
 
-			for (int j = ax; j < bx; j++)
+			// t is stepped as for the whole span, so pixels inside the scissor come out the same
+			int xs = max(ax, raster_x0), xe = min(bx, raster_x1);
+			if (xe > xs) covered += xe - xs;
+			for (int j = ax; j < min(xs, xe); j++) t += tstep;
+			for (int j = xs; j < xe; j++)
 			{
 				tex_w = (1.0f - t) * tex_sw + t * tex_ew;
 
 				int p_indx = i * wWidth + j;
-				int textur_x = (float)t_wd * (((1.0f - t) * tex_su + t * tex_eu) / tex_w);
-				int textur_y = (float)(t_ht - 1) * (((1.0f - t) * tex_sv + t * tex_ev) / tex_w);
-				int t_indx = (textur_y)*t_wd + textur_x;
 				/*approx_I += _Icx;
 				intensity = approx_I;*/
-				if (tex_w > zBuffer[p_indx])
+				if (pass == PASS_DEPTH) {
+					if (tex_w > depth[p_indx]) depth[p_indx] = tex_w;
+				}
+				else if (pass == PASS_EQUAL ? tex_w == depth[p_indx] : tex_w > depth[p_indx])
 				{
+					int textur_x = (float)t_wd * (((1.0f - t) * tex_su + t * tex_eu) / tex_w);
+					int textur_y = (float)(t_ht - 1) * (((1.0f - t) * tex_sv + t * tex_ev) / tex_w);
+					int t_indx = (textur_y)*t_wd + textur_x;
 					//scr_Buff[p_indx] = obj_tex->data[t_indx];
 					/*scr_Buff[p_indx].r = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;
 					scr_Buff[p_indx].g = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;
 					scr_Buff[p_indx].b = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;*/
 					rgb = (obj_tex->data[t_indx].r + light_col.r) / 2.0f * intensity;
-					scr_Buff[p_indx].r = rgb > 255 ? 255 : rgb;
+					frame[p_indx].r = rgb > 255 ? 255 : rgb;
 					rgb = (obj_tex->data[t_indx].g + light_col.g) / 2.0f * intensity;
-					scr_Buff[p_indx].g = rgb > 255 ? 255 : rgb;
+					frame[p_indx].g = rgb > 255 ? 255 : rgb;
 					rgb = (obj_tex->data[t_indx].b + light_col.b) / 2.0f * intensity;
-					scr_Buff[p_indx].b = rgb > 255 ? 255 : rgb;
-					zBuffer[p_indx] = tex_w;
+					frame[p_indx].b = rgb > 255 ? 255 : rgb;
+					depth[p_indx] = tex_w;
 				}
 				t += tstep; 
 			}
@@ -367,7 +1475,7 @@ void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
 		dv1_step = (v3 - v2) / dy1;
 		dw1_step = (w3 - w2) / dy1;
 
-		for (int i = (int)y2; i <= (int)y3; i++)
+		for (int i = max((int)y2, raster_y0); i <= min((int)y3, raster_y1 - 1); i++)
 		{
 			int ax = x2 + (float)(i - y2) * dx1_step;
 			int bx = x1 + (float)(i - y1) * dx2_step;
@@ -396,37 +1504,44 @@ void gfx::Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
 			_Icx = (ix2 - ix1) / (bx - ax);
 			approx_I = ((bx - (ax - 1)) * ix1 + ((ax - 1) - ax) * ix2) / (bx - ax);
 
-			for (int j = ax; j < bx; j++)
+			int xs = max(ax, raster_x0), xe = min(bx, raster_x1);
+			if (xe > xs) covered += xe - xs;
+			for (int j = ax; j < min(xs, xe); j++) t += tstep;
+			for (int j = xs; j < xe; j++)
 			{
 				tex_w = (1.0f - t) * tex_sw + t * tex_ew;
 
 				int p_indx = i * wWidth + j;
-				int textur_x = (float)t_wd * (((1.0f - t) * tex_su + t * tex_eu) / tex_w);
-				int textur_y = (float)(t_ht - 1) * (((1.0f - t) * tex_sv + t * tex_ev) / tex_w);
-				int t_indx = (textur_y)*t_wd + textur_x;
 				/*approx_I += _Icx;
 				intensity = approx_I;*/
-				if (tex_w > zBuffer[p_indx])
+				if (pass == PASS_DEPTH) {
+					if (tex_w > depth[p_indx]) depth[p_indx] = tex_w;
+				}
+				else if (pass == PASS_EQUAL ? tex_w == depth[p_indx] : tex_w > depth[p_indx])
 				{
+					int textur_x = (float)t_wd * (((1.0f - t) * tex_su + t * tex_eu) / tex_w);
+					int textur_y = (float)(t_ht - 1) * (((1.0f - t) * tex_sv + t * tex_ev) / tex_w);
+					int t_indx = (textur_y)*t_wd + textur_x;
 					//scr_Buff[p_indx] = obj_tex->data[t_indx];
 					/*scr_Buff[p_indx].r = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;
 					scr_Buff[p_indx].g = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;
 					scr_Buff[p_indx].b = 255.0 * intensity > 255 ? 255 : 255.0 * intensity;*/
 					rgb = (obj_tex->data[t_indx].r + light_col.r) / 2.0f * intensity;
-					scr_Buff[p_indx].r = rgb > 255 ? 255 : rgb;
+					frame[p_indx].r = rgb > 255 ? 255 : rgb;
 					rgb = (obj_tex->data[t_indx].g + light_col.g) / 2.0f * intensity;
-					scr_Buff[p_indx].g = rgb > 255 ? 255 : rgb;
+					frame[p_indx].g = rgb > 255 ? 255 : rgb;
 					rgb = (obj_tex->data[t_indx].b + light_col.b) / 2.0f * intensity;
-					scr_Buff[p_indx].b = rgb > 255 ? 255 : rgb;
-					zBuffer[p_indx] = tex_w;
+					frame[p_indx].b = rgb > 255 ? 255 : rgb;
+					depth[p_indx] = tex_w;
 				}
 				t += tstep;
 			}
 		}
 	}
+	return covered;
 }
 
-void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int x3, int y3, float w3, float intensity, bgra8 color)
+int gfx::Solid_Triangle(bgra8* frame, float* depth, int x1, int y1, float w1, int x2, int y2, float w2, int x3, int y3, float w3, float intensity, bgra8 color, uint32_t vis_id)
 {
 	if (y2 < y1)
 	{
@@ -448,10 +1563,26 @@ void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int
 	
 	float dy1 = _abs_(y2 - y1);
 	float dy2 = _abs_(y3 - y1);
-	bgra8 light_col = light.get_Color();
-	unsigned char rgb = 0;
 
-	float tex_w = 0;
+	bgra8 shade;
+	shade.r = color.r * intensity > 255 ? 255 : color.r * intensity;
+	shade.g = color.g * intensity > 255 ? 255 : color.g * intensity;
+	shade.b = color.b * intensity > 255 ? 255 : color.b * intensity;
+
+	const Raster_Pass pass = raster_pass;
+	int covered = 0;
+	auto span = [&](int i, int ax, int n, float sw, float ew, float tstep) {
+		int p_indx = i * wWidth + ax;
+		int k0 = max(raster_x0 - ax, 0);
+		n = min(n, raster_x1 - ax);
+		if (n <= k0)return;
+		covered += n - k0;
+		if (pass == PASS_DEPTH) simd.depth_Span(&depth[p_indx], k0, n, sw, ew, tstep);
+		else if (pass == PASS_EQUAL) simd.solid_Span_Equal(&frame[p_indx], &depth[p_indx], k0, n, sw, ew, tstep, shade);
+		else if (pass == PASS_VISIBILITY) simd.id_Span(&vis_Buffer[p_indx], &depth[p_indx], k0, n, sw, ew, tstep, vis_id);
+		else simd.solid_Span(&frame[p_indx], &depth[p_indx], k0, n, sw, ew, tstep, shade);
+	};
+
 	float dx1_step = 0, dx2_step = 0,
 		dw1_step = 0, dw2_step = 0;
 
@@ -472,7 +1603,7 @@ void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int
 		dw1_step = (w2 - w1) / dy1;
 
 
-		for (int i = (int)y1; i <= (int)y2; i++)
+		for (int i = max((int)y1, raster_y0); i <= min((int)y2, raster_y1 - 1); i++)
 		{
 			int ax = x1 + (float)(i - y1) * dx1_step;
 			float tex_sw = w1 + (float)(i - y1) * dw1_step;
@@ -486,27 +1617,13 @@ void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int
 				tmp = tex_sw; tex_sw = tex_ew; tex_ew = tmp;
 			}
 			float tstep = 1.0f / (float)(bx - ax);
-			float t = 0.0f;
 
 			/*ix1 += _Ic1;
 			ix2 += _Ic2;
 			_Icx = (ix2 - ix1) / (bx - ax);
 			intensity = ((bx - (ax - 1)) * ix1 + ((ax - 1) - ax) * ix2) / (bx - ax);*/
 
-			for (int j = ax; j < bx; j++)
-			{
-				int p_indx = i * wWidth + j;
-				tex_w = (1.0f - t) * tex_sw + t * tex_ew;
-				//intensity += _Icx;
-				if (tex_w > zBuffer[p_indx])
-				{
-					scr_Buff[p_indx].r = color.r * intensity > 255 ? 255 : color.r * intensity;
-					scr_Buff[p_indx].g = color.g * intensity > 255 ? 255 : color.g * intensity;
-					scr_Buff[p_indx].b = color.b * intensity > 255 ? 255 : color.b * intensity;
-					zBuffer[p_indx] = tex_w;
-				}
-				t += tstep;
-			}
+			if (bx > ax) span(i, ax, bx - ax, tex_sw, tex_ew, tstep);
 
 		}
 	}
@@ -522,7 +1639,7 @@ void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int
 		dx1_step = (x3 - x2) / dy1;
 		dw1_step = (w3 - w2) / dy1;
 
-		for (int i = (int)y2; i <= (int)y3; i++)
+		for (int i = max((int)y2, raster_y0); i <= min((int)y3, raster_y1 - 1); i++)
 		{
 			int ax = x2 + (float)(i - y2) * dx1_step;
 			int bx = x1 + (float)(i - y1) * dx2_step;
@@ -538,307 +1655,1400 @@ void gfx::Solid_Triangle(int x1, int y1, float w1, int x2, int y2, float w2, int
 			}
 
 			float tstep = 1.0f / ((float)(bx - ax));
-			float t = 0.0f;
 
 			/*ix1 += _Ic1;
 			ix2 += _Ic2;
 			_Icx = (ix2 - ix1) / (bx - ax);
 			intensity = ((bx - (ax - 1)) * ix1 + ((ax - 1) - ax) * ix2) / (bx - ax);*/
 
-			for (int j = ax; j < bx; j++)
-			{
-				tex_w = (1.0f - t) * tex_sw + t * tex_ew;
-
-				int p_indx = i * wWidth + j;
-				//intensity += _Icx;
-				if (tex_w > zBuffer[p_indx])
-				{
-					scr_Buff[p_indx].r = color.r * intensity > 255 ? 255 : color.r * intensity;
-					scr_Buff[p_indx].g = color.g * intensity > 255 ? 255 : color.g * intensity;
-					scr_Buff[p_indx].b = color.b * intensity > 255 ? 255 : color.b * intensity;
-					zBuffer[p_indx] = tex_w;
-				}
-				t += tstep;
-			}
+			if (bx > ax) span(i, ax, bx - ax, tex_sw, tex_ew, tstep);
 		}
 	}
+	return covered;
 }
 
-bool gfx::Draw_obj(mesh3d* mesh, const mat4x4& mdl_mat, Draw_Type type)
+void gfx::Depth_Triangle(float* depth, int stride, int x1, int y1, float w1, int x2, int y2, float w2, int x3, int y3, float w3)
 {
-	model_mat = mdl_mat;
-	dtype = type;
-	obj_tex = mesh->mtexture;
-	int n_tris = mesh->get_num_Triangles();
+	if (y2 < y1) { std::swap(y1, y2); std::swap(x1, x2); std::swap(w1, w2); }
+	if (y3 < y1) { std::swap(y1, y3); std::swap(x1, x3); std::swap(w1, w3); }
+	if (y3 < y2) { std::swap(y2, y3); std::swap(x2, x3); std::swap(w2, w3); }
+
+	float dy1 = _abs_(y2 - y1);
+	float dy2 = _abs_(y3 - y1);
+
+	float dx1_step = 0, dx2_step = 0,
+		dw1_step = 0, dw2_step = 0;
+
+	if ((int)dy2) {
+		dx2_step = (x3 - x1) / dy2;
+		dw2_step = (w3 - w1) / dy2;
+	}
+
+	if ((int)dy1)
 	{
-		std::lock_guard<std::mutex> lk1(draw_lock);
-		th_data[0].tris_list = mesh->triangles_list;
-		th_data[0].f_normals = mesh->face_normals;
-		th_data[0].v_normals = mesh->vertex_normals;
-		th_data[0].n_triangles = n_tris / 2;
-		done = false;
-		ready = true;
+		dx1_step = (x2 - x1) / dy1;
+		dw1_step = (w2 - w1) / dy1;
+
+		for (int i = (int)y1; i <= (int)y2; i++)
+		{
+			int ax = x1 + (float)(i - y1) * dx1_step;
+			float tex_sw = w1 + (float)(i - y1) * dw1_step;
+			int bx = x1 + (float)(i - y1) * dx2_step;
+			float tex_ew = w1 + (float)(i - y1) * dw2_step;
+
+			if (ax > bx)
+			{
+				float tmp = ax; ax = bx; bx = tmp;
+				tmp = tex_sw; tex_sw = tex_ew; tex_ew = tmp;
+			}
+			float tstep = 1.0f / (float)(bx - ax);
+			if (bx > ax) simd.depth_Span(&depth[i * stride + ax], 0, bx - ax, tex_sw, tex_ew, tstep);
+		}
 	}
 
-	th_data[1].tris_list = &mesh->triangles_list[n_tris / 2];
-	th_data[1].f_normals = &mesh->face_normals[n_tris / 2];
-	th_data[1].v_normals = &mesh->vertex_normals[n_tris / 2];
-	th_data[1].n_triangles = n_tris / 2 + n_tris % 2;
+	dy1 = _abs_(y3 - y2);
+
+	if ((int)dy1)
+	{
+		if ((int)dy2) dx2_step = (x3 - x1) / dy2;
+		dx1_step = (x3 - x2) / dy1;
+		dw1_step = (w3 - w2) / dy1;
 
-	draw_cv.notify_one();
+		for (int i = (int)y2; i <= (int)y3; i++)
+		{
+			int ax = x2 + (float)(i - y2) * dx1_step;
+			int bx = x1 + (float)(i - y1) * dx2_step;
+			float tex_sw = w2 + (float)(i - y2) * dw1_step;
+			float tex_ew = w1 + (float)(i - y1) * dw2_step;
 
-	main_Rasterizer(1);
+			if (ax > bx)
+			{
+				float tmp = ax; ax = bx; bx = tmp;
+				tmp = tex_sw; tex_sw = tex_ew; tex_ew = tmp;
+			}
 
-	while (!done) {
-		//std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			float tstep = 1.0f / ((float)(bx - ax));
+			if (bx > ax) simd.depth_Span(&depth[i * stride + ax], 0, bx - ax, tex_sw, tex_ew, tstep);
+		}
 	}
-	ready = false;
-
-	return true;
 }
 
-void gfx::Draw_String(const char* str, int x, int y, bgra8 color)
+void gfx::set_Lights(plane_Light* light_p, int n_lights)
 {
-	if (str == nullptr)return;
-	int max_chars = (wWidth - 35) / 28;
+	light_list.resize(n_lights);
+	for (int l = 0; l < n_lights; l++) {
+		light_data& ld = light_list[l];
+		ld.position = light_p[l].get_Position();
+		ld.direction = light_p[l].get_Normal();
+		normalise_vec3(ld.direction);
+		ld.color = light_p[l].get_Color();
+		ld.power = light_p[l].get_Power();
+		ld.radius = light_p[l].get_Radius();
+	}
+}
 
-	for (int n = 0, nc = 0; str[nc] != '\0'; n++, nc++) {
-		/*if (nc == (max_chars - 1)) {
-			y += 35;
-			n = 0;
-		}*/
-		if ((x + n * 28) >= (wWidth - 35)) {
-			y += 35; n = 0; x = 10;
-		}
-		if (str[nc] >= 97 && str[nc] <= 122) {
-			int k = (int)str[nc] - 97;
-			for (int i = 0; i < 35; i++)
-				for (int j = 0; j < 35; j++)
-					if (smaller_alphs[k * 35 * 35 + i * 35 + j])
-						scr_Buff[(i + y) * wWidth + j + n * 25 + x] = color;
-		}
-		else if (str[nc] >= 65 && str[nc] <= 90) {
-			int k = (int)str[nc] - 65;
-			for (int i = 0; i < 35; i++)
-				for (int j = 0; j < 35; j++)
-					if (capital_alphs[k * 35 * 35 + i * 35 + j])
-						scr_Buff[(i + y) * wWidth + j + n * 25 + x] = color;
-		}
-		else if (str[nc] >= 48 && str[nc] <= 57) {
-			int k = (int)str[nc] - 48;
-			for (int i = 0; i < 35; i++)
-				for (int j = 0; j < 35; j++)
-					if (digits[k * 35 * 35 + i * 35 + j])
-						scr_Buff[(i + y) * wWidth + j + n * 20 + x] = color;
-		}
-		else {
+bool gfx::Draw_Scene(scene3d* scene)
+{
+	if (scene == nullptr)return false;
 
-		}
+	std::vector<int> visible;
+	scene->query_Frustum(camera_mat * projection_mat, visible);
+	for (int id : visible) {
+		const mesh_instance* inst = scene->get_Instance(id);
+		if (!Draw_obj(inst->mesh, inst->world_mat, inst->type))return false;
 	}
+	return true;
 }
 
-void gfx::Draw_Image(const Texture* img, int x, int y)
+bool gfx::Draw_obj(mesh3d* mesh, const mat4x4& mdl_mat, Draw_Type type)
 {
-	if (img == nullptr)return;
-	if ((img->i_width + x) >= wWidth || (img->i_height + y) >= wHeight)return ;
+	if (!mesh->is_Ready())return true;
+	if (occ_enabled && is_Occluded(mesh, mdl_mat))return true;
 
-	int wd = img->i_width; int ht = img->i_height;
-	for (int i = 0; i < ht; i++)
-		for (int j = 0; j < wd; j++)
-			scr_Buff[(i+y) * wWidth + j + x] = img->data[i * wd + j];
+	// queued as render_Draw will draw it, so a texture finishing its load counts as a change
+	if (type == TEXTURED && (mesh->mtexture == nullptr || !mesh->mtexture->is_Ready())) type = SOLID;
+
+	if (render_mode == RENDER_INCREMENTAL && !inc_open) {
+		// drawn after this frame's flush, so it is not part of the kept image
+		inc_valid = false;
+		render_Draw(mesh, mdl_mat, type);
+		return true;
+	}
+	if (render_mode != RENDER_FORWARD) {
+		int first_light = queue_Lights();
+		draw_queue.push_back({ mesh, mdl_mat, camera_mat, projection_mat, camera_pos, type, first_light, (int)light_list.size() });
+		return true;
+	}
+	render_Draw(mesh, mdl_mat, type);
+	return true;
 }
 
-void gfx::pooled_draw(const int id)
+// Depth prepass: every queued opaque draw is rasterized into zBuffer alone, then all of
+// them run again shading only where their depth equals the stored one, so each pixel is
+// shaded once. Wireframes have no depth and are drawn in the second pass, in submission order.
+// Visibility buffer: the opaque draws write triangle ids, resolve_Visibility shades them,
+// and the wireframes are drawn over the result. Sort-last works the same way, with the
+// workers shading into their own buffers and composite_Private merging them.
+void gfx::Flush_Draws()
 {
-	while (kp_running) {
-		std::unique_lock<std::mutex> unq_lock(draw_lock);
-		draw_cv.wait(unq_lock, [=] {return (ready == true || kp_running == false); });
-		unq_lock.unlock();
+	if (render_mode == RENDER_INCREMENTAL) {
+		if (inc_open) flush_Incremental();
+		return;
+	}
+	if (draw_queue.empty())return;
+
+	// swapped out so the 2D calls made while drawing don't flush again
+	std::vector<draw_record> draws;
+	std::vector<light_data> lights;
+	draws.swap(draw_queue);
+	lights.swap(queued_lights);
+	mat4x4 frame_cam = camera_mat;
+	mat4x4 frame_proj = projection_mat;
+	vec3d frame_pos = camera_pos;
+	std::vector<light_data> frame_lights;
+	frame_lights.swap(light_list);
+
+	if (render_mode != RENDER_DEPTH_PREPASS) {
+		if (render_mode == RENDER_VISIBILITY_BUFFER) {
+			memset(vis_Buffer, 0xFF, sizeof(uint32_t) * wHeight * wWidth);
+			for (std::vector<vis_tri>& v : vis_tris) v.clear();
+			raster_pass = PASS_VISIBILITY;
+		}
+		else {
+			// cleared by their own worker, so the pages end up near the thread using them
+			run_Workers([this](int id) {
+				sl_color[id].resize(wWidth * wHeight);
+				sl_depth[id].assign(wWidth * wHeight, 0.0f);
+			});
+			raster_pass = PASS_PRIVATE;
+		}
 
-		if (!kp_running) {
-			done = true;
-			return;
+		for (const draw_record& d : draws) {
+			if (d.type == WIRE_FRAME)continue;
+			replay_Draw(d, lights);
+		}
+		if (render_mode == RENDER_VISIBILITY_BUFFER) resolve_Visibility();
+		else composite_Private();
+
+		raster_pass = PASS_FULL;
+		for (const draw_record& d : draws) {
+			if (d.type != WIRE_FRAME)continue;
+			replay_Draw(d, lights);
+		}
+	}
+	else {
+		raster_pass = PASS_DEPTH;
+		for (const draw_record& d : draws) {
+			if (d.type == WIRE_FRAME)continue;
+			replay_Draw(d, lights);
+		}
+		raster_pass = PASS_EQUAL;
+		for (const draw_record& d : draws) {
+			replay_Draw(d, lights);
 		}
+		raster_pass = PASS_FULL;
+	}
 
-		main_Rasterizer(id);
+	camera_mat = frame_cam;
+	camera_pos = frame_pos;
+	projection_mat = frame_proj;
+	light_list.swap(frame_lights);
+	draws.clear();
+	draw_queue.swap(draws);
+	lights.clear();
+	queued_lights.swap(lights);
+}
 
-		done = true;
-		ready = false;
+// Offset of a copy of light_list in queued_lights. Consecutive draws under the same lights share one.
+int gfx::queue_Lights()
+{
+	int n = (int)light_list.size();
+	if (!draw_queue.empty()) {
+		const draw_record& last = draw_queue.back();
+		if (last.n_lights == n && (n == 0 || memcmp(&queued_lights[last.first_light], light_list.data(), sizeof(light_data) * n) == 0))
+			return last.first_light;
 	}
+	int first = (int)queued_lights.size();
+	queued_lights.insert(queued_lights.end(), light_list.begin(), light_list.end());
+	return first;
 }
 
-void gfx::main_Rasterizer(const int id)
+void gfx::replay_Draw(const draw_record& d, const std::vector<light_data>& lights)
 {
-	mat4x4 mdl_mat = model_mat;
-	Transpose_mat4(mdl_mat);
-	mat_tri t_projected, t_transformed, t_viewed;
-	vec3d cam_ray, f_normal;
-	vec3d vn[3];
-	vec3d light_ray = light.get_Normal(), light_pos = light.get_Position(); float light_pow = light.get_Power();
-	normalise_vec3(light_ray);
-	mat_tri clipped[2];
-	std::deque<mat_tri> clip_t;
-	__m128 _ones = _mm_set1_ps(1.0);
-	__m128 _scl = _mm_set_ps(1.0, 1.0, 0.5 * wHeight, 0.5 * wWidth);
-	int n_triangles = th_data[id].n_triangles;
+	camera_mat = d.camera_mat; camera_pos = d.camera_pos;
+	projection_mat = d.projection_mat;
+	light_list.assign(lights.begin() + d.first_light, lights.begin() + d.first_light + d.n_lights);
+	render_Draw(d.mesh, d.model_mat, d.type);
+}
 
-	for (int i = 0; i < n_triangles; i++) {
-		tri_mat4_mult(th_data[id].tris_list[i], model_mat, t_transformed);
-		vec4_mat4_mult(th_data[id].f_normals[i], mdl_mat, f_normal);
+void gfx::set_Render_Mode(Render_Mode mode)
+{
+	Flush_Draws();
+	render_mode = mode;
+	inc_open = false;
+	inc_valid = false;
+}
 
-		cam_ray.x = t_transformed.mat[0][X] - camera_pos.x;
-		cam_ray.y = t_transformed.mat[0][Y] - camera_pos.y;
-		cam_ray.z = t_transformed.mat[0][Z] - camera_pos.z;
+void gfx::ClearScreen(bgra8 color)
+{
+	float lumen = color.r * 0.29 + color.g * 0.58 + color.b * 0.13;
+	memset(occ_Buffer, 0, sizeof(float) * occ_Height * occ_Width);
+	occ_dirty = false;
+	draw_queue.clear();
+	queued_lights.clear();
+	for (frame_arena& a : th_arena) a.reset();
+	memset(th_stats, 0, sizeof(th_stats));
+
+	// the incremental flush clears only the rows it draws again
+	if (render_mode == RENDER_INCREMENTAL) {
+		inc_clear = (unsigned char)lumen;
+		inc_open = true;
+		return;
+	}
+	memset(scr_Buff, (unsigned char)lumen, sizeof(bgra8) * wHeight * wWidth);
+	memset(zBuffer, 0, sizeof(float) * wHeight * wWidth);
+	inc_valid = false;
+}
 
-		if (dot_vec3(f_normal, cam_ray) < 0.0f) {
-			
-			vec4_mat4_mult(th_data[id].v_normals[i].v1, mdl_mat, vn[0]);
-			vec4_mat4_mult(th_data[id].v_normals[i].v2, mdl_mat, vn[1]);
-			vec4_mat4_mult(th_data[id].v_normals[i].v3, mdl_mat, vn[2]);
-			normalise_vec3(vn[0]); normalise_vec3(vn[1]); normalise_vec3(vn[2]);
-			vec3d centriod;
-			centriod.x = (t_transformed.mat[0][0] + t_transformed.mat[1][0] + t_transformed.mat[2][0]) / 3.0f;
-			centriod.y = (t_transformed.mat[0][1] + t_transformed.mat[1][1] + t_transformed.mat[2][1]) / 3.0f;
-			centriod.z = (t_transformed.mat[0][2] + t_transformed.mat[1][2] + t_transformed.mat[2][2]) / 3.0f;
-			
-			float vi1 = (dot_vec3(vn[0], light_ray) * light_pow) / (12.5663 * sqrd_distance({ t_transformed.mat[0][0], t_transformed.mat[0][1] ,t_transformed.mat[0][2] ,0 }, light_pos));
-			float vi2 = (dot_vec3(vn[1], light_ray) * light_pow) / (12.5663 * sqrd_distance({ t_transformed.mat[1][0], t_transformed.mat[1][1] ,t_transformed.mat[1][2] ,0 }, light_pos));
-			float vi3 = (dot_vec3(vn[2], light_ray) * light_pow) / (12.5663 * sqrd_distance({ t_transformed.mat[2][0], t_transformed.mat[2][1] ,t_transformed.mat[2][2] ,0 }, light_pos));
-			
-			float brightness = (dot_vec3(f_normal, light_ray) * light_pow) / (12.5663 * sqrd_distance(centriod, light_pos));
-			brightness = max(brightness, 0);
-			
+// Screen pixels a draw can touch, from its mesh's bounding box. A box reaching past the
+// near plane can cover anything once clipped, so it gets the whole screen.
+screen_rect gfx::draw_Rect(const draw_record& d)
+{
+	screen_rect r = { 0, 0, wWidth, wHeight };
+	mat4x4 mv = d.model_mat * d.camera_mat;
+	const mat4x4& proj = d.projection_mat;
+	float lx = FLT_MAX, hx = -FLT_MAX, ly = FLT_MAX, hy = -FLT_MAX;
+	for (int c = 0; c < 8; c++) {
+		vec3d p = { (c & 1) ? d.mesh->bb_max.x : d.mesh->bb_min.x,
+			(c & 2) ? d.mesh->bb_max.y : d.mesh->bb_min.y,
+			(c & 4) ? d.mesh->bb_max.z : d.mesh->bb_min.z, 1.0f };
+		float vx = p.x * mv.mat[0][0] + p.y * mv.mat[1][0] + p.z * mv.mat[2][0] + mv.mat[3][0];
+		float vy = p.x * mv.mat[0][1] + p.y * mv.mat[1][1] + p.z * mv.mat[2][1] + mv.mat[3][1];
+		float vz = p.x * mv.mat[0][2] + p.y * mv.mat[1][2] + p.z * mv.mat[2][2] + mv.mat[3][2];
+		if (vz < 1.0f)return r;
+		float cx = vx * proj.mat[0][0] + vy * proj.mat[1][0] + vz * proj.mat[2][0] + proj.mat[3][0];
+		float cy = vx * proj.mat[0][1] + vy * proj.mat[1][1] + vz * proj.mat[2][1] + proj.mat[3][1];
+		float cw = vx * proj.mat[0][3] + vy * proj.mat[1][3] + vz * proj.mat[2][3] + proj.mat[3][3];
+		float sx = (cx / cw + 1.0f) * 0.5f * wWidth;
+		float sy = (cy / cw + 1.0f) * 0.5f * wHeight;
+		lx = min(lx, sx); hx = max(hx, sx);
+		ly = min(ly, sy); hy = max(hy, sy);
+	}
+	// a pixel of margin for the truncation in the rasterizers
+	r.x0 = min(max((int)floorf(lx) - 1, 0), wWidth);
+	r.x1 = min(max((int)ceilf(hx) + 2, 0), wWidth);
+	r.y0 = min(max((int)floorf(ly) - 1, 0), wHeight);
+	r.y1 = min(max((int)ceilf(hy) + 2, 0), wHeight);
+	return r;
+}
 
-			tri_mat4_mult(t_transformed, camera_mat, t_viewed);
-			t_viewed.tex_mat[0] = th_data[id].tris_list[i].tex_mat[0];
-			t_viewed.tex_mat[1] = th_data[id].tris_list[i].tex_mat[1];
-			t_viewed.tex_mat[2] = th_data[id].tris_list[i].tex_mat[2];
+static inline bool rects_Overlap(const screen_rect& a, const screen_rect& b)
+{
+	return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
 
-			int ntri_clipped = 0;
-			ntri_clipped = fnear_Clipping(1.0f, t_viewed, clipped[0], clipped[1]);
+// Compares the frame's draws with the last frame's, index by index. The old and new bounds of
+// every draw that differs are cleared and all draws reaching them are rasterized again,
+// scissored to those pixels. Everything else comes from inc_color.
+void gfx::flush_Incremental()
+{
+	inc_open = false;
+	std::vector<draw_record> draws;
+	std::vector<light_data> lights;
+	draws.swap(draw_queue);
+	lights.swap(queued_lights);
+
+	bool full = !inc_valid || inc_clear != inc_prev_clear;
+
+	std::vector<screen_rect> dirty;
+	if (full) dirty.push_back({ 0, 0, wWidth, wHeight });
+	else {
+		size_t n = max(draws.size(), inc_draws.size());
+		for (size_t i = 0; i < n; i++) {
+			const draw_record* now = i < draws.size() ? &draws[i] : nullptr;
+			const draw_record* was = i < inc_draws.size() ? &inc_draws[i] : nullptr;
+			if (now && was && now->mesh == was->mesh && now->type == was->type
+				&& memcmp(&now->model_mat, &was->model_mat, sizeof(mat4x4)) == 0
+				&& memcmp(&now->camera_mat, &was->camera_mat, sizeof(mat4x4)) == 0
+				&& memcmp(&now->camera_pos, &was->camera_pos, sizeof(vec3d)) == 0
+				&& memcmp(&now->projection_mat, &was->projection_mat, sizeof(mat4x4)) == 0
+				&& now->n_lights == was->n_lights
+				&& (now->n_lights == 0 || memcmp(&lights[now->first_light], &inc_lights[was->first_light], sizeof(light_data) * now->n_lights) == 0))continue;
+
+			for (const draw_record* d : { now, was }) {
+				if (!d)continue;
+				screen_rect r = draw_Rect(*d);
+				if (r.x1 > r.x0 && r.y1 > r.y0) dirty.push_back(r);
+			}
+		}
+	}
 
-			for (int n = 0; n < ntri_clipped; n++) {
+	// overlapping rectangles are merged into their bounds until none overlap, so no pixel is drawn twice
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t i = 0; i < dirty.size(); i++) {
+			for (size_t j = i + 1; j < dirty.size(); j++) {
+				if (!rects_Overlap(dirty[i], dirty[j]))continue;
+				dirty[i] = { min(dirty[i].x0, dirty[j].x0), min(dirty[i].y0, dirty[j].y0),
+					max(dirty[i].x1, dirty[j].x1), max(dirty[i].y1, dirty[j].y1) };
+				dirty.erase(dirty.begin() + j);
+				merged = true;
+				j = i;
+			}
+		}
+	}
 
-				tri_mat4_mult(clipped[n], projection_mat, t_projected);
-				t_projected.tex_mat[0] = clipped[n].tex_mat[0];
-				t_projected.tex_mat[1] = clipped[n].tex_mat[1];
-				t_projected.tex_mat[2] = clipped[n].tex_mat[2];
-
-				_mm_storeu_ps(&t_projected.tex_mat[0].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[0].u), _mm_set1_ps(t_projected.mat[0][3])));
-				_mm_storeu_ps(&t_projected.tex_mat[1].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[1].u), _mm_set1_ps(t_projected.mat[1][3])));
-				_mm_storeu_ps(&t_projected.tex_mat[2].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[2].u), _mm_set1_ps(t_projected.mat[2][3])));
-
-				_mm_storeu_ps(&t_projected.mat[0][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[0][0]), _mm_set1_ps(t_projected.mat[0][3])), _ones), _scl));
-				_mm_storeu_ps(&t_projected.mat[1][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[1][0]), _mm_set1_ps(t_projected.mat[1][3])), _ones), _scl));
-				_mm_storeu_ps(&t_projected.mat[2][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[2][0]), _mm_set1_ps(t_projected.mat[2][3])), _ones), _scl));
-
-
-				clip_t.push_back(t_projected);
-				int new_tris = 1;
-				for (int p = 0; p < 4; p++) {
-					int n_tris = 0;
-
-					while (new_tris > 0) {
-						mat_tri test = clip_t.front();
-						clip_t.pop_front();
-						new_tris--;
-
-						switch (p) {
-						case 0: { n_tris = top_Clipping(test, clipped[0], clipped[1]); break; }
-						case 1: { n_tris = bottom_Clipping(wHeight - 1.0f, test, clipped[0], clipped[1]); break; }
-						case 2: { n_tris = left_Clipping(test, clipped[0], clipped[1]); break; }
-						case 3: { n_tris = right_Clipping(wWidth - 1.0f, test, clipped[0], clipped[1]); break; }
-						}
+	// 2D drawn over the last frame, or a Submit_Frame swap, left scr_Buff without the 3D image
+	if (!full) memcpy(scr_Buff, inc_color, sizeof(bgra8) * wHeight * wWidth);
+
+	mat4x4 frame_cam = camera_mat;
+	mat4x4 frame_proj = projection_mat;
+	vec3d frame_pos = camera_pos;
+	std::vector<light_data> frame_lights;
+	frame_lights.swap(light_list);
+	const bgra8 clear_px = { inc_clear, inc_clear, inc_clear, inc_clear };
+	for (const screen_rect& r : dirty) {
+		int w = r.x1 - r.x0;
+		for (int y = r.y0; y < r.y1; y++) {
+			std::fill_n(&scr_Buff[y * wWidth + r.x0], w, clear_px);
+			memset(&zBuffer[y * wWidth + r.x0], 0, sizeof(float) * w);
+		}
+		raster_x0 = r.x0;
+		raster_x1 = r.x1;
+		raster_y0 = r.y0;
+		raster_y1 = r.y1;
+		for (const draw_record& d : draws) {
+			if (!rects_Overlap(draw_Rect(d), r))continue;
+			replay_Draw(d, lights);
+		}
+		for (int y = r.y0; y < r.y1; y++)
+			memcpy(&inc_color[y * wWidth + r.x0], &scr_Buff[y * wWidth + r.x0], sizeof(bgra8) * w);
+	}
+	raster_x0 = 0;
+	raster_x1 = wWidth;
+	raster_y0 = 0;
+	raster_y1 = wHeight;
+	camera_mat = frame_cam;
+	camera_pos = frame_pos;
+	projection_mat = frame_proj;
+	light_list.swap(frame_lights);
+
+	inc_draws.swap(draws);
+	inc_lights.swap(lights);
+	inc_prev_clear = inc_clear;
+	inc_valid = true;
+}
 
-						for (int ww = 0; ww < n_tris; ww++)
-							clip_t.push_back(clipped[ww]);
-					}
-					new_tris = clip_t.size();
-				}
-				int clip_t_size = clip_t.size();
-				for (int it = 0; it < clip_t_size; it++) {
-
-					switch (dtype) {
-					case WIRE_FRAME: {
-						Triangle(
-							(int)clip_t[it].mat[0][X], (int)clip_t[it].mat[0][Y],
-							(int)clip_t[it].mat[1][X], (int)clip_t[it].mat[1][Y],
-							(int)clip_t[it].mat[2][X], (int)clip_t[it].mat[2][Y], { 250,250,250,0 });
-						break; }
-
-					case SOLID: {
-						Solid_Triangle(
-							clip_t[it].mat[0][X], clip_t[it].mat[0][Y], clip_t[it].tex_mat[0].w,
-							clip_t[it].mat[1][X], clip_t[it].mat[1][Y], clip_t[it].tex_mat[1].w,
-							clip_t[it].mat[2][X], clip_t[it].mat[2][Y], clip_t[it].tex_mat[2].w,
-							brightness, { 250,250,250,0 });
-						break; }
-
-					case TEXTURED: {
-						Textured_Triangle(
-							(int)clip_t[it].mat[0][X], clip_t[it].mat[0][Y], clip_t[it].tex_mat[0].u, clip_t[it].tex_mat[0].v, clip_t[it].tex_mat[0].w,
-							clip_t[it].mat[1][X], clip_t[it].mat[1][Y], clip_t[it].tex_mat[1].u, clip_t[it].tex_mat[1].v, clip_t[it].tex_mat[1].w,
-							clip_t[it].mat[2][X], clip_t[it].mat[2][Y], clip_t[it].tex_mat[2].u, clip_t[it].tex_mat[2].v, clip_t[it].tex_mat[2].w,
-							brightness, vi1, vi2, vi3);
-						break; }
+// Every covered pixel is shaded once from the triangle its id names. Rows go out in bands
+// of RESOLVE_ROWS from a shared counter, so the workers finish together however the
+// geometry is spread over the screen.
+void gfx::resolve_Visibility()
+{
+	std::atomic<int> next_band(0);
+	run_Workers([this, &next_band](int) {
+		for (int y0 = next_band++ * RESOLVE_ROWS; y0 < wHeight; y0 = next_band++ * RESOLVE_ROWS) {
+			int y1 = min(y0 + RESOLVE_ROWS, wHeight);
+			for (int i = y0; i < y1; i++) {
+				const uint32_t* ids = &vis_Buffer[i * wWidth];
+				bgra8* row = &scr_Buff[i * wWidth];
+				for (int j = 0; j < wWidth; j++) {
+					if (ids[j] == VIS_EMPTY)continue;
+					const vis_tri& vt = vis_tris[ids[j] >> VIS_THREAD_SHIFT][ids[j] & VIS_INDEX_MASK];
+					if (vt.tex == nullptr) {
+						row[j].r = vt.color.r; row[j].g = vt.color.g; row[j].b = vt.color.b;
+						continue;
 					}
 
+					float x = (float)j, y = (float)i;
+					float w = vt.w_plane[0] * x + vt.w_plane[1] * y + vt.w_plane[2];
+					float u = (vt.u_plane[0] * x + vt.u_plane[1] * y + vt.u_plane[2]) / w;
+					float v = (vt.v_plane[0] * x + vt.v_plane[1] * y + vt.v_plane[2]) / w;
+
+					// the planes are evaluated at pixel corners, which can land just outside the triangle
+					const Texture* tex = vt.tex;
+					int textur_x = min(max((int)((float)tex->i_width * u), 0), tex->i_width - 1);
+					int textur_y = min(max((int)((float)(tex->i_height - 1) * v), 0), tex->i_height - 1);
+					const bgra8& texel = tex->data[textur_y * tex->i_width + textur_x];
+					float rgb = (texel.r + vt.color.r) / 2.0f * vt.intensity;
+					row[j].r = rgb > 255 ? 255 : rgb;
+					rgb = (texel.g + vt.color.g) / 2.0f * vt.intensity;
+					row[j].g = rgb > 255 ? 255 : rgb;
+					rgb = (texel.b + vt.color.b) / 2.0f * vt.intensity;
+					row[j].b = rgb > 255 ? 255 : rgb;
 				}
-				clip_t.clear();
 			}
-
-
 		}
-	}
+	});
 }
 
-_3D::mat4x4 _3D::Identity4()
+// Merges every worker's private buffers into scr_Buff and zBuffer, keeping the nearest w.
+// Workers go in index order and an equal w keeps what is there, so ties go to the earlier
+// triangle. Bands are handed out like the visibility resolve.
+void gfx::composite_Private()
 {
-	mat4x4 matrix;
-	matrix.mat[0][0] = 1.0f;
-	matrix.mat[1][1] = 1.0f;
-	matrix.mat[2][2] = 1.0f;
-	matrix.mat[3][3] = 1.0f;
-	return matrix;
+	std::atomic<int> next_band(0);
+	run_Workers([this, &next_band](int) {
+		for (int y0 = next_band++ * RESOLVE_ROWS; y0 < wHeight; y0 = next_band++ * RESOLVE_ROWS) {
+			int p0 = y0 * wWidth;
+			int n = (min(y0 + RESOLVE_ROWS, wHeight) - y0) * wWidth;
+			for (int t = 0; t < n_threads; t++)
+				simd.composite_Row(&scr_Buff[p0], &zBuffer[p0], &sl_color[t][p0], &sl_depth[t][p0], n);
+		}
+	});
 }
 
-_3D::mat4x4 _3D::XRotation_mat4(float angle)
+void gfx::render_Draw(mesh3d* mesh, const mat4x4& mdl_mat, Draw_Type type)
 {
-	mat4x4 matrix;
-	matrix.mat[0][0] = 1.0f;
-	matrix.mat[1][1] = cosf(angle);
-	matrix.mat[1][2] = sinf(angle);
-	matrix.mat[2][1] = -sinf(angle);
-	matrix.mat[2][2] = cosf(angle);
-	matrix.mat[3][3] = 1.0f;
-	return matrix;
+	model_mat = mdl_mat;
+	dtype = type;
+
+	// camera in the mesh's object space, so back faces are rejected before any transform
+	mat4x4 inv_mdl = affine_mat_inverse(mdl_mat);
+	Transpose_mat4(inv_mdl);
+	vec3d cam = camera_pos; cam.w = 1.0f;
+	vec4_mat4_mult(cam, inv_mdl, obj_cam_pos);
+
+	// frustum planes in object space, from model*view*proj
+	mat4x4 mvp = (mdl_mat * camera_mat) * projection_mat;
+	frustum_Planes(mvp, obj_frustum);
+
+	// lights that reach the object's bounding sphere; the workers narrow this down per meshlet
+	vec3d bb_c = { (mesh->bb_min.x + mesh->bb_max.x) * 0.5f, (mesh->bb_min.y + mesh->bb_max.y) * 0.5f, (mesh->bb_min.z + mesh->bb_max.z) * 0.5f };
+	vec3d obj_c = { 0, 0, 0 };
+	for (int j = 0; j < 3; j++)
+		(&obj_c.x)[j] = bb_c.x * mdl_mat.mat[0][j] + bb_c.y * mdl_mat.mat[1][j] + bb_c.z * mdl_mat.mat[2][j] + mdl_mat.mat[3][j];
+	obj_scale = 0.0f;
+	for (int r = 0; r < 3; r++)
+		obj_scale = max(obj_scale, mdl_mat.mat[r][0] * mdl_mat.mat[r][0] + mdl_mat.mat[r][1] * mdl_mat.mat[r][1] + mdl_mat.mat[r][2] * mdl_mat.mat[r][2]);
+	obj_scale = sqrtf(obj_scale);
+	float obj_r = sqrtf(sqrd_distance(mesh->bb_min, mesh->bb_max)) * 0.5f * obj_scale;
+	obj_lights.clear();
+	for (int l = 0; l < (int)light_list.size(); l++) {
+		float reach = obj_r + light_list[l].radius;
+		if (sqrd_distance(obj_c, light_list[l].position) <= reach * reach) obj_lights.push_back(l);
+	}
+
+	obj_tex = mesh->mtexture;
+	if (dtype == TEXTURED && (obj_tex == nullptr || !obj_tex->is_Ready())) dtype = SOLID;
+	job_mesh = mesh;
+	next_meshlet = 0;
+
+	if (dtype == WIRE_FRAME) Draw_Wireframe(mesh);
+	else run_Workers([this](int id) { main_Rasterizer(id); });
 }
 
-_3D::mat4x4 _3D::YRotation_mat4(float angle)
+// Chunks are culled on their bounds from the table, so the mapped arrays of a chunk
+// that is off screen are never touched.
+bool gfx::Draw_Chunked(chunked_mesh* cmesh, const mat4x4& mdl_mat, Draw_Type type)
 {
-	mat4x4 matrix;
-	matrix.mat[0][0] = cosf(angle);
-	matrix.mat[0][2] = sinf(angle);
-	matrix.mat[2][0] = -sinf(angle);
-	matrix.mat[1][1] = 1.0f;
-	matrix.mat[2][2] = cosf(angle);
-	matrix.mat[3][3] = 1.0f;
-	return matrix;
+	vec3d planes[5];
+	mat4x4 mvp = (mdl_mat * camera_mat) * projection_mat;
+	frustum_Planes(mvp, planes);
+
+	for (int c = 0; c < cmesh->num_chunks; c++) {
+		mesh3d& chunk = cmesh->views[c];
+		vec3d center = { (chunk.bb_min.x + chunk.bb_max.x) * 0.5f, (chunk.bb_min.y + chunk.bb_max.y) * 0.5f, (chunk.bb_min.z + chunk.bb_max.z) * 0.5f };
+		float radius = sqrtf(sqrd_distance(chunk.bb_min, chunk.bb_max)) * 0.5f;
+		bool outside = false;
+		for (int p = 0; p < 5 && !outside; p++)
+			outside = planes[p].x * center.x + planes[p].y * center.y + planes[p].z * center.z + planes[p].w < -radius;
+		if (outside)continue;
+
+		if (!Draw_obj(&chunk, mdl_mat, type))return false;
+	}
+	return true;
 }
 
-_3D::mat4x4 _3D::ZRotation_mat4(float angle)
+// Each shared edge is drawn once: vertices are transformed a single time, an edge is kept
+// when either neighbouring triangle faces the camera, and it is near-clipped as a line.
+void gfx::Draw_Wireframe(mesh3d* mesh)
 {
-	mat4x4 matrix;
-	matrix.mat[0][0] = cosf(angle);
-	matrix.mat[0][1] = sinf(angle);
-	matrix.mat[1][0] = -sinf(angle);
-	matrix.mat[1][1] = cosf(angle);
-	matrix.mat[2][2] = 1.0f;
-	matrix.mat[3][3] = 1.0f;
-	return matrix;
+	mat4x4 mv_mat = model_mat * camera_mat;
+	face_vis.resize(mesh->num_triangles);
+	view_verts.resize(mesh->num_vertices);
+
+	run_Workers([this, mesh, &mv_mat](int id) {
+		int claim_end = 0;
+		for (int m = claim_Meshlet(id, -1, claim_end); m >= 0; m = claim_Meshlet(id, m, claim_end)) {
+			const meshlet& mlet = mesh->meshlets[m];
+			th_stats[id].meshlets++;
+			int tri_end = mlet.first_tri + mlet.n_tris;
+			if (cull_Meshlet(mlet)) {
+				memset(&face_vis[mlet.first_tri], 0, mlet.n_tris);
+				continue;
+			}
+			tri_batch tb;
+			for (int b = mlet.first_tri; b < tri_end; b += 4) {
+				int n_batch = min(4, tri_end - b);
+				mesh->fetch_Batch(b, n_batch, tb);
+				int front = backface_Mask(tb.t, tb.f, n_batch, obj_cam_pos);
+				for (int k = 0; k < n_batch; k++) face_vis[b + k] = (front >> k) & 1;
+			}
+		}
+
+		// split on SOA_PAD so neither worker's vectors reach into the other's range
+		int v_begin = (mesh->num_vertices * id / n_threads) & ~(SOA_PAD - 1);
+		int v_end = (id == n_threads - 1) ? mesh->num_vertices : (mesh->num_vertices * (id + 1) / n_threads) & ~(SOA_PAD - 1);
+		view_verts.load(mesh->vertices, v_begin, v_end - v_begin);
+		transform_Points(mv_mat, view_verts, view_verts, v_begin, v_end - v_begin);
+	});
+
+	run_Workers([this, mesh](int id) {
+		std::vector<line2d>& lines = wire_lines[id];
+		lines.clear();
+		int e_end = mesh->num_edges * (id + 1) / n_threads;
+		for (int e = mesh->num_edges * id / n_threads; e < e_end; e++) {
+			const mesh_edge& edge = mesh->edges[e];
+			if (!face_vis[edge.f0] && (edge.f1 < 0 || !face_vis[edge.f1]))continue;
+
+			vec3d a = view_verts.get(edge.v0), b = view_verts.get(edge.v1);
+			if (a.z < 1.0f && b.z < 1.0f)continue;
+			if (a.z < 1.0f || b.z < 1.0f) {
+				vec3d& in = a.z < 1.0f ? b : a;
+				vec3d& out = a.z < 1.0f ? a : b;
+				float t = (1.0f - in.z) / (out.z - in.z);
+				out.x = in.x + (out.x - in.x) * t;
+				out.y = in.y + (out.y - in.y) * t;
+				out.z = 1.0f;
+			}
+
+			float sx[2], sy[2];
+			const vec3d* ends[2] = { &a, &b };
+			for (int k = 0; k < 2; k++) {
+				const vec3d& p = *ends[k];
+				float cx = p.x * projection_mat.mat[0][0] + p.y * projection_mat.mat[1][0] + p.z * projection_mat.mat[2][0] + projection_mat.mat[3][0];
+				float cy = p.x * projection_mat.mat[0][1] + p.y * projection_mat.mat[1][1] + p.z * projection_mat.mat[2][1] + projection_mat.mat[3][1];
+				float cw = p.x * projection_mat.mat[0][3] + p.y * projection_mat.mat[1][3] + p.z * projection_mat.mat[2][3] + projection_mat.mat[3][3];
+				// keep far off-screen ends inside int range, Draw_Lines clips the rest
+				sx[k] = min(max((cx / cw + 1.0f) * 0.5f * wWidth, -1.0e7f), 1.0e7f);
+				sy[k] = min(max((cy / cw + 1.0f) * 0.5f * wHeight, -1.0e7f), 1.0e7f);
+			}
+			lines.push_back({ (int)sx[0], (int)sy[0], (int)sx[1], (int)sy[1], { 250,250,250,0 } });
+		}
+	});
+
+	for (int t = 1; t < n_threads; t++)
+		wire_lines[0].insert(wire_lines[0].end(), wire_lines[t].begin(), wire_lines[t].end());
+	Draw_Lines(wire_lines[0].data(), (int)wire_lines[0].size());
 }
 
-_3D::mat4x4 _3D::Translation_mat4(float x, float y, float z)
+// Runs task(0) on the caller and task(1 .. n_threads - 1) on the pool, returning once all finish
+void gfx::run_Workers(const std::function<void(int)>& task)
+{
+	if (n_threads > 1) {
+		{
+			std::lock_guard<std::mutex> lk1(draw_lock);
+			worker_task = &task;
+			pending = n_threads - 1;
+			job_gen++;
+		}
+		draw_cv.notify_all();
+	}
+
+	task(0);
+
+	while (pending > 0) {
+		std::this_thread::yield();
+	}
+}
+
+// Next meshlet of job_mesh after m for worker id. A new run of CLAIM_MESHLETS is taken
+// from the shared counter once the last one is used up; -1 when the mesh is done.
+// The sort-last pass gives every worker one fixed run in mesh order instead, so worker
+// order is triangle order and the composite settles equal depths the same way each frame.
+int gfx::claim_Meshlet(int id, int m, int& claim_end)
+{
+	if (++m < claim_end)return m;
+	if (raster_pass == PASS_PRIVATE) {
+		if (claim_end > 0)return -1;
+		m = job_mesh->num_meshlets * id / n_threads;
+		claim_end = job_mesh->num_meshlets * (id + 1) / n_threads;
+		return m < claim_end ? m : -1;
+	}
+	m = next_meshlet.fetch_add(CLAIM_MESHLETS);
+	claim_end = min(m + CLAIM_MESHLETS, job_mesh->num_meshlets);
+	return m < claim_end ? m : -1;
+}
+
+void gfx::set_Thread_Count(int count)
+{
+	bool running = kp_running;
+	if (running) {
+		Flush_Draws();
+		gfx_terminate();
+	}
+	n_threads = min(max(count, 1), MAX_THREADS);
+	if (running) start_Workers();
+}
+
+void gfx::blit_Glyph(int glyph, int x, int y, bgra8 color)
+{
+	// clip to the frame buffer, then hand each row's bits to the glyph kernel
+	int r0 = max(0, -y), r1 = min(GLYPH_SIZE, wHeight - y);
+	int c0 = max(0, -x), c1 = min(GLYPH_SIZE, wWidth - x);
+	if (r0 >= r1 || c0 >= c1)return;
+
+	uint64_t col_mask = ((c1 - c0) >= 64 ? ~0ull : ((1ull << (c1 - c0)) - 1)) << c0;
+	const uint64_t* rows = &glyph_rows[glyph * GLYPH_SIZE];
+
+	for (int i = r0; i < r1; i++) {
+		uint64_t row = rows[i] & col_mask;
+		if (row) simd.glyph_Row((int*)&scr_Buff[(i + y) * wWidth + x], row, c0, c1, *(const int*)&color);
+	}
+}
+
+void gfx::Draw_String(const char* str, int x, int y, bgra8 color)
+{
+	if (str == nullptr || glyph_rows == nullptr)return;
+	Flush_Draws();
+
+	for (int n = 0, nc = 0; str[nc] != '\0'; n++, nc++) {
+		if ((x + n * 28) >= (wWidth - 35)) {
+			y += 35; n = 0; x = 10;
+		}
+		if (str[nc] >= 97 && str[nc] <= 122)
+			blit_Glyph(str[nc] - 97, x + n * 25, y, color);
+		else if (str[nc] >= 65 && str[nc] <= 90)
+			blit_Glyph(26 + str[nc] - 65, x + n * 25, y, color);
+		else if (str[nc] >= 48 && str[nc] <= 57)
+			blit_Glyph(52 + str[nc] - 48, x + n * 20, y, color);
+	}
+}
+
+void gfx::blend_Row(bgra8* dst, const bgra8* src, int n)
+{
+	simd.blend_Row(dst, src, n);
+}
+
+void gfx::Draw_Image(const Texture* img, int x, int y, Blit_Mode mode)
+{
+	if (img == nullptr || !img->is_Ready())return;
+	Flush_Draws();
+
+	int wd = img->i_width; int ht = img->i_height;
+	int c0 = max(0, -x), c1 = min(wd, wWidth - x);
+	int r0 = max(0, -y), r1 = min(ht, wHeight - y);
+	if (c0 >= c1 || r0 >= r1)return;
+
+	for (int i = r0; i < r1; i++) {
+		bgra8* dst = &scr_Buff[(i + y) * wWidth + x + c0];
+		const bgra8* src = &img->data[i * wd + c0];
+		if (mode == BLIT_OPAQUE) memcpy(dst, src, sizeof(bgra8) * (c1 - c0));
+		else blend_Row(dst, src, c1 - c0);
+	}
+}
+
+void gfx::Draw_Image_Scaled(const Texture* img, int x, int y, int dst_w, int dst_h, Blit_Filter filter, Blit_Mode mode)
+{
+	if (img == nullptr || !img->is_Ready() || dst_w <= 0 || dst_h <= 0)return;
+	Flush_Draws();
+
+	int wd = img->i_width; int ht = img->i_height;
+	int c0 = max(0, -x), c1 = min(dst_w, wWidth - x);
+	int r0 = max(0, -y), r1 = min(dst_h, wHeight - y);
+	if (c0 >= c1 || r0 >= r1)return;
+
+	// per column source taps and 8-bit weights, shared by every row
+	int n_cols = c1 - c0;
+	std::vector<int> x0(n_cols), x1(n_cols), wx(n_cols);
+	for (int j = 0; j < n_cols; j++) {
+		float fx = ((j + c0) + 0.5f) * wd / (float)dst_w - 0.5f;
+		if (filter == FILTER_NEAREST) fx += 0.5f;
+		fx = min(max(fx, 0.0f), (float)(wd - 1));
+		x0[j] = (int)fx;
+		x1[j] = min(x0[j] + 1, wd - 1);
+		wx[j] = (int)((fx - x0[j]) * 256.0f);
+	}
+	std::vector<bgra8> line(n_cols);
+	const __m128i _zero = _mm_setzero_si128();
+	const __m128i _full = _mm_set1_epi16(256);
+
+	for (int i = r0; i < r1; i++) {
+		float fy = (i + 0.5f) * ht / (float)dst_h - 0.5f;
+		if (filter == FILTER_NEAREST) fy += 0.5f;
+		fy = min(max(fy, 0.0f), (float)(ht - 1));
+		int y0 = (int)fy, y1 = min(y0 + 1, ht - 1);
+		const bgra8* row0 = &img->data[y0 * wd];
+		const bgra8* row1 = &img->data[y1 * wd];
+
+		if (filter == FILTER_NEAREST) {
+			for (int j = 0; j < n_cols; j++) line[j] = row0[x0[j]];
+		}
+		else {
+			__m128i w_y = _mm_set1_epi16((short)((fy - y0) * 256.0f));
+			__m128i w_y0 = _mm_sub_epi16(_full, w_y);
+			for (int j = 0; j < n_cols; j++) {
+				__m128i w_x = _mm_set1_epi16((short)wx[j]);
+				__m128i w_x0 = _mm_sub_epi16(_full, w_x);
+				__m128i t00 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)&row0[x0[j]]), _zero);
+				__m128i t01 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)&row0[x1[j]]), _zero);
+				__m128i t10 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)&row1[x0[j]]), _zero);
+				__m128i t11 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)&row1[x1[j]]), _zero);
+				__m128i top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(t00, w_x0), _mm_mullo_epi16(t01, w_x)), 8);
+				__m128i bot = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(t10, w_x0), _mm_mullo_epi16(t11, w_x)), 8);
+				__m128i px = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, w_y0), _mm_mullo_epi16(bot, w_y)), 8);
+				*(int*)&line[j] = _mm_cvtsi128_si32(_mm_packus_epi16(px, _zero));
+			}
+		}
+
+		bgra8* dst = &scr_Buff[(i + y) * wWidth + x + c0];
+		if (mode == BLIT_OPAQUE) memcpy(dst, line.data(), sizeof(bgra8) * n_cols);
+		else blend_Row(dst, line.data(), n_cols);
+	}
+}
+
+bool gfx::open_Frame_Sink(const char* path, Frame_Format format, int fps)
+{
+	if (sink_file)return false;
+
+	sink_file = fopen(path, "wb");
+	if (!sink_file)return false;
+
+	if (format == FRAME_Y4M) {
+		if (fprintf(sink_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", wWidth, wHeight, max(fps, 1)) < 0) {
+			fclose(sink_file);
+			sink_file = nullptr;
+			return false;
+		}
+		yuv_Buff = new unsigned char[wWidth * wHeight + 2 * ((wWidth + 1) / 2) * ((wHeight + 1) / 2)];
+	}
+
+	sink_format = format;
+	sink_error = false;
+	sink_running = true;
+	for (int i = 0; i < FRAME_QUEUE_SIZE; i++)
+		sink_free.push_back(new bgra8[wWidth * wHeight]);
+	sink_thd = std::thread(&gfx::sink_Writer, this);
+
+	return true;
+}
+
+bool gfx::Submit_Frame()
+{
+	if (!sink_file)return false;
+	Flush_Draws();
+
+	std::unique_lock<std::mutex> unq_lock(sink_lock);
+	// blocks while FRAME_QUEUE_SIZE frames are still waiting to be written
+	sink_cv.wait(unq_lock, [=] {return !sink_free.empty(); });
+	if (sink_error)return false;
+
+	sink_queue.push_back(scr_Buff);
+	scr_Buff = sink_free.back();
+	sink_free.pop_back();
+	unq_lock.unlock();
+	sink_cv.notify_all();
+
+	return true;
+}
+
+// Writes out everything still queued, returns false if any write failed
+bool gfx::close_Frame_Sink()
+{
+	if (!sink_file)return false;
+
+	{
+		std::lock_guard<std::mutex> lk1(sink_lock);
+		sink_running = false;
+	}
+	sink_cv.notify_all();
+	sink_thd.join();
+
+	bool ok = !sink_error;
+	if (fclose(sink_file) != 0) ok = false;
+	sink_file = nullptr;
+
+	for (bgra8* buff : sink_free) delete[] buff;
+	sink_free.clear();
+	delete[] yuv_Buff;
+	yuv_Buff = nullptr;
+
+	return ok;
+}
+
+void gfx::sink_Writer()
+{
+	size_t frame_bytes = sizeof(bgra8) * wWidth * wHeight;
+	size_t yuv_bytes = wWidth * wHeight + 2 * ((wWidth + 1) / 2) * ((wHeight + 1) / 2);
+
+	while (true) {
+		std::unique_lock<std::mutex> unq_lock(sink_lock);
+		sink_cv.wait(unq_lock, [=] {return (!sink_queue.empty() || !sink_running); });
+		if (sink_queue.empty())return;
+
+		bgra8* frame = sink_queue.front();
+		sink_queue.pop_front();
+		unq_lock.unlock();
+
+		// after a failed write the remaining frames are only recycled
+		bool ok = !sink_error;
+		if (ok) {
+			if (sink_format == FRAME_Y4M) {
+				bgra_to_I420(frame, yuv_Buff);
+				ok = fwrite("FRAME\n", 1, 6, sink_file) == 6 && fwrite(yuv_Buff, 1, yuv_bytes, sink_file) == yuv_bytes;
+			}
+			else ok = fwrite(frame, 1, frame_bytes, sink_file) == frame_bytes;
+		}
+
+		unq_lock.lock();
+		if (!ok) sink_error = true;
+		sink_free.push_back(frame);
+		unq_lock.unlock();
+		sink_cv.notify_all();
+	}
+}
+
+// _mm_hadd_epi32 without SSSE3: { a0+a1, a2+a3, b0+b1, b2+b3 }
+static inline __m128i hadd_Epi32(__m128i a, __m128i b)
+{
+	__m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+	return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// BT.601 studio range with 8 fractional bits, chroma is the average of each 2x2 block
+void gfx::bgra_to_I420(const bgra8* src, unsigned char* dst)
+{
+	int cw = (wWidth + 1) / 2, ch = (wHeight + 1) / 2;
+	unsigned char* y_plane = dst;
+	unsigned char* u_plane = dst + wWidth * wHeight;
+	unsigned char* v_plane = u_plane + cw * ch;
+
+	const __m128i y_coef = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+	const __m128i u_coef = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+	const __m128i v_coef = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi32(128);
+
+	for (int i = 0; i < wHeight; i++) {
+		const bgra8* row = &src[i * wWidth];
+		unsigned char* y_row = &y_plane[i * wWidth];
+		int j = 0;
+		for (; j + 8 <= wWidth; j += 8) {
+			__m128i p0 = _mm_loadu_si128((const __m128i*)&row[j]);
+			__m128i p1 = _mm_loadu_si128((const __m128i*)&row[j + 4]);
+			__m128i s0 = hadd_Epi32(_mm_madd_epi16(_mm_unpacklo_epi8(p0, zero), y_coef), _mm_madd_epi16(_mm_unpackhi_epi8(p0, zero), y_coef));
+			__m128i s1 = hadd_Epi32(_mm_madd_epi16(_mm_unpacklo_epi8(p1, zero), y_coef), _mm_madd_epi16(_mm_unpackhi_epi8(p1, zero), y_coef));
+			s0 = _mm_srai_epi32(_mm_add_epi32(s0, half), 8);
+			s1 = _mm_srai_epi32(_mm_add_epi32(s1, half), 8);
+			__m128i y16 = _mm_add_epi16(_mm_packs_epi32(s0, s1), _mm_set1_epi16(16));
+			_mm_storel_epi64((__m128i*)&y_row[j], _mm_packus_epi16(y16, y16));
+		}
+		for (; j < wWidth; j++)
+			y_row[j] = (unsigned char)(((25 * row[j].b + 129 * row[j].g + 66 * row[j].r + 128) >> 8) + 16);
+	}
+
+	for (int i = 0; i < ch; i++) {
+		const bgra8* r0 = &src[(2 * i) * wWidth];
+		const bgra8* r1 = &src[min(2 * i + 1, wHeight - 1) * wWidth];
+		unsigned char* u_row = &u_plane[i * cw];
+		unsigned char* v_row = &v_plane[i * cw];
+		int j = 0;
+		// two chroma samples, a 4x2 block of pixels, per step
+		for (; 2 * j + 4 <= wWidth; j += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)&r0[2 * j]);
+			__m128i b = _mm_loadu_si128((const __m128i*)&r1[2 * j]);
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+			__m128i avg = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+			__m128i uv = hadd_Epi32(_mm_madd_epi16(avg, u_coef), _mm_madd_epi16(avg, v_coef));
+			uv = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(uv, half), 8), half);
+			uv = _mm_packus_epi16(_mm_packs_epi32(uv, uv), zero);
+			int packed = _mm_cvtsi128_si32(uv);
+			u_row[j] = (unsigned char)packed; u_row[j + 1] = (unsigned char)(packed >> 8);
+			v_row[j] = (unsigned char)(packed >> 16); v_row[j + 1] = (unsigned char)(packed >> 24);
+		}
+		for (; j < cw; j++) {
+			int x0 = 2 * j, x1 = min(2 * j + 1, wWidth - 1);
+			int b = (r0[x0].b + r0[x1].b + r1[x0].b + r1[x1].b + 2) >> 2;
+			int g = (r0[x0].g + r0[x1].g + r1[x0].g + r1[x1].g + 2) >> 2;
+			int r = (r0[x0].r + r0[x1].r + r1[x0].r + r1[x1].r + 2) >> 2;
+			u_row[j] = (unsigned char)(((112 * b - 74 * g - 38 * r + 128) >> 8) + 128);
+			v_row[j] = (unsigned char)(((-18 * b - 94 * g + 112 * r + 128) >> 8) + 128);
+		}
+	}
+}
+
+// Pooled threads take ids 1 .. n_threads - 1; the thread calling run_Workers is id 0
+void gfx::start_Workers()
+{
+	job_gen = 0;
+	kp_running = true;
+	for (int id = 1; id < n_threads; id++)
+		draw_thds.emplace_back(&gfx::pooled_draw, this, id);
+}
+
+void gfx::pooled_draw(const int id)
+{
+	// each job is picked up once, by comparing against the last generation this thread ran
+	uint64_t seen = 0;
+	while (true) {
+		std::unique_lock<std::mutex> unq_lock(draw_lock);
+		draw_cv.wait(unq_lock, [&] { return job_gen != seen || !kp_running; });
+		if (!kp_running)return;
+		seen = job_gen;
+		unq_lock.unlock();
+
+		(*worker_task)(id);
+		pending--;
+	}
+}
+
+void* frame_arena::alloc(size_t bytes, size_t align)
+{
+	if (!chunks.empty()) {
+		chunk& c = chunks.back();
+		size_t at = (((size_t)c.base + offset + align - 1) & ~(align - 1)) - (size_t)c.base;
+		if (at + bytes <= c.size) {
+			offset = at + bytes;
+			return c.base + at;
+		}
+		before += c.size;
+	}
+
+	size_t size = max(bytes + align, chunks.empty() ? (size_t)ARENA_CHUNK : chunks.back().size * 2);
+	chunks.push_back({ new unsigned char[size], size });
+	chunk& c = chunks.back();
+	size_t at = (((size_t)c.base + align - 1) & ~(align - 1)) - (size_t)c.base;
+	offset = at + bytes;
+	return c.base + at;
+}
+
+void frame_arena::reset()
+{
+	if (chunks.size() > 1) {
+		size_t total = 0;
+		for (chunk& c : chunks) {
+			total += c.size;
+			delete[] c.base;
+		}
+		chunks.clear();
+		chunks.push_back({ new unsigned char[total], total });
+	}
+	offset = 0;
+	before = 0;
+}
+
+// Clips tris[0..count) against the four screen edges, ping-ponging through scratch.
+// Each edge can at most double the count, so both buffers need CLIP_MAX_TRIS entries
+// for a single input triangle. The result is left in tris.
+int gfx::screen_Clip(mat_tri* tris, int count, mat_tri* scratch, float wd, float ht)
+{
+	mat_tri* src = tris;
+	mat_tri* dst = scratch;
+	for (int p = 0; p < 4; p++) {
+		int n_out = 0;
+		for (int i = 0; i < count; i++) {
+			switch (p) {
+			case 0: { n_out += top_Clipping(src[i], dst[n_out], dst[n_out + 1]); break; }
+			case 1: { n_out += bottom_Clipping(ht, src[i], dst[n_out], dst[n_out + 1]); break; }
+			case 2: { n_out += left_Clipping(src[i], dst[n_out], dst[n_out + 1]); break; }
+			case 3: { n_out += right_Clipping(wd, src[i], dst[n_out], dst[n_out + 1]); break; }
+			}
+		}
+		count = n_out;
+		mat_tri* t = src; src = dst; dst = t;
+	}
+	return count;
+}
+
+void gfx::Draw_Occluder(mesh3d* mesh, const mat4x4& mdl_mat)
+{
+	if (mesh == nullptr || !mesh->is_Ready())return;
+
+	mat4x4 inv_mdl = affine_mat_inverse(mdl_mat);
+	Transpose_mat4(inv_mdl);
+	vec3d cam = camera_pos; cam.w = 1.0f;
+	vec3d eye;
+	vec4_mat4_mult(cam, inv_mdl, eye);
+
+	mat4x4 mv_mat = mdl_mat * camera_mat;
+	mat_tri t_viewed, t_projected, clipped[2];
+	// the caller's thread runs as worker 0, and no job is running while this does
+	frame_arena& arena = th_arena[0];
+	size_t arena_mark = arena.mark();
+	mat_tri* clip_t = arena.alloc_Array<mat_tri>(CLIP_MAX_TRIS);
+	mat_tri* clip_tmp = arena.alloc_Array<mat_tri>(CLIP_MAX_TRIS);
+	__m128 _ones = _mm_set1_ps(1.0);
+	__m128 _scl = _mm_set_ps(1.0, 1.0, 0.5 * occ_Height, 0.5 * occ_Width);
+	int n_tris = mesh->num_triangles;
+
+	tri_batch tb;
+	for (int b = 0; b < n_tris; b += 4) {
+		int n_batch = min(4, n_tris - b);
+		mesh->fetch_Batch(b, n_batch, tb);
+		int front = backface_Mask(tb.t, tb.f, n_batch, eye);
+
+		for (int k = 0; k < n_batch; k++) {
+			if (!(front & (1 << k)))continue;
+
+			tri_mat4_mult(tb.t[k], mv_mat, t_viewed);
+			for (int v = 0; v < 3; v++) t_viewed.tex_mat[v] = { 0, 0, 1, 0 };
+			int ntri_clipped = fnear_Clipping(1.0f, t_viewed, clipped[0], clipped[1]);
+
+			for (int n = 0; n < ntri_clipped; n++) {
+				tri_mat4_mult(clipped[n], projection_mat, t_projected);
+				for (int v = 0; v < 3; v++) {
+					t_projected.tex_mat[v].w = clipped[n].tex_mat[v].w / t_projected.mat[v][3];
+					_mm_storeu_ps(&t_projected.mat[v][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[v][0]), _mm_set1_ps(t_projected.mat[v][3])), _ones), _scl));
+				}
+
+				clip_t[0] = t_projected;
+				int n_clip = screen_Clip(clip_t, 1, clip_tmp, occ_Width - 1.0f, occ_Height - 1.0f);
+				for (int it = 0; it < n_clip; it++) {
+					const mat_tri& t = clip_t[it];
+					Depth_Triangle(occ_Buffer, occ_Width,
+						t.mat[0][X], t.mat[0][Y], t.tex_mat[0].w,
+						t.mat[1][X], t.mat[1][Y], t.tex_mat[1].w,
+						t.mat[2][X], t.mat[2][Y], t.tex_mat[2].w);
+				}
+			}
+		}
+	}
+	arena.rewind(arena_mark);
+	occ_dirty = true;
+}
+
+void gfx::erode_Occlusion()
+{
+	// 3x3 farthest-depth filter: drops partially covered texels along occluder silhouettes,
+	// which keeps the low resolution buffer conservative
+	for (int i = 0; i < occ_Height; i++) {
+		float* src = &occ_Buffer[i * occ_Width];
+		float* dst = &occ_Temp[i * occ_Width];
+		dst[0] = 0.0f; dst[occ_Width - 1] = 0.0f;
+		for (int j = 1; j < occ_Width - 1; j++)
+			dst[j] = min(src[j - 1], min(src[j], src[j + 1]));
+	}
+	memset(occ_Buffer, 0, sizeof(float) * occ_Width);
+	memset(&occ_Buffer[(occ_Height - 1) * occ_Width], 0, sizeof(float) * occ_Width);
+	for (int i = 1; i < occ_Height - 1; i++) {
+		float* up = &occ_Temp[(i - 1) * occ_Width];
+		float* mid = &occ_Temp[i * occ_Width];
+		float* dn = &occ_Temp[(i + 1) * occ_Width];
+		float* dst = &occ_Buffer[i * occ_Width];
+		int j = 0;
+		for (; j + 4 <= occ_Width; j += 4)
+			_mm_storeu_ps(&dst[j], _mm_min_ps(_mm_loadu_ps(&up[j]), _mm_min_ps(_mm_loadu_ps(&mid[j]), _mm_loadu_ps(&dn[j]))));
+		for (; j < occ_Width; j++)
+			dst[j] = min(up[j], min(mid[j], dn[j]));
+	}
+	occ_dirty = false;
+}
+
+bool gfx::is_Occluded(mesh3d* mesh, const mat4x4& mdl_mat)
+{
+	if (occ_dirty) erode_Occlusion();
+
+	mat4x4 mv_mat = mdl_mat * camera_mat;
+	float x_min = FLT_MAX, x_max = -FLT_MAX, y_min = FLT_MAX, y_max = -FLT_MAX, near_w = 0.0f;
+
+	for (int c = 0; c < 8; c++) {
+		float corner[4] = { (c & 1) ? mesh->bb_max.x : mesh->bb_min.x,
+			(c & 2) ? mesh->bb_max.y : mesh->bb_min.y,
+			(c & 4) ? mesh->bb_max.z : mesh->bb_min.z, 1.0f };
+		float view[4], clip[4];
+		for (int j = 0; j < 4; j++)
+			view[j] = corner[0] * mv_mat.mat[0][j] + corner[1] * mv_mat.mat[1][j] + corner[2] * mv_mat.mat[2][j] + mv_mat.mat[3][j];
+		if (view[Z] < 1.0f)return false;   // box reaches the near plane
+
+		for (int j = 0; j < 4; j++)
+			clip[j] = view[0] * projection_mat.mat[0][j] + view[1] * projection_mat.mat[1][j] + view[2] * projection_mat.mat[2][j] + view[3] * projection_mat.mat[3][j];
+		float sx = (clip[X] / clip[W] + 1.0f) * 0.5f * occ_Width;
+		float sy = (clip[Y] / clip[W] + 1.0f) * 0.5f * occ_Height;
+		x_min = min(x_min, sx); x_max = max(x_max, sx);
+		y_min = min(y_min, sy); y_max = max(y_max, sy);
+		near_w = max(near_w, 1.0f / clip[W]);
+	}
+
+	int x0 = max((int)floorf(x_min), 0), x1 = min((int)ceilf(x_max), occ_Width - 1);
+	int y0 = max((int)floorf(y_min), 0), y1 = min((int)ceilf(y_max), occ_Height - 1);
+	if (x0 > x1 || y0 > y1)return true;   // off screen
+
+	for (int i = y0; i <= y1; i++)
+		for (int j = x0; j <= x1; j++)
+			if (occ_Buffer[i * occ_Width + j] <= near_w)return false;
+
+	return true;
+}
+
+bool gfx::cull_Meshlet(const meshlet& mlet)
+{
+	// whole cluster outside one of the frustum planes
+	for (int p = 0; p < 5; p++) {
+		const vec3d& pl = obj_frustum[p];
+		if (pl.x * mlet.center.x + pl.y * mlet.center.y + pl.z * mlet.center.z + pl.w < -mlet.radius)
+			return true;
+	}
+
+	// every triangle of the cluster faces away from the camera
+	vec3d dir = { mlet.cone_apex.x - obj_cam_pos.x, mlet.cone_apex.y - obj_cam_pos.y, mlet.cone_apex.z - obj_cam_pos.z, 0 };
+	float l = lenth_vec3(dir);
+	if (l > 0.0f && (dir.x * mlet.cone_axis.x + dir.y * mlet.cone_axis.y + dir.z * mlet.cone_axis.z) >= mlet.cone_cutoff * l)
+		return true;
+
+	return false;
+}
+
+// Attribute planes for the resolve, from the same truncated corners Solid_Triangle walks
+static vis_tri vis_Setup(const mat_tri& t, float intensity, bgra8 light_col, const Texture* tex)
+{
+	vis_tri vt;
+	vt.intensity = intensity;
+	vt.tex = tex;
+	if (tex == nullptr) {
+		vt.color.r = 250.0f * intensity > 255 ? 255 : 250.0f * intensity;
+		vt.color.g = vt.color.r;
+		vt.color.b = vt.color.r;
+		vt.color.a = 0;
+		return vt;
+	}
+	vt.color = light_col;
+
+	float x[3], y[3], attr[3][3];
+	for (int k = 0; k < 3; k++) {
+		x[k] = (float)(int)t.mat[k][X]; y[k] = (float)(int)t.mat[k][Y];
+		attr[0][k] = t.tex_mat[k].u; attr[1][k] = t.tex_mat[k].v; attr[2][k] = t.tex_mat[k].w;
+	}
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	float* planes[3] = { vt.u_plane, vt.v_plane, vt.w_plane };
+	for (int a = 0; a < 3; a++) {
+		float a0 = attr[a][0], a1 = attr[a][1], a2 = attr[a][2];
+		if (area == 0.0f) {
+			planes[a][0] = 0.0f; planes[a][1] = 0.0f; planes[a][2] = a0;
+			continue;
+		}
+		planes[a][0] = ((a1 - a0) * (y[2] - y[0]) - (a2 - a0) * (y[1] - y[0])) / area;
+		planes[a][1] = ((a2 - a0) * (x[1] - x[0]) - (a1 - a0) * (x[2] - x[0])) / area;
+		planes[a][2] = a0 - planes[a][0] * x[0] - planes[a][1] * y[0];
+	}
+	return vt;
+}
+
+void gfx::main_Rasterizer(const int id)
+{
+	mat4x4 mdl_mat = model_mat;
+	Transpose_mat4(mdl_mat);
+	mat_tri t_projected, t_transformed, t_viewed;
+	vec3d f_normal;
+	vec3d vn[3];
+	mat_tri clipped[2];
+	frame_arena& arena = th_arena[id];
+	vec_soa& normals = th_normals[id];
+	normals.resize(2 * SOA_PAD);
+	size_t arena_mark = arena.mark();
+	int* mlet_lights = arena.alloc_Array<int>(obj_lights.size() + 1);
+	int n_mlet_lights = 0;
+	mat_tri* clip_t = arena.alloc_Array<mat_tri>(CLIP_MAX_TRIS);
+	mat_tri* clip_tmp = arena.alloc_Array<mat_tri>(CLIP_MAX_TRIS);
+	__m128 _ones = _mm_set1_ps(1.0);
+	__m128 _scl = _mm_set_ps(1.0, 1.0, 0.5 * wHeight, 0.5 * wWidth);
+	const mesh3d* mesh = job_mesh;
+	std::vector<vis_tri>& vis_out = vis_tris[id];
+	thread_stats& stats = th_stats[id];
+	tri_batch tb;
+
+	// sort-last workers shade into buffers of their own, composited by Flush_Draws
+	bgra8* frame = scr_Buff;
+	float* depth = zBuffer;
+	if (raster_pass == PASS_PRIVATE) {
+		frame = sl_color[id].data();
+		depth = sl_depth[id].data();
+	}
+
+	int claim_end = 0;
+	for (int m = claim_Meshlet(id, -1, claim_end); m >= 0; m = claim_Meshlet(id, m, claim_end)) {
+		const meshlet& mlet = mesh->meshlets[m];
+		stats.meshlets++;
+		if (cull_Meshlet(mlet))continue;
+		int tri_end = mlet.first_tri + mlet.n_tris;
+
+		// lights of this object whose range reaches the cluster's bounding sphere
+		n_mlet_lights = 0;
+		vec3d mlet_c = mlet.center; mlet_c.w = 1.0f;
+		vec3d wc;
+		vec4_mat4_mult(mlet_c, mdl_mat, wc);
+		float wr = mlet.radius * obj_scale;
+		for (int l : obj_lights) {
+			float reach = wr + light_list[l].radius;
+			if (sqrd_distance(wc, light_list[l].position) <= reach * reach) mlet_lights[n_mlet_lights++] = l;
+		}
+
+		for (int b = mlet.first_tri; b < tri_end; b += 4) {
+			int n_batch = min(4, tri_end - b);
+			mesh->fetch_Batch(b, n_batch, tb);
+			int front = backface_Mask(tb.t, tb.f, n_batch, obj_cam_pos);
+
+			// vertex normals of triangle k at 3k, its face normal at SOA_PAD + k. Vertex normals
+			// carry w = 1 and always took the whole matrix, so both go through transform_Points
+			if (raster_pass != PASS_DEPTH && front) {
+				for (int k = 0; k < n_batch; k++) {
+					if (!(front & (1 << k)))continue;
+					normals.set(3 * k, tb.v[k].v1);
+					normals.set(3 * k + 1, tb.v[k].v2);
+					normals.set(3 * k + 2, tb.v[k].v3);
+					normals.set(SOA_PAD + k, tb.f[k]);
+				}
+				transform_Points(model_mat, normals, normals, 0, SOA_PAD + n_batch);
+				normalise_Batch(normals, 0, 3 * n_batch);
+			}
+
+			for (int k = 0; k < n_batch; k++) {
+				if (!(front & (1 << k)))continue;
+
+				tri_mat4_mult(tb.t[k], model_mat, t_transformed);
+
+				// the depth prepass needs positions only
+				float vi1 = 0, vi2 = 0, vi3 = 0, brightness = 0;
+				bgra8 light_col = { 0, 0, 0, 0 };
+				if (raster_pass != PASS_DEPTH) {
+					f_normal = normals.get(SOA_PAD + k);
+					vn[0] = normals.get(3 * k);
+					vn[1] = normals.get(3 * k + 1);
+					vn[2] = normals.get(3 * k + 2);
+					vec3d centriod;
+					centriod.x = (t_transformed.mat[0][0] + t_transformed.mat[1][0] + t_transformed.mat[2][0]) / 3.0f;
+					centriod.y = (t_transformed.mat[0][1] + t_transformed.mat[1][1] + t_transformed.mat[2][1]) / 3.0f;
+					centriod.z = (t_transformed.mat[0][2] + t_transformed.mat[1][2] + t_transformed.mat[2][2]) / 3.0f;
+			
+					float lc_r = 0, lc_g = 0, lc_b = 0;
+					for (int ml = 0; ml < n_mlet_lights; ml++) {
+						light_data& ld = light_list[mlet_lights[ml]];
+						vi1 += (dot_vec3(vn[0], ld.direction) * ld.power) / (12.5663 * sqrd_distance({ t_transformed.mat[0][0], t_transformed.mat[0][1] ,t_transformed.mat[0][2] ,0 }, ld.position));
+						vi2 += (dot_vec3(vn[1], ld.direction) * ld.power) / (12.5663 * sqrd_distance({ t_transformed.mat[1][0], t_transformed.mat[1][1] ,t_transformed.mat[1][2] ,0 }, ld.position));
+						vi3 += (dot_vec3(vn[2], ld.direction) * ld.power) / (12.5663 * sqrd_distance({ t_transformed.mat[2][0], t_transformed.mat[2][1] ,t_transformed.mat[2][2] ,0 }, ld.position));
+
+						float bf = (dot_vec3(f_normal, ld.direction) * ld.power) / (12.5663 * sqrd_distance(centriod, ld.position));
+						if (bf <= 0.0f)continue;
+						brightness += bf;
+						lc_r += bf * ld.color.r; lc_g += bf * ld.color.g; lc_b += bf * ld.color.b;
+					}
+					if (brightness > 0.0f) {
+						light_col.r = lc_r / brightness; light_col.g = lc_g / brightness; light_col.b = lc_b / brightness;
+					}
+				}
+
+				tri_mat4_mult(t_transformed, camera_mat, t_viewed);
+				t_viewed.tex_mat[0] = tb.t[k].tex_mat[0];
+				t_viewed.tex_mat[1] = tb.t[k].tex_mat[1];
+				t_viewed.tex_mat[2] = tb.t[k].tex_mat[2];
+
+				int ntri_clipped = 0;
+				ntri_clipped = fnear_Clipping(1.0f, t_viewed, clipped[0], clipped[1]);
+
+				for (int n = 0; n < ntri_clipped; n++) {
+
+					tri_mat4_mult(clipped[n], projection_mat, t_projected);
+					t_projected.tex_mat[0] = clipped[n].tex_mat[0];
+					t_projected.tex_mat[1] = clipped[n].tex_mat[1];
+					t_projected.tex_mat[2] = clipped[n].tex_mat[2];
+
+					_mm_storeu_ps(&t_projected.tex_mat[0].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[0].u), _mm_set1_ps(t_projected.mat[0][3])));
+					_mm_storeu_ps(&t_projected.tex_mat[1].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[1].u), _mm_set1_ps(t_projected.mat[1][3])));
+					_mm_storeu_ps(&t_projected.tex_mat[2].u, _mm_div_ps(_mm_loadu_ps(&t_projected.tex_mat[2].u), _mm_set1_ps(t_projected.mat[2][3])));
+
+					_mm_storeu_ps(&t_projected.mat[0][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[0][0]), _mm_set1_ps(t_projected.mat[0][3])), _ones), _scl));
+					_mm_storeu_ps(&t_projected.mat[1][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[1][0]), _mm_set1_ps(t_projected.mat[1][3])), _ones), _scl));
+					_mm_storeu_ps(&t_projected.mat[2][0], _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(&t_projected.mat[2][0]), _mm_set1_ps(t_projected.mat[2][3])), _ones), _scl));
+
+
+					clip_t[0] = t_projected;
+					int clip_t_size = screen_Clip(clip_t, 1, clip_tmp, wWidth - 1.0f, wHeight - 1.0f);
+
+					stats.triangles += clip_t_size;
+					for (int it = 0; it < clip_t_size; it++) {
+
+						if (raster_pass == PASS_VISIBILITY) {
+							// index VIS_INDEX_MASK of the last worker would read back as VIS_EMPTY
+							if (vis_out.size() >= VIS_INDEX_MASK)continue;
+							uint32_t vis_id = ((uint32_t)id << VIS_THREAD_SHIFT) | (uint32_t)vis_out.size();
+							vis_out.push_back(vis_Setup(clip_t[it], brightness, light_col, dtype == TEXTURED ? obj_tex : nullptr));
+							stats.pixels += Solid_Triangle(frame, depth,
+								clip_t[it].mat[0][X], clip_t[it].mat[0][Y], clip_t[it].tex_mat[0].w,
+								clip_t[it].mat[1][X], clip_t[it].mat[1][Y], clip_t[it].tex_mat[1].w,
+								clip_t[it].mat[2][X], clip_t[it].mat[2][Y], clip_t[it].tex_mat[2].w,
+								0.0f, { 0,0,0,0 }, vis_id);
+							continue;
+						}
+
+						switch (dtype) {
+						case SOLID: {
+							stats.pixels += Solid_Triangle(frame, depth,
+								clip_t[it].mat[0][X], clip_t[it].mat[0][Y], clip_t[it].tex_mat[0].w,
+								clip_t[it].mat[1][X], clip_t[it].mat[1][Y], clip_t[it].tex_mat[1].w,
+								clip_t[it].mat[2][X], clip_t[it].mat[2][Y], clip_t[it].tex_mat[2].w,
+								brightness, { 250,250,250,0 });
+							break; }
+
+						case TEXTURED: {
+							stats.pixels += Textured_Triangle(frame, depth,
+								(int)clip_t[it].mat[0][X], clip_t[it].mat[0][Y], clip_t[it].tex_mat[0].u, clip_t[it].tex_mat[0].v, clip_t[it].tex_mat[0].w,
+								clip_t[it].mat[1][X], clip_t[it].mat[1][Y], clip_t[it].tex_mat[1].u, clip_t[it].tex_mat[1].v, clip_t[it].tex_mat[1].w,
+								clip_t[it].mat[2][X], clip_t[it].mat[2][Y], clip_t[it].tex_mat[2].u, clip_t[it].tex_mat[2].v, clip_t[it].tex_mat[2].w,
+								brightness, vi1, vi2, vi3, light_col);
+							break; }
+
+						// wireframes are drawn by Draw_Wireframe and never reach the rasterizer
+						case WIRE_FRAME:
+							break;
+						}
+
+					}
+				}
+			}
+		}
+	}
+	arena.rewind(arena_mark);
+}
+
+_3D::mat4x4 _3D::Identity4()
+{
+	mat4x4 matrix;
+	matrix.mat[0][0] = 1.0f;
+	matrix.mat[1][1] = 1.0f;
+	matrix.mat[2][2] = 1.0f;
+	matrix.mat[3][3] = 1.0f;
+	return matrix;
+}
+
+_3D::mat4x4 _3D::XRotation_mat4(float angle)
+{
+	mat4x4 matrix;
+	matrix.mat[0][0] = 1.0f;
+	matrix.mat[1][1] = cosf(angle);
+	matrix.mat[1][2] = sinf(angle);
+	matrix.mat[2][1] = -sinf(angle);
+	matrix.mat[2][2] = cosf(angle);
+	matrix.mat[3][3] = 1.0f;
+	return matrix;
+}
+
+_3D::mat4x4 _3D::YRotation_mat4(float angle)
+{
+	mat4x4 matrix;
+	matrix.mat[0][0] = cosf(angle);
+	matrix.mat[0][2] = sinf(angle);
+	matrix.mat[2][0] = -sinf(angle);
+	matrix.mat[1][1] = 1.0f;
+	matrix.mat[2][2] = cosf(angle);
+	matrix.mat[3][3] = 1.0f;
+	return matrix;
+}
+
+_3D::mat4x4 _3D::ZRotation_mat4(float angle)
+{
+	mat4x4 matrix;
+	matrix.mat[0][0] = cosf(angle);
+	matrix.mat[0][1] = sinf(angle);
+	matrix.mat[1][0] = -sinf(angle);
+	matrix.mat[1][1] = cosf(angle);
+	matrix.mat[2][2] = 1.0f;
+	matrix.mat[3][3] = 1.0f;
+	return matrix;
+}
+
+_3D::mat4x4 _3D::Translation_mat4(float x, float y, float z)
 {
 	mat4x4 matrix;
 	matrix.mat[0][0] = 1.0f;
@@ -929,7 +3139,7 @@ void _3D::Transpose_mat4(mat4x4& matrix)
 	_mm_store_ps(&matrix.mat[3][0], row4);
 }
 
-_3D::vec3d _3D::cross_vec3(vec3d& v1, vec3d& v2)
+_3D::vec3d _3D::cross_vec3(const vec3d& v1, const vec3d& v2)
 {
 	vec3d v;
 	v.x = v1.y * v2.z - v1.z * v2.y;
@@ -938,7 +3148,7 @@ _3D::vec3d _3D::cross_vec3(vec3d& v1, vec3d& v2)
 	return v;
 }
 
-_3D::mat4x4 _3D::pointAt_mat(vec3d& pos, vec3d& target, vec3d& up)
+_3D::mat4x4 _3D::pointAt_mat(const vec3d& pos, const vec3d& target, const vec3d& up)
 {
 	vec3d forward = target - pos;
 	normalise_vec3(forward);
@@ -957,7 +3167,7 @@ _3D::mat4x4 _3D::pointAt_mat(vec3d& pos, vec3d& target, vec3d& up)
 	return matrix;
 }
 
-_3D::mat4x4 _3D::Camera_mat4(vec3d& camPostion)
+_3D::mat4x4 _3D::Camera_mat4(const vec3d& camPostion)
 {
 	vec3d look_dir = { 0,0,1 };
 	vec3d up = { 0,1,0 };
@@ -982,7 +3192,7 @@ _3D::mat4x4 _3D::Camera_mat4(vec3d& camPostion)
 	return view_mat;
 }
 
-_3D::mat4x4 _3D::rt_mat_inverse(mat4x4& m)
+_3D::mat4x4 _3D::rt_mat_inverse(const mat4x4& m)
 {
 	mat4x4 matrix;
 	matrix.mat[0][0] =   m.mat[0][0];  matrix.mat[0][1] = m.mat[1][0];  matrix.mat[0][2] = m.mat[2][0];  matrix.mat[0][3] = 0.0f;
@@ -995,6 +3205,148 @@ _3D::mat4x4 _3D::rt_mat_inverse(mat4x4& m)
 	return matrix;
 }
 
+_3D::mat4x4 _3D::affine_mat_inverse(const mat4x4& m)
+{
+	// general inverse of the upper 3x3 (handles scale), then the translation row
+	float c00 = m.mat[1][1] * m.mat[2][2] - m.mat[1][2] * m.mat[2][1];
+	float c01 = m.mat[1][2] * m.mat[2][0] - m.mat[1][0] * m.mat[2][2];
+	float c02 = m.mat[1][0] * m.mat[2][1] - m.mat[1][1] * m.mat[2][0];
+	float det = m.mat[0][0] * c00 + m.mat[0][1] * c01 + m.mat[0][2] * c02;
+	float inv_det = (det != 0.0f) ? 1.0f / det : 0.0f;
+
+	mat4x4 matrix;
+	matrix.mat[0][0] = c00 * inv_det;
+	matrix.mat[0][1] = (m.mat[0][2] * m.mat[2][1] - m.mat[0][1] * m.mat[2][2]) * inv_det;
+	matrix.mat[0][2] = (m.mat[0][1] * m.mat[1][2] - m.mat[0][2] * m.mat[1][1]) * inv_det;
+	matrix.mat[1][0] = c01 * inv_det;
+	matrix.mat[1][1] = (m.mat[0][0] * m.mat[2][2] - m.mat[0][2] * m.mat[2][0]) * inv_det;
+	matrix.mat[1][2] = (m.mat[0][2] * m.mat[1][0] - m.mat[0][0] * m.mat[1][2]) * inv_det;
+	matrix.mat[2][0] = c02 * inv_det;
+	matrix.mat[2][1] = (m.mat[0][1] * m.mat[2][0] - m.mat[0][0] * m.mat[2][1]) * inv_det;
+	matrix.mat[2][2] = (m.mat[0][0] * m.mat[1][1] - m.mat[0][1] * m.mat[1][0]) * inv_det;
+	matrix.mat[3][0] = -(m.mat[3][0] * matrix.mat[0][0] + m.mat[3][1] * matrix.mat[1][0] + m.mat[3][2] * matrix.mat[2][0]);
+	matrix.mat[3][1] = -(m.mat[3][0] * matrix.mat[0][1] + m.mat[3][1] * matrix.mat[1][1] + m.mat[3][2] * matrix.mat[2][1]);
+	matrix.mat[3][2] = -(m.mat[3][0] * matrix.mat[0][2] + m.mat[3][1] * matrix.mat[1][2] + m.mat[3][2] * matrix.mat[2][2]);
+	matrix.mat[3][3] = 1.0f;
+	return matrix;
+}
+
+void _3D::frustum_Planes(const mat4x4& m, vec3d planes[5])
+{
+	// left, right, bottom, top, near; taken from the columns of m (row vectors), normalised
+	for (int p = 0; p < 5; p++) {
+		int axis = (p < 4) ? p / 2 : Z;
+		float sgn = (p < 4 && p % 2) ? -1.0f : 1.0f;
+		float wgt = (p < 4) ? 1.0f : 0.0f;
+		vec3d& pl = planes[p];
+		pl.x = wgt * m.mat[0][W] + sgn * m.mat[0][axis];
+		pl.y = wgt * m.mat[1][W] + sgn * m.mat[1][axis];
+		pl.z = wgt * m.mat[2][W] + sgn * m.mat[2][axis];
+		pl.w = wgt * m.mat[3][W] + sgn * m.mat[3][axis];
+		float l = lenth_vec3(pl);
+		if (l > 0.0f) { pl.x /= l; pl.y /= l; pl.z /= l; pl.w /= l; }
+	}
+}
+
+int _3D::backface_Mask(const mat_tri* tris, const vec3d* f_normals, int count, const vec3d& eye)
+{
+	// bit k set => triangle k faces the eye. Runs on untransformed object-space data.
+	if (count < 4) {
+		int mask = 0;
+		for (int k = 0; k < count; k++) {
+			float d = f_normals[k].x * (tris[k].mat[0][X] - eye.x) +
+				f_normals[k].y * (tris[k].mat[0][Y] - eye.y) +
+				f_normals[k].z * (tris[k].mat[0][Z] - eye.z);
+			if (d < 0.0f) mask |= (1 << k);
+		}
+		return mask;
+	}
+
+	__m128 nx = _mm_loadu_ps(&f_normals[0].x);
+	__m128 ny = _mm_loadu_ps(&f_normals[1].x);
+	__m128 nz = _mm_loadu_ps(&f_normals[2].x);
+	__m128 nw = _mm_loadu_ps(&f_normals[3].x);
+	_MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+
+	__m128 px = _mm_loadu_ps(&tris[0].mat[0][0]);
+	__m128 py = _mm_loadu_ps(&tris[1].mat[0][0]);
+	__m128 pz = _mm_loadu_ps(&tris[2].mat[0][0]);
+	__m128 pw = _mm_loadu_ps(&tris[3].mat[0][0]);
+	_MM_TRANSPOSE4_PS(px, py, pz, pw);
+
+	__m128 d = _mm_mul_ps(nx, _mm_sub_ps(px, _mm_set1_ps(eye.x)));
+	d = _mm_add_ps(d, _mm_mul_ps(ny, _mm_sub_ps(py, _mm_set1_ps(eye.y))));
+	d = _mm_add_ps(d, _mm_mul_ps(nz, _mm_sub_ps(pz, _mm_set1_ps(eye.z))));
+	return _mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()));
+}
+
+// Contents are not kept when the arrays grow
+void vec_soa::resize(int n)
+{
+	if (n > capacity) {
+		delete[] block;
+		capacity = soa_Padded(n);
+		block = new float[capacity * 4 + SOA_ALIGN / sizeof(float)]();
+		x = (float*)(((uintptr_t)block + SOA_ALIGN - 1) & ~(uintptr_t)(SOA_ALIGN - 1));
+		y = x + capacity; z = y + capacity; w = z + capacity;
+	}
+	count = n;
+}
+
+void vec_soa::load(const vec3d* src, int first, int n)
+{
+	for (int i = first; i < first + n; i++) {
+		x[i] = src[i].x; y[i] = src[i].y; z[i] = src[i].z; w[i] = src[i].w;
+	}
+}
+
+void vec_soa::store(vec3d* dst, int first, int n) const
+{
+	for (int i = first; i < first + n; i++)
+		dst[i] = { x[i], y[i], z[i], w[i] };
+}
+
+void _3D::transform_Points(const mat4x4& m, const vec_soa& in, vec_soa& out, int first, int count)
+{
+	if (count < 0) count = in.size() - first;
+	const float* src[4] = { in.x + first, in.y + first, in.z + first, in.w + first };
+	float* dst[4] = { out.x + first, out.y + first, out.z + first, out.w + first };
+	simd.transform_Soa(src, dst, count, m, true);
+}
+
+void _3D::transform_Normals(const mat4x4& m, const vec_soa& in, vec_soa& out, int first, int count)
+{
+	if (count < 0) count = in.size() - first;
+	const float* src[4] = { in.x + first, in.y + first, in.z + first, in.w + first };
+	float* dst[4] = { out.x + first, out.y + first, out.z + first, out.w + first };
+	simd.transform_Soa(src, dst, count, m, false);
+}
+
+void _3D::normalise_Batch(vec_soa& v, int first, int count)
+{
+	if (count < 0) count = v.size() - first;
+	float* vs[3] = { v.x + first, v.y + first, v.z + first };
+	simd.normalise_Soa(vs, count);
+}
+
+void _3D::dot_Batch(const vec_soa& a, const vec_soa& b, float* out, int first, int count)
+{
+	if (count < 0) count = a.size() - first;
+	const float* as[3] = { a.x + first, a.y + first, a.z + first };
+	const float* bs[3] = { b.x + first, b.y + first, b.z + first };
+	simd.dot_Soa(as, bs, out + first, count);
+}
+
+void _3D::face_Normals_Batch(const vec_soa& p0, const vec_soa& p1, const vec_soa& p2, vec_soa& out, int first, int count)
+{
+	if (count < 0) count = p0.size() - first;
+	const float* a[3] = { p0.x + first, p0.y + first, p0.z + first };
+	const float* b[3] = { p1.x + first, p1.y + first, p1.z + first };
+	const float* c[3] = { p2.x + first, p2.y + first, p2.z + first };
+	float* dst[4] = { out.x + first, out.y + first, out.z + first, out.w + first };
+	simd.face_Normals_Soa(a, b, c, dst, count);
+}
+
 int _3D::left_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 {
 	vec_tri in; vec3d tmp_vert;
@@ -1024,13 +3376,13 @@ int _3D::left_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out1.tex_mat[0] = *t_in[0];
 
 		float t = (-p_in[0]->x) / (p_out[0]->x - p_in[0]->x);
-		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		t = (-p_in[0]->x) / (p_out[1]->x - p_in[0]->x);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t), pin));
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t)), pin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin)), tin));
 
 		return 1;
 	}
@@ -1048,9 +3400,9 @@ int _3D::left_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out1.tex_mat[1] = *t_in[1];
 		
 		float t = (-p_in[0]->x) / (p_out[0]->x - p_in[0]->x);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
 		tri_out2.tex_mat[0] = *t_in[1];
@@ -1058,9 +3410,9 @@ int _3D::left_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
 
 		t = (-p_in[1]->x) / (p_out[0]->x - p_in[1]->x);
-		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t), pin_1));
+		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t)), pin_1));
 		tin = _mm_loadu_ps(&t_in[1]->u);
-		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 		
 		return 2;
 	}
@@ -1095,13 +3447,13 @@ int _3D::top_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out1.tex_mat[0] = *t_in[0];
 
 		float t = (-p_in[0]->y) / (p_out[0]->y - p_in[0]->y);
-		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		t = (-p_in[0]->y) / (p_out[1]->y - p_in[0]->y);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t), pin));
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t)), pin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin)), tin));
 
 		return 1;
 	}
@@ -1119,9 +3471,9 @@ int _3D::top_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out1.tex_mat[1] = *t_in[1];
 
 		float t = (-p_in[0]->y) / (p_out[0]->y - p_in[0]->y);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
 		tri_out2.tex_mat[0] = *t_in[1];
@@ -1129,9 +3481,9 @@ int _3D::top_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
 		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
 
 		t = (-p_in[1]->y) / (p_out[0]->y - p_in[1]->y);
-		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t), pin_1));
+		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t)), pin_1));
 		tin = _mm_loadu_ps(&t_in[1]->u);
-		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 		return 2;
 	}
 }
@@ -1169,13 +3521,13 @@ int _3D::bottom_Clipping(float wht, mat_tri& tri_in, mat_tri& tri_out1, mat_tri&
 		tri_out1.tex_mat[0] = *t_in[0];
 
 		float t = (-(wht) - (-p_in[0]->y)) / ((-p_out[0]->y) - (-p_in[0]->y));
-		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		t = (-(wht)-(-p_in[0]->y)) / ((-p_out[1]->y) - (-p_in[0]->y));
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t), pin));
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t)), pin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin)), tin));
 
 		return 1;
 	}
@@ -1193,9 +3545,9 @@ int _3D::bottom_Clipping(float wht, mat_tri& tri_in, mat_tri& tri_out1, mat_tri&
 		tri_out1.tex_mat[1] = *t_in[1];
 
 		float t = (-(wht)-(-p_in[0]->y)) / ((-p_out[0]->y) - (-p_in[0]->y));
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
 		tri_out2.tex_mat[0] = *t_in[1];
@@ -1203,9 +3555,9 @@ int _3D::bottom_Clipping(float wht, mat_tri& tri_in, mat_tri& tri_out1, mat_tri&
 		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
 
 		t = (-(wht)-(-p_in[1]->y)) / ((-p_out[0]->y) - (-p_in[1]->y));
-		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t), pin_1));
+		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t)), pin_1));
 		tin = _mm_loadu_ps(&t_in[1]->u);
-		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 		return 2;
 	}
 }
@@ -1242,13 +3594,13 @@ int _3D::right_Clipping(float wwd, mat_tri& tri_in, mat_tri& tri_out1, mat_tri&
 		_mm_storeu_ps(&tri_out1.mat[0][X], pin);
 		tri_out1.tex_mat[0] = *t_in[0];
 		float t = (-(wwd)-(-p_in[0]->x)) / ((-p_out[0]->x) - (-p_in[0]->x));
-		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		t = (-(wwd)-(-p_in[0]->x)) / ((-p_out[1]->x) - (-p_in[0]->x));
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t), pin));
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t)), pin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin)), tin));
 
 		return 1;
 	}
@@ -1266,216 +3618,1131 @@ int _3D::right_Clipping(float wwd, mat_tri& tri_in, mat_tri& tri_out1, mat_tri&
 		tri_out1.tex_mat[1] = *t_in[1];
 
 		float t = (-(wwd)-(-p_in[0]->x)) / ((-p_out[0]->x) - (-p_in[0]->x));
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
+		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
+
+		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
+		tri_out2.tex_mat[0] = *t_in[1];
+		_mm_storeu_ps(&tri_out2.mat[1][X], _mm_loadu_ps(&tri_out1.mat[2][X]));
+		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
+
+		t = (-(wwd)-(-p_in[1]->x)) / ((-p_out[0]->x) - (-p_in[1]->x));
+		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t)), pin_1));
+		tin = _mm_loadu_ps(&t_in[1]->u);
+		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
+		return 2;
+	}
+}
+
+int _3D::fnear_Clipping(float fnear, mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
+{
+	vec_tri in; vec3d tmp_vert;
+	memcpy(&in, &tri_in, sizeof(vec_tri));
+
+	vec3d* p_in[3]; int in_count = 0;
+	vec3d* p_out[3]; int out_count = 0;
+	vec2d* t_in[3]; int in_texCount = 0;
+	vec2d* t_out[3]; int out_texCount = 0;
+
+	if ((in.vertx[0].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[0]; t_in[in_texCount++] = &in.tex_vertx[0]; }
+	else { p_out[out_count++] = &in.vertx[0]; t_out[out_texCount++] = &in.tex_vertx[0]; }
+	if ((in.vertx[1].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[1]; t_in[in_texCount++] = &in.tex_vertx[1]; }
+	else { p_out[out_count++] = &in.vertx[1];  t_out[out_texCount++] = &in.tex_vertx[1]; }
+	if ((in.vertx[2].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[2]; t_in[in_texCount++] = &in.tex_vertx[2]; }
+	else { p_out[out_count++] = &in.vertx[2];  t_out[out_texCount++] = &in.tex_vertx[2]; }
+
+	if (in_count == 0) return 0;
+	if (in_count == 3) { memcpy(&tri_out1, &tri_in, sizeof(mat_tri)); return 1; }
+
+	if (in_count == 1 && out_count == 2) {
+		tri_out1.color = tri_in.color;
+		//tri_out1.color.r = 250; tri_out1.color.g = 0; tri_out1.color.b = 0; tri_out1.color.a = 250;
+
+		__m128 pin = _mm_loadu_ps(&p_in[0]->x);
+		_mm_storeu_ps(&tri_out1.mat[0][X], pin);
+		tri_out1.tex_mat[0] = *t_in[0];
+		
+		float t = (fnear - p_in[0]->z) / (p_out[0]->z - p_in[0]->z);
+		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
+		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
+		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
+
+		t = (fnear - p_in[0]->z) / (p_out[1]->z - p_in[0]->z);
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t)), pin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin)), tin));
+
+		return 1;
+	}
+	if (in_count == 2 && out_count == 1) {
+		tri_out1.color = tri_in.color;
+		//tri_out1.color.r = 0; tri_out1.color.g = 250; tri_out1.color.b = 0; tri_out1.color.a = 250;
+		tri_out2.color = tri_in.color;
+		//tri_out2.color.r = 0; tri_out2.color.g = 0; tri_out2.color.b = 250; tri_out2.color.a = 250;
+
+		__m128 pin = _mm_loadu_ps(&p_in[0]->x);
+		_mm_storeu_ps(&tri_out1.mat[0][X], pin);
+		__m128 pin_1 = _mm_loadu_ps(&p_in[1]->x);
+		_mm_storeu_ps(&tri_out1.mat[1][X], pin_1);
+		tri_out1.tex_mat[0] = *t_in[0];
+		tri_out1.tex_mat[1] = *t_in[1];
+
+		float t = (fnear - p_in[0]->z) / (p_out[0]->z - p_in[0]->z);
+		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t)), pin));
 		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
 
 		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
 		tri_out2.tex_mat[0] = *t_in[1];
 		_mm_storeu_ps(&tri_out2.mat[1][X], _mm_loadu_ps(&tri_out1.mat[2][X]));
 		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
 
-		t = (-(wwd)-(-p_in[1]->x)) / ((-p_out[0]->x) - (-p_in[1]->x));
-		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t), pin_1));
-		tin = _mm_loadu_ps(&t_in[1]->u);
-		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
-		return 2;
+		t = (fnear - p_in[1]->z) / (p_out[0]->z - p_in[1]->z);
+		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t)), pin_1));
+		tin = _mm_loadu_ps(&t_in[1]->u);
+		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin)), tin));
+		return 2;
+	}
+}
+
+// one "v", "v/vt" or "v/vt/vn" face token; missing parts read as 0
+static void obj_Face_Vertex(char*& p, int& v, int& vt)
+{
+	v = (int)strtol(p, &p, 10);
+	vt = 0;
+	if (*p == '/') {
+		p++;
+		if (*p != '/') vt = (int)strtol(p, &p, 10);
+	}
+	while (*p && *p != ' ' && *p != '\t') p++;
+}
+
+struct obj_face_rec {
+	int v[3];
+	int vt[3];
+};
+
+// a triangle "f" line, indices made 0 based; false when one is out of range
+static bool obj_Face(char* line, obj_face_rec& f, int n_verts, int n_texs, bool isTextured)
+{
+	char* p = line + 1;
+	for (int k = 0; k < 3; k++) {
+		obj_Face_Vertex(p, f.v[k], f.vt[k]);
+		if (f.v[k] < 1 || f.v[k] > n_verts || (isTextured && (f.vt[k] < 1 || f.vt[k] > n_texs)))return false;
+		f.v[k]--; f.vt[k]--;
+	}
+	return true;
+}
+
+bool mesh3d::load_obj(const char* file, bool isTextured)
+{
+	std::vector<vec_tri> tris;
+	std::ifstream object(file);
+	if (!object.is_open())return false;
+	num_triangles = 0;
+
+	std::vector<vec3d> verts;
+	std::vector<vec2d> texs;
+	std::vector<int> f_indx;
+	
+	// one string reused for every line, so a line of any length is parsed whole
+	std::string text;
+	while (std::getline(object, text))
+	{
+		char* line = &text[0];
+		char* p = line;
+		if (line[0] == 'v')
+		{
+			if (line[1] == 't')
+			{
+				vec2d v;
+				v.u = strtof(line + 2, &p);
+				v.v = strtof(p, &p);
+				texs.push_back(v);
+			}
+			else if (line[1] == ' ' || line[1] == '\t')
+			{
+				vec3d v;
+				v.x = strtof(line + 1, &p);
+				v.y = strtof(p, &p);
+				v.z = strtof(p, &p);
+				verts.push_back(v);
+			}
+		}
+		else if (line[0] == 'f')
+		{
+			obj_face_rec f;
+			if (!obj_Face(line, f, (int)verts.size(), (int)texs.size(), isTextured)) {
+				num_triangles = 0;
+				return false;
+			}
+
+			if (isTextured)
+				tris.push_back({ verts[f.v[0]], verts[f.v[1]], verts[f.v[2]],
+					texs[f.vt[0]], texs[f.vt[1]], texs[f.vt[2]] });
+			else
+				tris.push_back({ verts[f.v[0]], verts[f.v[1]], verts[f.v[2]] });
+			for (int k = 0; k < 3; k++) f_indx.push_back(f.v[k]);
+		}
+	}
+	object.close();
+
+	std::vector<vec3d> f_normals, v_normals;
+	build_Normals(tris, f_indx, (int)verts.size(), f_normals, v_normals);
+	assemble(tris, f_indx, f_normals.data(), v_normals.data(), verts);
+	return true;
+}
+
+// Splits [0, n) into SOA_PAD aligned ranges over the hardware threads, for load time work
+static void parallel_Ranges(int n, const std::function<void(int, int)>& fn)
+{
+	int n_threads = min(max((int)std::thread::hardware_concurrency(), 1), max(n / 4096, 1));
+	if (n_threads == 1) {
+		fn(0, n);
+		return;
+	}
+	std::vector<std::thread> pool;
+	for (int t = 0; t < n_threads; t++) {
+		int begin = (int)((int64_t)n * t / n_threads) & ~(SOA_PAD - 1);
+		int end = (t == n_threads - 1) ? n : (int)((int64_t)n * (t + 1) / n_threads) & ~(SOA_PAD - 1);
+		pool.emplace_back(fn, begin, end);
+	}
+	for (std::thread& th : pool) th.join();
+}
+
+// The face normal before normalising; its length is twice the triangle's area, so summing
+// these weights each face by area.
+vec3d mesh3d::face_Cross(const vec_tri& tri)
+{
+	vec3d n = cross_vec3(tri.vertx[1] - tri.vertx[0], tri.vertx[2] - tri.vertx[0]);
+	n.w = 0;
+	return n;
+}
+
+// vertices without any area around them keep a zero normal
+void mesh3d::finish_Normal(vec3d& sum)
+{
+	float l = lenth_vec3(sum);
+	if (l > 0.0f) { sum.x /= l; sum.y /= l; sum.z /= l; }
+	sum.w = 1;
+}
+
+void mesh3d::face_Normals(const std::vector<vec_tri>& tris, std::vector<vec3d>& f_normals)
+{
+	int n = (int)tris.size();
+	vec_soa corners[3], normals;
+	for (int i = 0; i < 3; i++) corners[i].resize(n);
+	normals.resize(n);
+	for (int f = 0; f < n; f++)
+		for (int i = 0; i < 3; i++) corners[i].set(f, tris[f].vertx[i]);
+	face_Normals_Batch(corners[0], corners[1], corners[2], normals);
+	f_normals.resize(n);
+	normals.store(f_normals.data(), 0, n);
+}
+
+// Face normals are computed once, each vertex then gathers the area weighted normals of its
+// faces in face order and is normalised once. The chunk converter scatters the same sums in
+// the same order, so both loaders shade identically.
+void mesh3d::build_Normals(const std::vector<vec_tri>& tris, const std::vector<int>& f_indx, int n_verts, std::vector<vec3d>& f_normals, std::vector<vec3d>& v_normals)
+{
+	int n_tris = (int)tris.size();
+	vec_soa cross;
+	cross.resize(n_tris);
+	parallel_Ranges(n_tris, [&](int begin, int end) {
+		for (int f = begin; f < end; f++) cross.set(f, face_Cross(tris[f]));
+	});
+
+	// faces of each vertex, in face order
+	std::vector<int> v_start(n_verts + 1, 0), v_faces(f_indx.size());
+	for (int v : f_indx) v_start[v + 1]++;
+	for (int v = 0; v < n_verts; v++) v_start[v + 1] += v_start[v];
+	{
+		std::vector<int> cursor(v_start.begin(), v_start.end() - 1);
+		for (int i = 0; i < (int)f_indx.size(); i++) v_faces[cursor[f_indx[i]]++] = i / 3;
+	}
+
+	v_normals.resize(n_verts);
+	parallel_Ranges(n_verts, [&](int begin, int end) {
+		for (int v = begin; v < end; v++) {
+			vec3d sum = { 0, 0, 0, 0 };
+			for (int i = v_start[v]; i < v_start[v + 1]; i++) sum = sum + cross.get(v_faces[i]);
+			finish_Normal(sum);
+			v_normals[v] = sum;
+		}
+	});
+
+	f_normals.resize(n_tris);
+	parallel_Ranges(n_tris, [&](int begin, int end) {
+		normalise_Batch(cross, begin, end - begin);
+		cross.store(f_normals.data(), begin, end - begin);
+	});
+}
+
+// Builds the render arrays from parsed triangles; f_indx holds 3 indices into verts and
+// v_normals per triangle, f_normals one unit normal per triangle.
+void mesh3d::assemble(const std::vector<vec_tri>& tris, const std::vector<int>& f_indx, const vec3d* f_normals, const vec3d* v_normals, const std::vector<vec3d>& verts)
+{
+	num_triangles = (int)tris.size();
+	triangles_list = new mat_tri[num_triangles];
+	face_normals = new vec3d[num_triangles];
+	vertex_normals = new vec3dx3[num_triangles];
+
+	for (int n = 0; n < num_triangles; n++) {
+		const vec_tri& triangle = tris[n];
+		for (int i = 0; i < 3; i++) {
+			triangles_list[n].mat[i][X] = triangle.vertx[i].x;
+			triangles_list[n].mat[i][Y] = triangle.vertx[i].y;
+			triangles_list[n].mat[i][Z] = triangle.vertx[i].z;
+			triangles_list[n].mat[i][W] = triangle.vertx[i].w;
+
+			triangles_list[n].tex_mat[i] = triangle.tex_vertx[i];
+		}
+		face_normals[n] = f_normals[n];
+		vertex_normals[n] = { v_normals[f_indx[n * 3]], v_normals[f_indx[n * 3 + 1]], v_normals[f_indx[n * 3 + 2]] };
+	}
+
+	bb_min = { FLT_MAX, FLT_MAX, FLT_MAX }; bb_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (const vec3d& v : verts) {
+		bb_min.x = min(bb_min.x, v.x); bb_max.x = max(bb_max.x, v.x);
+		bb_min.y = min(bb_min.y, v.y); bb_max.y = max(bb_max.y, v.y);
+		bb_min.z = min(bb_min.z, v.z); bb_max.z = max(bb_max.z, v.z);
+	}
+
+	num_vertices = (int)verts.size();
+	vertices = new vec3d[num_vertices];
+	for (int i = 0; i < num_vertices; i++) vertices[i] = verts[i];
+	tri_vindx = new int[num_triangles * 3];
+	memcpy(tri_vindx, f_indx.data(), sizeof(int) * num_triangles * 3);
+
+	build_Meshlets();
+	optimize_Order();
+	build_Edges();
+}
+
+void mesh3d::reorder_Triangles(const int* order)
+{
+	mat_tri* n_tris = new mat_tri[num_triangles];
+	vec3d* n_fnormals = new vec3d[num_triangles];
+	vec3dx3* n_vnormals = new vec3dx3[num_triangles];
+	int* n_vindx = new int[num_triangles * 3];
+
+	for (int n = 0; n < num_triangles; n++) {
+		n_tris[n] = triangles_list[order[n]];
+		n_fnormals[n] = face_normals[order[n]];
+		n_vnormals[n] = vertex_normals[order[n]];
+		for (int v = 0; v < 3; v++) n_vindx[n * 3 + v] = tri_vindx[order[n] * 3 + v];
+	}
+
+	delete[] triangles_list; triangles_list = n_tris;
+	delete[] face_normals; face_normals = n_fnormals;
+	delete[] vertex_normals; vertex_normals = n_vnormals;
+	delete[] tri_vindx; tri_vindx = n_vindx;
+}
+
+// Unique edges with the (up to two) triangles sharing them. Call after the triangles
+// reach their final order, face indices are not remapped afterwards.
+void mesh3d::build_Edges()
+{
+	delete[] edges;
+	edges = nullptr;
+	num_edges = 0;
+	if (num_triangles == 0)return;
+
+	std::vector<mesh_edge> e_list;
+	e_list.reserve(num_triangles * 3 / 2 + 1);
+	std::unordered_map<uint64_t, int> lookup;
+	lookup.reserve(num_triangles * 3 / 2 + 1);
+
+	for (int n = 0; n < num_triangles; n++) {
+		for (int k = 0; k < 3; k++) {
+			int a = tri_vindx[n * 3 + k], b = tri_vindx[n * 3 + (k + 1) % 3];
+			if (a == b)continue;
+			uint64_t key = ((uint64_t)(unsigned)min(a, b) << 32) | (unsigned)max(a, b);
+			auto it = lookup.find(key);
+			if (it == lookup.end()) {
+				lookup.emplace(key, (int)e_list.size());
+				e_list.push_back({ a, b, n, -1 });
+			}
+			else if (e_list[it->second].f1 < 0 && e_list[it->second].f0 != n) {
+				e_list[it->second].f1 = n;
+			}
+		}
+	}
+
+	num_edges = (int)e_list.size();
+	edges = new mesh_edge[num_edges];
+	memcpy(edges, e_list.data(), sizeof(mesh_edge) * num_edges);
+}
+
+static void oct_Encode(const vec3d& n, int16_t out[2])
+{
+	float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if (!(l1 > 0.0f)) { out[0] = 0; out[1] = 0; return; }   // degenerate, decodes to +z
+
+	float x = n.x / l1, y = n.y / l1;
+	if (n.z < 0.0f) {
+		float ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	out[0] = (int16_t)lrintf(min(max(x, -1.0f), 1.0f) * 32767.0f);
+	out[1] = (int16_t)lrintf(min(max(y, -1.0f), 1.0f) * 32767.0f);
+}
+
+// four octahedral normals at once; w is taken from w_lanes
+static inline void oct_Decode4(const int16_t* enc, __m128 w_lanes, vec3d* out)
+{
+	__m128i e = _mm_loadu_si128((const __m128i*)enc);
+	__m128 k = _mm_set1_ps(1.0f / 32767.0f);
+	__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(e, 16), 16)), k);
+	__m128 y = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(e, 16)), k);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 z = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_andnot_ps(sign, x)), _mm_andnot_ps(sign, y));
+
+	// lower hemisphere: x -= copysign(max(-z, 0), x), same for y
+	__m128 t = _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), z), _mm_setzero_ps());
+	x = _mm_sub_ps(x, _mm_or_ps(t, _mm_and_ps(x, sign)));
+	y = _mm_sub_ps(y, _mm_or_ps(t, _mm_and_ps(y, sign)));
+
+	__m128 inv_l = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z))));
+	x = _mm_mul_ps(x, inv_l); y = _mm_mul_ps(y, inv_l); z = _mm_mul_ps(z, inv_l);
+	__m128 w = w_lanes;
+	_MM_TRANSPOSE4_PS(x, y, z, w);
+	_mm_storeu_ps(&out[0].x, x);
+	_mm_storeu_ps(&out[1].x, y);
+	_mm_storeu_ps(&out[2].x, z);
+	_mm_storeu_ps(&out[3].x, w);
+}
+
+bool mesh3d::quantize()
+{
+	if (is_view || qtris != nullptr || triangles_list == nullptr || num_triangles == 0)return false;
+
+	vec3d ext = { bb_max.x - bb_min.x, bb_max.y - bb_min.y, bb_max.z - bb_min.z, 0 };
+	q_offset = bb_min; q_offset.w = 1.0f;
+	q_scale = { ext.x / 65535.0f, ext.y / 65535.0f, ext.z / 65535.0f, 0.0f };
+
+	qtris = new quant_tri[num_triangles];
+	for (int n = 0; n < num_triangles; n++) {
+		quant_tri& q = qtris[n];
+		const mat_tri& t = triangles_list[n];
+		for (int v = 0; v < 3; v++) {
+			for (int c = 0; c < 3; c++) {
+				float e = (&ext.x)[c];
+				float f = (e > 0.0f) ? (t.mat[v][c] - (&bb_min.x)[c]) / e * 65535.0f : 0.0f;
+				q.pos[v][c] = (uint16_t)lrintf(min(max(f, 0.0f), 65535.0f));
+			}
+			q.uv[v][0] = float_To_Half(t.tex_mat[v].u);
+			q.uv[v][1] = float_To_Half(t.tex_mat[v].v);
+		}
+		oct_Encode(vertex_normals[n].v1, q.normals[0]);
+		oct_Encode(vertex_normals[n].v2, q.normals[1]);
+		oct_Encode(vertex_normals[n].v3, q.normals[2]);
+		oct_Encode(face_normals[n], q.normals[3]);
+		q.pad = 0;
+	}
+
+	delete[] triangles_list; triangles_list = nullptr;
+	delete[] face_normals; face_normals = nullptr;
+	delete[] vertex_normals; vertex_normals = nullptr;
+	return true;
+}
+
+void mesh3d::fetch_Batch(int first, int count, tri_batch& out) const
+{
+	if (qtris == nullptr) {
+		out.t = &triangles_list[first];
+		out.f = &face_normals[first];
+		out.v = &vertex_normals[first];
+		return;
+	}
+
+	__m128 scale = _mm_loadu_ps(&q_scale.x);
+	__m128 offset = _mm_loadu_ps(&q_offset.x);
+	__m128i zero = _mm_setzero_si128();
+	// vertex normals were built with w = 1, face normals with w = 0
+	__m128 n_w = _mm_setr_ps(1.0f, 1.0f, 1.0f, 0.0f);
+	vec3d n4[4];
+
+	for (int n = 0; n < count; n++) {
+		const quant_tri& q = qtris[first + n];
+		mat_tri& t = out.tris[n];
+		// the 4th lane reads the next 16 bits, scale.w = 0 and offset.w = 1 make it w = 1
+		for (int v = 0; v < 3; v++) {
+			__m128i p = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)q.pos[v]), zero);
+			_mm_store_ps(t.mat[v], _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(p), scale), offset));
+		}
+
+		simd.decode_UV(q.uv, t.tex_mat);
+
+		oct_Decode4(q.normals[0], n_w, n4);
+		out.v_normals[n] = { n4[0], n4[1], n4[2] };
+		out.f_normals[n] = n4[3];
+	}
+	out.t = out.tris;
+	out.f = out.f_normals;
+	out.v = out.v_normals;
+}
+
+static unsigned int morton_Spread(unsigned int v)
+{
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v << 8)) & 0x0300F00F;
+	v = (v | (v << 4)) & 0x030C30C3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+void mesh3d::build_Meshlets()
+{
+	delete[] meshlets;
+	meshlets = nullptr;
+	num_meshlets = 0;
+	if (num_triangles == 0)return;
+
+	// sort triangles along a Morton curve of their centroids so each run of MESHLET_SIZE is spatially compact
+	vec3d b_min = { FLT_MAX, FLT_MAX, FLT_MAX }, b_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	std::vector<vec3d> centroids(num_triangles);
+	for (int n = 0; n < num_triangles; n++) {
+		const mat_tri& t = triangles_list[n];
+		centroids[n] = { (t.mat[0][X] + t.mat[1][X] + t.mat[2][X]) / 3.0f,
+			(t.mat[0][Y] + t.mat[1][Y] + t.mat[2][Y]) / 3.0f,
+			(t.mat[0][Z] + t.mat[1][Z] + t.mat[2][Z]) / 3.0f };
+		b_min.x = min(b_min.x, centroids[n].x); b_max.x = max(b_max.x, centroids[n].x);
+		b_min.y = min(b_min.y, centroids[n].y); b_max.y = max(b_max.y, centroids[n].y);
+		b_min.z = min(b_min.z, centroids[n].z); b_max.z = max(b_max.z, centroids[n].z);
+	}
+
+	float ext = max(b_max.x - b_min.x, max(b_max.y - b_min.y, b_max.z - b_min.z));
+	float scl = (ext > 0.0f) ? 1023.0f / ext : 0.0f;
+	std::vector<unsigned int> codes(num_triangles);
+	std::vector<int> order(num_triangles);
+	for (int n = 0; n < num_triangles; n++) {
+		codes[n] = (morton_Spread((unsigned int)((centroids[n].x - b_min.x) * scl)) << 2) |
+			(morton_Spread((unsigned int)((centroids[n].y - b_min.y) * scl)) << 1) |
+			morton_Spread((unsigned int)((centroids[n].z - b_min.z) * scl));
+		order[n] = n;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+	reorder_Triangles(order.data());
+
+	num_meshlets = (num_triangles + MESHLET_SIZE - 1) / MESHLET_SIZE;
+	meshlets = new meshlet[num_meshlets];
+
+	for (int m = 0; m < num_meshlets; m++) {
+		meshlet& mlet = meshlets[m];
+		mlet.first_tri = m * MESHLET_SIZE;
+		mlet.n_tris = min(MESHLET_SIZE, num_triangles - mlet.first_tri);
+		int tri_end = mlet.first_tri + mlet.n_tris;
+
+		// bounding sphere around the box centre
+		vec3d c_min = { FLT_MAX, FLT_MAX, FLT_MAX }, c_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int n = mlet.first_tri; n < tri_end; n++)
+			for (int v = 0; v < 3; v++) {
+				const float* p = triangles_list[n].mat[v];
+				c_min.x = min(c_min.x, p[X]); c_max.x = max(c_max.x, p[X]);
+				c_min.y = min(c_min.y, p[Y]); c_max.y = max(c_max.y, p[Y]);
+				c_min.z = min(c_min.z, p[Z]); c_max.z = max(c_max.z, p[Z]);
+			}
+		mlet.center = { (c_min.x + c_max.x) * 0.5f, (c_min.y + c_max.y) * 0.5f, (c_min.z + c_max.z) * 0.5f };
+		float r2 = 0;
+		for (int n = mlet.first_tri; n < tri_end; n++)
+			for (int v = 0; v < 3; v++)
+				r2 = max(r2, sqrd_distance(mlet.center, { triangles_list[n].mat[v][X], triangles_list[n].mat[v][Y], triangles_list[n].mat[v][Z] }));
+		mlet.radius = sqrtf(r2);
+
+		// normal cone: average axis, widest deviation from it, and an apex behind every triangle's plane
+		vec3d axis = { 0, 0, 0, 0 };
+		for (int n = mlet.first_tri; n < tri_end; n++)
+			if (face_normals[n].x == face_normals[n].x) axis = axis + face_normals[n];
+		float l = lenth_vec3(axis);
+		mlet.cone_cutoff = 2.0f;
+		mlet.cone_apex = mlet.center;
+		if (l <= 0.0f)continue;
+		axis = axis / l; axis.w = 0;
+		mlet.cone_axis = axis;
+
+		float min_dp = 1.0f;
+		for (int n = mlet.first_tri; n < tri_end; n++)
+			if (face_normals[n].x == face_normals[n].x) min_dp = min(min_dp, dot_vec3(face_normals[n], axis));
+		if (min_dp <= 0.1f)continue;
+
+		float max_t = 0;
+		for (int n = mlet.first_tri; n < tri_end; n++) {
+			vec3d& fn = face_normals[n];
+			if (fn.x != fn.x)continue;
+			vec3d to_c = { mlet.center.x - triangles_list[n].mat[0][X], mlet.center.y - triangles_list[n].mat[0][Y], mlet.center.z - triangles_list[n].mat[0][Z], 0 };
+			max_t = max(max_t, dot_vec3(to_c, fn) / dot_vec3(axis, fn));
+		}
+		vec3d offs = axis * max_t;
+		mlet.cone_apex = mlet.center - offs;
+		mlet.cone_cutoff = sqrtf(1.0f - min_dp * min_dp);
 	}
 }
 
-int _3D::fnear_Clipping(float fnear, mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2)
+// Tipsify (Sander, Nehab and Barczak 2007) over one meshlet: triangles are fanned around the
+// vertex most likely to still be in a cache of cache_size entries. tris holds local vertex
+// ids, out receives the triangles in their new order.
+static void tipsify(const int* tris, int n_tris, int n_verts, int cache_size, int* out)
 {
-	vec_tri in; vec3d tmp_vert;
-	memcpy(&in, &tri_in, sizeof(vec_tri));
-
-	vec3d* p_in[3]; int in_count = 0;
-	vec3d* p_out[3]; int out_count = 0;
-	vec2d* t_in[3]; int in_texCount = 0;
-	vec2d* t_out[3]; int out_texCount = 0;
+	std::vector<int> adj_start(n_verts + 1, 0), adj(n_tris * 3), live(n_verts, 0), stamp(n_verts, 0);
+	for (int i = 0; i < n_tris * 3; i++) live[tris[i]]++;
+	for (int v = 0; v < n_verts; v++) adj_start[v + 1] = adj_start[v] + live[v];
+	{
+		std::vector<int> cursor(adj_start.begin(), adj_start.end() - 1);
+		for (int i = 0; i < n_tris * 3; i++) adj[cursor[tris[i]]++] = i / 3;
+	}
 
-	if ((in.vertx[0].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[0]; t_in[in_texCount++] = &in.tex_vertx[0]; }
-	else { p_out[out_count++] = &in.vertx[0]; t_out[out_texCount++] = &in.tex_vertx[0]; }
-	if ((in.vertx[1].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[1]; t_in[in_texCount++] = &in.tex_vertx[1]; }
-	else { p_out[out_count++] = &in.vertx[1];  t_out[out_texCount++] = &in.tex_vertx[1]; }
-	if ((in.vertx[2].z - fnear) >= 0) { p_in[in_count++] = &in.vertx[2]; t_in[in_texCount++] = &in.tex_vertx[2]; }
-	else { p_out[out_count++] = &in.vertx[2];  t_out[out_texCount++] = &in.tex_vertx[2]; }
+	std::vector<unsigned char> emitted(n_tris, 0);
+	std::vector<int> dead_end, candidates;
+	int fan = 0, time = cache_size + 1, scan = 1, n_out = 0;
+	while (fan >= 0) {
+		candidates.clear();
+		for (int a = adj_start[fan]; a < adj_start[fan + 1]; a++) {
+			int t = adj[a];
+			if (emitted[t])continue;
+			for (int k = 0; k < 3; k++) {
+				int v = tris[t * 3 + k];
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - stamp[v] > cache_size) stamp[v] = time++;
+			}
+			emitted[t] = 1;
+			out[n_out++] = t;
+		}
 
-	if (in_count == 0) return 0;
-	if (in_count == 3) { memcpy(&tri_out1, &tri_in, sizeof(mat_tri)); return 1; }
+		// next fan: a candidate that will still be cached once its triangles are out, else the
+		// most recent dead end, else the next vertex with triangles left
+		fan = -1;
+		int best = -1;
+		for (int v : candidates) {
+			if (live[v] <= 0)continue;
+			int p = (time - stamp[v] + 2 * live[v] <= cache_size) ? time - stamp[v] : 0;
+			if (p > best) { best = p; fan = v; }
+		}
+		while (fan < 0 && !dead_end.empty()) {
+			int v = dead_end.back();
+			dead_end.pop_back();
+			if (live[v] > 0) fan = v;
+		}
+		for (; fan < 0 && scan < n_verts; scan++)
+			if (live[scan] > 0) fan = scan;
+	}
+}
 
-	if (in_count == 1 && out_count == 2) {
-		tri_out1.color = tri_in.color;
-		//tri_out1.color.r = 250; tri_out1.color.g = 0; tri_out1.color.b = 0; tri_out1.color.a = 250;
+// Load time ordering, kept by chunk files since they store the arrays as built. Tipsify runs
+// inside each meshlet, then the meshlets are sorted so those facing away from the mesh centre
+// come first and occlude the rest (Sander et al.'s overdraw pass with meshlets as clusters).
+// Vertices are finally renumbered in first use order.
+void mesh3d::optimize_Order()
+{
+	if (num_meshlets == 0)return;
 
-		__m128 pin = _mm_loadu_ps(&p_in[0]->x);
-		_mm_storeu_ps(&tri_out1.mat[0][X], pin);
-		tri_out1.tex_mat[0] = *t_in[0];
-		
-		float t = (fnear - p_in[0]->z) / (p_out[0]->z - p_in[0]->z);
-		_mm_storeu_ps(&tri_out1.mat[1][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
-		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[1].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+	vec3d centre = { 0, 0, 0, 0 };
+	for (int m = 0; m < num_meshlets; m++) {
+		vec3d c = meshlets[m].center * (float)meshlets[m].n_tris;
+		centre = centre + c;
+	}
+	centre = centre / (float)num_triangles;
 
-		t = (fnear - p_in[0]->z) / (p_out[1]->z - p_in[0]->z);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[1]->x), pin), _mm_set1_ps(t), pin));
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[1]->u), tin), tin));
+	std::vector<float> facing(num_meshlets);
+	std::vector<int> m_order(num_meshlets);
+	for (int m = 0; m < num_meshlets; m++) {
+		facing[m] = dot_vec3(meshlets[m].center - centre, meshlets[m].cone_axis);
+		m_order[m] = m;
+	}
+	std::stable_sort(m_order.begin(), m_order.end(), [&](int a, int b) { return facing[a] > facing[b]; });
+
+	std::vector<int> order(num_triangles), local(num_vertices, -1), used;
+	int l_tris[MESHLET_SIZE * 3], l_order[MESHLET_SIZE];
+	meshlet* n_mlets = new meshlet[num_meshlets];
+	int at = 0;
+	for (int i = 0; i < num_meshlets; i++) {
+		meshlet mlet = meshlets[m_order[i]];
+		used.clear();
+		for (int k = 0; k < mlet.n_tris * 3; k++) {
+			int v = tri_vindx[mlet.first_tri * 3 + k];
+			if (local[v] < 0) { local[v] = (int)used.size(); used.push_back(v); }
+			l_tris[k] = local[v];
+		}
+		tipsify(l_tris, mlet.n_tris, (int)used.size(), VCACHE_SIZE, l_order);
+		for (int v : used) local[v] = -1;
 
-		return 1;
+		for (int n = 0; n < mlet.n_tris; n++) order[at + n] = mlet.first_tri + l_order[n];
+		mlet.first_tri = at;
+		n_mlets[i] = mlet;
+		at += mlet.n_tris;
 	}
-	if (in_count == 2 && out_count == 1) {
-		tri_out1.color = tri_in.color;
-		//tri_out1.color.r = 0; tri_out1.color.g = 250; tri_out1.color.b = 0; tri_out1.color.a = 250;
-		tri_out2.color = tri_in.color;
-		//tri_out2.color.r = 0; tri_out2.color.g = 0; tri_out2.color.b = 250; tri_out2.color.a = 250;
+	delete[] meshlets; meshlets = n_mlets;
+	reorder_Triangles(order.data());
+
+	// unreferenced vertices go last
+	std::vector<int> remap(num_vertices, -1);
+	vec3d* n_verts = new vec3d[num_vertices];
+	int next = 0;
+	for (int i = 0; i < num_triangles * 3; i++) {
+		int& v = tri_vindx[i];
+		if (remap[v] < 0) { remap[v] = next; n_verts[next++] = vertices[v]; }
+		v = remap[v];
+	}
+	for (int v = 0; v < num_vertices; v++)
+		if (remap[v] < 0) n_verts[next++] = vertices[v];
+	delete[] vertices; vertices = n_verts;
+}
 
-		__m128 pin = _mm_loadu_ps(&p_in[0]->x);
-		_mm_storeu_ps(&tri_out1.mat[0][X], pin);
-		__m128 pin_1 = _mm_loadu_ps(&p_in[1]->x);
-		_mm_storeu_ps(&tri_out1.mat[1][X], pin_1);
-		tri_out1.tex_mat[0] = *t_in[0];
-		tri_out1.tex_mat[1] = *t_in[1];
+// calls fn for every line of an obj file, read the way load_obj reads it; stops when fn returns false
+template<class F>
+static bool obj_Lines(const char* file, F fn)
+{
+	std::ifstream object(file);
+	if (!object.is_open())return false;
 
-		float t = (fnear - p_in[0]->z) / (p_out[0]->z - p_in[0]->z);
-		_mm_storeu_ps(&tri_out1.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin), _mm_set1_ps(t), pin));
-		__m128 tin = _mm_loadu_ps(&t_in[0]->u);
-		_mm_storeu_ps(&tri_out1.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
+	std::string text;
+	while (std::getline(object, text))
+		if (!fn(&text[0]))return false;
+	return true;
+}
 
-		_mm_storeu_ps(&tri_out2.mat[0][X], pin_1);
-		tri_out2.tex_mat[0] = *t_in[1];
-		_mm_storeu_ps(&tri_out2.mat[1][X], _mm_loadu_ps(&tri_out1.mat[2][X]));
-		tri_out2.tex_mat[1] = tri_out1.tex_mat[2];
+// offsets of a chunk's seven arrays from the chunk start, offs[7] is the chunk size
+static void chunk_Sections(const chunk_info& ci, uint64_t offs[8], uint64_t bytes[7])
+{
+	bytes[0] = sizeof(mat_tri) * (uint64_t)ci.num_triangles;
+	bytes[1] = sizeof(vec3d) * (uint64_t)ci.num_triangles;
+	bytes[2] = sizeof(vec3dx3) * (uint64_t)ci.num_triangles;
+	bytes[3] = sizeof(meshlet) * (uint64_t)ci.num_meshlets;
+	bytes[4] = sizeof(vec3d) * (uint64_t)ci.num_vertices;
+	bytes[5] = sizeof(int) * 3 * (uint64_t)ci.num_triangles;
+	bytes[6] = sizeof(mesh_edge) * (uint64_t)ci.num_edges;
+	offs[0] = 0;
+	for (int i = 0; i < 7; i++)
+		offs[i + 1] = offs[i] + (bytes[i] + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+}
 
-		t = (fnear - p_in[1]->z) / (p_out[0]->z - p_in[1]->z);
-		_mm_storeu_ps(&tri_out2.mat[2][X], _mm_fmadd_ps(_mm_sub_ps(_mm_loadu_ps(&p_out[0]->x), pin_1), _mm_set1_ps(t), pin_1));
-		tin = _mm_loadu_ps(&t_in[1]->u);
-		_mm_storeu_ps(&tri_out2.tex_mat[2].u, _mm_fmadd_ps(_mm_set1_ps(t), _mm_sub_ps(_mm_loadu_ps(&t_out[0]->u), tin), tin));
-		return 2;
-	}
+static bool write_Padded(FILE* f, const void* data, uint64_t bytes)
+{
+	static const char zeros[CHUNK_ALIGN] = { 0 };
+	uint64_t pad = (CHUNK_ALIGN - bytes % CHUNK_ALIGN) % CHUNK_ALIGN;
+	return (bytes == 0 || fwrite(data, 1, (size_t)bytes, f) == bytes) && (pad == 0 || fwrite(zeros, 1, (size_t)pad, f) == pad);
 }
 
-bool mesh3d::load_obj(const char* file, bool isTextured)
+// Pass 1 keeps the vertex positions and UVs, pass 2 accumulates vertex normals and counts the
+// triangles of each cell of a Morton ordered grid, pass 3 buckets the faces into a temporary file
+// by cell. Each cell is then built into mesh3d arrays (split along its own Morton curve when it
+// is over chunk_tris) and appended to the output.
+bool chunked_mesh::convert_obj(const char* obj_file, const char* out_file, bool isTextured, int chunk_tris)
 {
-	std::vector<vec_tri> tris;
-	std::ifstream object(file);
-	if (!object.is_open())return false;
-	num_triangles = 0;
+	chunk_tris = max(chunk_tris, MESHLET_SIZE);
 
 	std::vector<vec3d> verts;
 	std::vector<vec2d> texs;
-	std::vector<vec3d> f_indx;
-	
-	char line[128];
-	while (!object.eof())
+	int64_t n_faces = 0;
+	vec3d b_min = { FLT_MAX, FLT_MAX, FLT_MAX }, b_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	bool ok = obj_Lines(obj_file, [&](char* line) {
+		char* p = line;
+		if (line[0] == 'v' && line[1] == 't') {
+			vec2d v;
+			v.u = strtof(line + 2, &p);
+			v.v = strtof(p, &p);
+			texs.push_back(v);
+		}
+		else if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+			vec3d v;
+			v.x = strtof(line + 1, &p);
+			v.y = strtof(p, &p);
+			v.z = strtof(p, &p);
+			verts.push_back(v);
+			b_min.x = min(b_min.x, v.x); b_max.x = max(b_max.x, v.x);
+			b_min.y = min(b_min.y, v.y); b_max.y = max(b_max.y, v.y);
+			b_min.z = min(b_min.z, v.z); b_max.z = max(b_max.z, v.z);
+		}
+		else if (line[0] == 'f') n_faces++;
+		return true;
+	});
+	if (!ok || n_faces == 0 || n_faces > INT_MAX)return false;
+
+	// about chunk_tris per cell, at most 64^3 cells, cell ids are Morton codes
+	int bits = 0;
+	while (bits < 6 && ((int64_t)1 << (3 * bits)) * chunk_tris < n_faces) bits++;
+	int res = 1 << bits;
+	int n_cells = 1 << (3 * bits);
+	float scl[3];
+	for (int a = 0; a < 3; a++) {
+		float ext = (&b_max.x)[a] - (&b_min.x)[a];
+		scl[a] = (ext > 0.0f) ? res / ext : 0.0f;
+	}
+	auto cell_Of = [&](const obj_face_rec& f) {
+		unsigned int c[3];
+		for (int a = 0; a < 3; a++) {
+			float m = ((&verts[f.v[0]].x)[a] + (&verts[f.v[1]].x)[a] + (&verts[f.v[2]].x)[a]) / 3.0f;
+			c[a] = (unsigned int)min(max((int)((m - (&b_min.x)[a]) * scl[a]), 0), res - 1);
+		}
+		return (int)((morton_Spread(c[0]) << 2) | (morton_Spread(c[1]) << 1) | morton_Spread(c[2]));
+	};
+
+	std::vector<vec3d> v_normals(verts.size(), vec3d{ 0, 0, 0, 0 });
+	std::vector<uint64_t> cell_start(n_cells + 1, 0);
+	int nv = 0, nt = 0;
+	ok = obj_Lines(obj_file, [&](char* line) {
+		if (line[0] == 'v') {
+			if (line[1] == 't') nt++;
+			else if (line[1] == ' ' || line[1] == '\t') nv++;
+			return true;
+		}
+		if (line[0] != 'f')return true;
+
+		// indices are checked against what is defined so far, as load_obj does
+		obj_face_rec f;
+		if (!obj_Face(line, f, nv, nt, isTextured))return false;
+		vec_tri tri = { { verts[f.v[0]], verts[f.v[1]], verts[f.v[2]] }, {} };
+		vec3d n = mesh3d::face_Cross(tri);
+		for (int k = 0; k < 3; k++) v_normals[f.v[k]] = v_normals[f.v[k]] + n;
+		cell_start[cell_Of(f) + 1]++;
+		return true;
+	});
+	if (!ok)return false;
+	for (vec3d& n : v_normals) mesh3d::finish_Normal(n);
+	for (int c = 0; c < n_cells; c++) cell_start[c + 1] += cell_start[c];
+
+	std::string tmp_path = std::string(out_file) + ".tmp";
+	FILE* tmp = fopen(tmp_path.c_str(), "w+b");
+	if (!tmp)return false;
+
+	// faces are buffered per cell and written at the cell's running position
 	{
-		object.getline(line, 128);
-
-		std::strstream s;
-		s << line;
+		std::vector<uint64_t> cursor(cell_start.begin(), cell_start.end() - 1);
+		std::vector<std::vector<obj_face_rec>> pending(n_cells);
+		size_t flush_at = min(max((size_t)(1 << 22) / n_cells, (size_t)16), (size_t)1024);
+		auto flush = [&](int c) {
+			std::vector<obj_face_rec>& b = pending[c];
+			if (b.empty())return true;
+			if (_fseeki64(tmp, (int64_t)(cursor[c] * sizeof(obj_face_rec)), SEEK_SET) != 0 ||
+				fwrite(b.data(), sizeof(obj_face_rec), b.size(), tmp) != b.size())return false;
+			cursor[c] += b.size();
+			b.clear();
+			return true;
+		};
+		ok = obj_Lines(obj_file, [&](char* line) {
+			if (line[0] != 'f')return true;
+			obj_face_rec f;
+			obj_Face(line, f, (int)verts.size(), (int)texs.size(), isTextured);
+			int c = cell_Of(f);
+			pending[c].push_back(f);
+			return pending[c].size() < flush_at || flush(c);
+		});
+		for (int c = 0; c < n_cells && ok; c++) ok = flush(c);
+	}
 
-		char junk;
+	FILE* out = ok ? fopen(out_file, "wb") : nullptr;
+	ok = out != nullptr;
+
+	chunk_file_header hdr = {};
+	memcpy(hdr.magic, "PGCM", 4);
+	hdr.version = 1;
+	hdr.sizes[0] = sizeof(mat_tri); hdr.sizes[1] = sizeof(meshlet); hdr.sizes[2] = sizeof(mesh_edge); hdr.sizes[3] = sizeof(chunk_info);
+	hdr.num_triangles = (int)n_faces;
+	hdr.bb_min = b_min; hdr.bb_max = b_max;
+	ok = ok && write_Padded(out, &hdr, sizeof(hdr));
+	uint64_t at = (sizeof(hdr) + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+	std::vector<chunk_info> table;
+
+	auto emit_Chunk = [&](const obj_face_rec* faces, int n) {
+		std::unordered_map<int, int> local;
+		std::vector<vec3d> c_verts, c_normals;
+		std::vector<vec_tri> tris(n);
+		std::vector<int> f_indx(n * 3);
+		for (int i = 0; i < n; i++)
+			for (int k = 0; k < 3; k++) {
+				int v = faces[i].v[k];
+				auto it = local.find(v);
+				if (it == local.end()) {
+					it = local.emplace(v, (int)c_verts.size()).first;
+					c_verts.push_back(verts[v]);
+					c_normals.push_back(v_normals[v]);
+				}
+				f_indx[i * 3 + k] = it->second;
+				tris[i].vertx[k] = verts[v];
+				if (isTextured) tris[i].tex_vertx[k] = texs[faces[i].vt[k]];
+			}
 
-		if (line[0] == 'v')
-		{
-			if (line[1] == 't')
-			{
-				vec2d v;
-				s >> junk >> junk >> v.u >> v.v;
-				texs.push_back(v);
+		std::vector<vec3d> f_normals;
+		mesh3d::face_Normals(tris, f_normals);
+		mesh3d m;
+		m.assemble(tris, f_indx, f_normals.data(), c_normals.data(), c_verts);
+		chunk_info ci = { at, m.num_triangles, m.num_meshlets, m.num_vertices, m.num_edges, m.bb_min, m.bb_max };
+		uint64_t offs[8], bytes[7];
+		chunk_Sections(ci, offs, bytes);
+		const void* data[7] = { m.triangles_list, m.face_normals, m.vertex_normals, m.meshlets, m.vertices, m.tri_vindx, m.edges };
+		for (int i = 0; i < 7; i++)
+			if (!write_Padded(out, data[i], bytes[i]))return false;
+		table.push_back(ci);
+		at += offs[7];
+		return true;
+	};
+
+	std::vector<obj_face_rec> cell;
+	std::vector<unsigned int> codes;
+	std::vector<int> order;
+	for (int c = 0; c < n_cells && ok; c++) {
+		int count = (int)(cell_start[c + 1] - cell_start[c]);
+		if (count == 0)continue;
+		cell.resize(count);
+		ok = _fseeki64(tmp, (int64_t)(cell_start[c] * sizeof(obj_face_rec)), SEEK_SET) == 0 &&
+			fread(cell.data(), sizeof(obj_face_rec), count, tmp) == (size_t)count;
+		if (!ok)break;
+
+		if (count > chunk_tris) {
+			vec3d c_min = { FLT_MAX, FLT_MAX, FLT_MAX }, c_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			std::vector<vec3d> centroids(count);
+			for (int i = 0; i < count; i++) {
+				for (int a = 0; a < 3; a++)
+					(&centroids[i].x)[a] = ((&verts[cell[i].v[0]].x)[a] + (&verts[cell[i].v[1]].x)[a] + (&verts[cell[i].v[2]].x)[a]) / 3.0f;
+				c_min.x = min(c_min.x, centroids[i].x); c_max.x = max(c_max.x, centroids[i].x);
+				c_min.y = min(c_min.y, centroids[i].y); c_max.y = max(c_max.y, centroids[i].y);
+				c_min.z = min(c_min.z, centroids[i].z); c_max.z = max(c_max.z, centroids[i].z);
 			}
-			else
-			{
-				vec3d v;
-				s >> junk >> v.x >> v.y >> v.z;
-				verts.push_back(v);
+			float ext = max(c_max.x - c_min.x, max(c_max.y - c_min.y, c_max.z - c_min.z));
+			float c_scl = (ext > 0.0f) ? 1023.0f / ext : 0.0f;
+			codes.resize(count);
+			order.resize(count);
+			for (int i = 0; i < count; i++) {
+				codes[i] = (morton_Spread((unsigned int)((centroids[i].x - c_min.x) * c_scl)) << 2) |
+					(morton_Spread((unsigned int)((centroids[i].y - c_min.y) * c_scl)) << 1) |
+					morton_Spread((unsigned int)((centroids[i].z - c_min.z) * c_scl));
+				order[i] = i;
 			}
+			std::sort(order.begin(), order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+			std::vector<obj_face_rec> sorted(count);
+			for (int i = 0; i < count; i++) sorted[i] = cell[order[i]];
+			cell.swap(sorted);
 		}
 
-		if (!isTextured)
-		{
-			if (line[0] == 'f')
-			{
-				int f[3];
-				s >> junk >> f[0] >> f[1] >> f[2];
-				tris.push_back({ verts[f[0] - 1], verts[f[1] - 1], verts[f[2] - 1] });
-				f_indx.push_back({ (float)f[0] - 1, (float)f[1] - 1, (float)f[2] - 1, 0 });
-				num_triangles++;
-			}
+		// even pieces, so a cell just over the limit does not leave a sliver chunk
+		int pieces = (count + chunk_tris - 1) / chunk_tris;
+		for (int i = 0; i < pieces && ok; i++) {
+			int first = (int)((int64_t)count * i / pieces), last = (int)((int64_t)count * (i + 1) / pieces);
+			ok = emit_Chunk(&cell[first], last - first);
 		}
-		else
-		{
-			if (line[0] == 'f')
-			{
-				s >> junk;
-				std::string tokens[6];
-				int nTokenCount = -1;
+	}
 
-				while (!s.eof())
-				{
-					char c = s.get();
-					if (c == ' ' || c == '/')
-						nTokenCount++;
-					else
-						tokens[nTokenCount].append(1, c);
-				}
-				tokens[nTokenCount].pop_back();
+	fclose(tmp);
+	remove(tmp_path.c_str());
 
-				tris.push_back({ verts[stoi(tokens[0]) - 1], verts[stoi(tokens[2]) - 1], verts[stoi(tokens[4]) - 1],
-					texs[stoi(tokens[1]) - 1], texs[stoi(tokens[3]) - 1], texs[stoi(tokens[5]) - 1] });
-				f_indx.push_back({ (float)stoi(tokens[0]) - 1, (float)stoi(tokens[2]) - 1, (float)stoi(tokens[4]) - 1, 0 });
-				num_triangles++;
-			}
+	if (ok) {
+		hdr.num_chunks = (int)table.size();
+		hdr.table_offset = at;
+		ok = fwrite(table.data(), sizeof(chunk_info), table.size(), out) == table.size() &&
+			fseek(out, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+	}
+	if (out && fclose(out) != 0) ok = false;
+	if (!ok && out) remove(out_file);
+	return ok;
+}
 
-		}
+// every meshlet, vertex index and edge of a mapped chunk stays inside the chunk's own arrays
+bool chunked_mesh::indices_Valid(const mesh3d& m)
+{
+	for (int i = 0; i < m.num_meshlets; i++) {
+		const meshlet& ml = m.meshlets[i];
+		if (ml.first_tri < 0 || ml.n_tris < 0 || (int64_t)ml.first_tri + ml.n_tris > m.num_triangles)return false;
+	}
+	for (int i = 0; i < 3 * m.num_triangles; i++)
+		if (m.tri_vindx[i] < 0 || m.tri_vindx[i] >= m.num_vertices)return false;
+	for (int i = 0; i < m.num_edges; i++) {
+		const mesh_edge& e = m.edges[i];
+		if (e.v0 < 0 || e.v0 >= m.num_vertices || e.v1 < 0 || e.v1 >= m.num_vertices ||
+			e.f0 < 0 || e.f0 >= m.num_triangles || e.f1 < -1 || e.f1 >= m.num_triangles)return false;
 	}
+	return true;
+}
 
-	vec3d* v_normals = new vec3d[verts.size()];
-	memset(v_normals, 0, sizeof(vec3d) * verts.size());
-	for (int i = 0; i < num_triangles; i++) {
-		vec_tri tri = tris[i];
-		vec3d l1, l2, normal;
-		l1 = tri.vertx[1] - tri.vertx[0];
-		l2 = tri.vertx[2] - tri.vertx[0];
-		normal = cross_vec3(l1, l2);
-		normalise_vec3(normal);
-		v_normals[(int)f_indx[i].x] = v_normals[(int)f_indx[i].x] + normal;
-		v_normals[(int)f_indx[i].y] = v_normals[(int)f_indx[i].y] + normal;
-		v_normals[(int)f_indx[i].z] = v_normals[(int)f_indx[i].z] + normal;
-		normalise_vec3(v_normals[(int)f_indx[i].x ]);
-		normalise_vec3(v_normals[(int)f_indx[i].y ]);
-		normalise_vec3(v_normals[(int)f_indx[i].z ]);
+bool chunked_mesh::open(const char* path)
+{
+	close();
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = nullptr;
+		return false;
 	}
 
-	triangles_list = new mat_tri[num_triangles];
-	face_normals = new vec3d[num_triangles];
-	vertex_normals = new vec3dx3[num_triangles];
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(chunk_file_header)) {
+		close();
+		return false;
+	}
+	file_size = (uint64_t)size.QuadPart;
 
-	for (int n = 0; n < num_triangles; n++) {
-		vec_tri triangle = tris[n]; vec3d l1, l2, normal;
-		for (int i = 0; i < 3; i++) {
-			triangles_list[n].mat[i][X] = triangle.vertx[i].x;
-			triangles_list[n].mat[i][Y] = triangle.vertx[i].y;
-			triangles_list[n].mat[i][Z] = triangle.vertx[i].z;
-			triangles_list[n].mat[i][W] = triangle.vertx[i].w;
+	// one view of the whole file; the OS pages a chunk in when it is first drawn
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping) base = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!base) {
+		close();
+		return false;
+	}
 
-			triangles_list[n].tex_mat[i] = triangle.tex_vertx[i];
+	const chunk_file_header* hdr = (const chunk_file_header*)base;
+	int sizes[4] = { (int)sizeof(mat_tri), (int)sizeof(meshlet), (int)sizeof(mesh_edge), (int)sizeof(chunk_info) };
+	if (memcmp(hdr->magic, "PGCM", 4) != 0 || hdr->version != 1 || memcmp(hdr->sizes, sizes, sizeof(sizes)) != 0 ||
+		hdr->num_chunks < 0 || hdr->table_offset % CHUNK_ALIGN != 0 || hdr->table_offset > file_size ||
+		(file_size - hdr->table_offset) / sizeof(chunk_info) < (uint64_t)hdr->num_chunks) {
+		close();
+		return false;
+	}
+
+	// the views point at their chunk's arrays; only the index arrays are read here, so a
+	// corrupt file cannot send the rasterizer or the wireframe outside the mapped view
+	num_chunks = hdr->num_chunks;
+	num_triangles = hdr->num_triangles;
+	bb_min = hdr->bb_min; bb_max = hdr->bb_max;
+	chunks = (const chunk_info*)(base + hdr->table_offset);
+	views = new mesh3d[num_chunks];
+	for (int c = 0; c < num_chunks; c++) {
+		const chunk_info& ci = chunks[c];
+		uint64_t offs[8], bytes[7];
+		if (ci.num_triangles < 0 || ci.num_meshlets < 0 || ci.num_vertices < 0 || ci.num_edges < 0 ||
+			ci.offset % CHUNK_ALIGN != 0 || ci.offset > file_size) {
+			close();
+			return false;
+		}
+		chunk_Sections(ci, offs, bytes);
+		if (offs[7] > file_size - ci.offset) {
+			close();
+			return false;
 		}
 
-		l1 = triangle.vertx[1] - triangle.vertx[0];
-		l2 = triangle.vertx[2] - triangle.vertx[0];
-		normal = cross_vec3(l1, l2);
-		normalise_vec3(normal);
-		face_normals[n] = normal; face_normals[n].w = 0;
-		vertex_normals[n] = { v_normals[(int)f_indx[n].x], v_normals[(int)f_indx[n].y] ,v_normals[(int)f_indx[n].z] };
+		const unsigned char* p = base + ci.offset;
+		mesh3d& m = views[c];
+		m.is_view = true;
+		m.num_triangles = ci.num_triangles;
+		m.triangles_list = (mat_tri*)(p + offs[0]);
+		m.face_normals = (vec3d*)(p + offs[1]);
+		m.vertex_normals = (vec3dx3*)(p + offs[2]);
+		m.num_meshlets = ci.num_meshlets;
+		m.meshlets = (meshlet*)(p + offs[3]);
+		m.num_vertices = ci.num_vertices;
+		m.vertices = (vec3d*)(p + offs[4]);
+		m.tri_vindx = (int*)(p + offs[5]);
+		m.num_edges = ci.num_edges;
+		m.edges = (mesh_edge*)(p + offs[6]);
+		m.bb_min = ci.bb_min;
+		m.bb_max = ci.bb_max;
+		if (!indices_Valid(m)) {
+			close();
+			return false;
+		}
 	}
 
-	tris.clear();
-	tris.shrink_to_fit();
-	object.close();
-	delete[] v_normals;
-
 	return true;
 }
 
+void chunked_mesh::close()
+{
+	delete[] views;
+	views = nullptr;
+	chunks = nullptr;
+	num_chunks = 0;
+	num_triangles = 0;
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+	base = nullptr;
+	mapping = nullptr;
+	file = nullptr;
+	file_size = 0;
+}
+
+void chunked_mesh::bind_Texture(Texture* tex)
+{
+	for (int c = 0; c < num_chunks; c++) views[c].mtexture = tex;
+}
+
+asset_loader::asset_loader(int n_threads)
+{
+	active = 0;
+	stopping = false;
+	for (int i = 0; i < max(n_threads, 1); i++)
+		workers.emplace_back(&asset_loader::worker_Loop, this);
+}
+
+asset_loader::~asset_loader()
+{
+	std::unique_lock<std::mutex> unq_lock(job_lock);
+	stopping = true;
+	unq_lock.unlock();
+	job_cv.notify_all();
+	for (std::thread& t : workers) t.join();
+}
+
+void asset_loader::worker_Loop()
+{
+	while (true) {
+		std::unique_lock<std::mutex> unq_lock(job_lock);
+		job_cv.wait(unq_lock, [=] {return (!jobs.empty() || stopping); });
+		if (jobs.empty())return;
+
+		std::function<void()> job = std::move(jobs.front());
+		jobs.pop_front();
+		active++;
+		unq_lock.unlock();
+
+		job();
+
+		unq_lock.lock();
+		active--;
+		unq_lock.unlock();
+		job_cv.notify_all();
+	}
+}
+
+std::shared_future<bool> asset_loader::submit(std::function<bool()> work)
+{
+	auto task = std::make_shared<std::packaged_task<bool()>>(std::move(work));
+	std::shared_future<bool> result = task->get_future().share();
+
+	std::unique_lock<std::mutex> unq_lock(job_lock);
+	jobs.push_back([task] { (*task)(); });
+	unq_lock.unlock();
+	job_cv.notify_all();
+	return result;
+}
+
+std::shared_future<bool> asset_loader::load_Texture(Texture* tex, const char* jpeg_path)
+{
+	tex->pending.store(true, std::memory_order_relaxed);
+	std::string path = jpeg_path;
+	return submit([tex, path] {
+		delete[] tex->data;
+		tex->data = nullptr;
+		bool ok = tex->load_image_data(path.c_str());
+		tex->pending.store(false, std::memory_order_release);
+		return ok;
+	});
+}
+
+std::shared_future<bool> asset_loader::load_Mesh(mesh3d* mesh, const char* obj_path, bool isTextured, Texture* tex)
+{
+	mesh->pending.store(true, std::memory_order_relaxed);
+	if (tex) mesh->bind_Texture(tex);
+	std::string path = obj_path;
+	return submit([mesh, path, isTextured] {
+		bool ok = mesh->load_obj(path.c_str(), isTextured);
+		mesh->pending.store(false, std::memory_order_release);
+		return ok;
+	});
+}
+
+void asset_loader::wait_All()
+{
+	std::unique_lock<std::mutex> unq_lock(job_lock);
+	job_cv.wait(unq_lock, [=] {return (jobs.empty() && active == 0); });
+}
+
+int asset_loader::pending_Jobs()
+{
+	std::unique_lock<std::mutex> unq_lock(job_lock);
+	return (int)jobs.size() + active;
+}
+
 bool Texture::load_image_data(const char* jpeg_path)
 {
 	FILE* pFile = fopen(jpeg_path, "rb");
@@ -1525,3 +4792,330 @@ bool Texture::load_image_data(const char* jpeg_path)
 	fclose(pFile);
 	return true;
 }
+
+static inline float box_Area(const bound_box& b)
+{
+	float dx = b.max.x - b.min.x, dy = b.max.y - b.min.y, dz = b.max.z - b.min.z;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static inline bound_box box_Union(const bound_box& a, const bound_box& b)
+{
+	bound_box r;
+	r.min = { min(a.min.x, b.min.x), min(a.min.y, b.min.y), min(a.min.z, b.min.z) };
+	r.max = { max(a.max.x, b.max.x), max(a.max.y, b.max.y), max(a.max.z, b.max.z) };
+	return r;
+}
+
+static inline bool box_Contains(const bound_box& outer, const bound_box& inner)
+{
+	return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+		outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+}
+
+bound_box scene3d::world_Box(const mesh3d* mesh, const mat4x4& m)
+{
+	// transformed centre plus absolute-matrix extents
+	vec3d c = { (mesh->bb_min.x + mesh->bb_max.x) * 0.5f, (mesh->bb_min.y + mesh->bb_max.y) * 0.5f, (mesh->bb_min.z + mesh->bb_max.z) * 0.5f };
+	vec3d e = { (mesh->bb_max.x - mesh->bb_min.x) * 0.5f, (mesh->bb_max.y - mesh->bb_min.y) * 0.5f, (mesh->bb_max.z - mesh->bb_min.z) * 0.5f };
+	float wc[3], we[3];
+	for (int j = 0; j < 3; j++) {
+		wc[j] = c.x * m.mat[0][j] + c.y * m.mat[1][j] + c.z * m.mat[2][j] + m.mat[3][j];
+		we[j] = e.x * _abs_(m.mat[0][j]) + e.y * _abs_(m.mat[1][j]) + e.z * _abs_(m.mat[2][j]);
+	}
+	bound_box b;
+	b.min = { wc[X] - we[X], wc[Y] - we[Y], wc[Z] - we[Z] };
+	b.max = { wc[X] + we[X], wc[Y] + we[Y], wc[Z] + we[Z] };
+	return b;
+}
+
+int scene3d::add_Instance(mesh3d* mesh, const mat4x4& world_mat, Draw_Type type)
+{
+	// the box is taken from the mesh once, so a mesh still being loaded has nothing to take it from
+	if (mesh == nullptr || !mesh->is_Ready())return -1;
+	int id = instances.acquire();
+	mesh_instance& inst = instances[id];
+	inst.mesh = mesh;
+	inst.world_mat = world_mat;
+	inst.inv_world = affine_mat_inverse(world_mat);
+	inst.type = type;
+	inst.box = world_Box(mesh, world_mat);
+
+	int leaf = nodes.acquire();
+	nodes[leaf].box = fat_Box(inst.box);
+	nodes[leaf].instance = id;
+	inst.node = leaf;
+	insert_Leaf(leaf);
+	return id;
+}
+
+void scene3d::remove_Instance(int id)
+{
+	if (id < 0 || id >= (int)instances.size() || instances[id].mesh == nullptr)return;
+	remove_Leaf(instances[id].node);
+	nodes.release(instances[id].node);
+	instances[id] = mesh_instance();
+	instances.release(id);
+}
+
+void scene3d::set_Transform(int id, const mat4x4& world_mat)
+{
+	if (id < 0 || id >= (int)instances.size() || instances[id].mesh == nullptr)return;
+	mesh_instance& inst = instances[id];
+	inst.world_mat = world_mat;
+	inst.inv_world = affine_mat_inverse(world_mat);
+	inst.box = world_Box(inst.mesh, world_mat);
+
+	// still inside the fattened leaf box: nothing in the tree changes
+	if (box_Contains(nodes[inst.node].box, inst.box))return;
+
+	remove_Leaf(inst.node);
+	nodes[inst.node].box = fat_Box(inst.box);
+	insert_Leaf(inst.node);
+}
+
+bound_box scene3d::fat_Box(const bound_box& b)
+{
+	float m = BVH_MARGIN * max(b.max.x - b.min.x, max(b.max.y - b.min.y, b.max.z - b.min.z));
+	bound_box f;
+	f.min = { b.min.x - m, b.min.y - m, b.min.z - m };
+	f.max = { b.max.x + m, b.max.y + m, b.max.z + m };
+	return f;
+}
+
+void scene3d::insert_Leaf(int leaf)
+{
+	if (root == -1) {
+		root = leaf;
+		nodes[root].parent = -1;
+		return;
+	}
+
+	// walk down picking the cheaper child by surface area increase
+	bound_box leaf_box = nodes[leaf].box;
+	int index = root;
+	while (nodes[index].left != -1) {
+		int l = nodes[index].left, r = nodes[index].right;
+		float area = box_Area(nodes[index].box);
+		float combined = box_Area(box_Union(nodes[index].box, leaf_box));
+		float cost = 2.0f * combined;
+		float inherit = 2.0f * (combined - area);
+
+		float cost_l = box_Area(box_Union(leaf_box, nodes[l].box)) + inherit;
+		if (nodes[l].left != -1) cost_l -= box_Area(nodes[l].box);
+		float cost_r = box_Area(box_Union(leaf_box, nodes[r].box)) + inherit;
+		if (nodes[r].left != -1) cost_r -= box_Area(nodes[r].box);
+
+		if (cost < cost_l && cost < cost_r)break;
+		index = (cost_l < cost_r) ? l : r;
+	}
+
+	int sibling = index;
+	int old_parent = nodes[sibling].parent;
+	int new_parent = nodes.acquire();
+	nodes[new_parent].parent = old_parent;
+	nodes[new_parent].box = box_Union(leaf_box, nodes[sibling].box);
+	nodes[new_parent].height = nodes[sibling].height + 1;
+	nodes[new_parent].left = sibling;
+	nodes[new_parent].right = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	if (old_parent != -1) {
+		if (nodes[old_parent].left == sibling) nodes[old_parent].left = new_parent;
+		else nodes[old_parent].right = new_parent;
+	}
+	else root = new_parent;
+
+	refit_Up(nodes[leaf].parent);
+}
+
+void scene3d::remove_Leaf(int leaf)
+{
+	if (leaf == root) {
+		root = -1;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grand = nodes[parent].parent;
+	int sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+
+	if (grand != -1) {
+		if (nodes[grand].left == parent) nodes[grand].left = sibling;
+		else nodes[grand].right = sibling;
+		nodes[sibling].parent = grand;
+		nodes.release(parent);
+		refit_Up(grand);
+	}
+	else {
+		root = sibling;
+		nodes[sibling].parent = -1;
+		nodes.release(parent);
+	}
+	nodes[leaf].parent = -1;
+}
+
+void scene3d::refit_Up(int index)
+{
+	while (index != -1) {
+		index = balance(index);
+		int l = nodes[index].left, r = nodes[index].right;
+		nodes[index].height = 1 + max(nodes[l].height, nodes[r].height);
+		nodes[index].box = box_Union(nodes[l].box, nodes[r].box);
+		index = nodes[index].parent;
+	}
+}
+
+int scene3d::balance(int a)
+{
+	// AVL style rotation: lift the taller grandchild when the children heights differ by more than one
+	if (nodes[a].left == -1 || nodes[a].height < 2)return a;
+
+	int b = nodes[a].left, c = nodes[a].right;
+	int diff = nodes[c].height - nodes[b].height;
+	if (diff > 1) return rotate(a, c, b);
+	if (diff < -1) return rotate(a, b, c);
+	return a;
+}
+
+int scene3d::rotate(int a, int tall, int other)
+{
+	// 'tall' replaces 'a'; a keeps 'other' and the shorter of tall's children
+	int f = nodes[tall].left, g = nodes[tall].right;
+
+	nodes[tall].left = a;
+	nodes[tall].parent = nodes[a].parent;
+	nodes[a].parent = tall;
+
+	if (nodes[tall].parent != -1) {
+		if (nodes[nodes[tall].parent].left == a) nodes[nodes[tall].parent].left = tall;
+		else nodes[nodes[tall].parent].right = tall;
+	}
+	else root = tall;
+
+	int keep = (nodes[f].height > nodes[g].height) ? f : g;
+	int give = (keep == f) ? g : f;
+	nodes[tall].right = keep;
+	nodes[a].left = other;
+	nodes[a].right = give;
+	nodes[give].parent = a;
+
+	nodes[a].box = box_Union(nodes[other].box, nodes[give].box);
+	nodes[a].height = 1 + max(nodes[other].height, nodes[give].height);
+	nodes[tall].box = box_Union(nodes[a].box, nodes[keep].box);
+	nodes[tall].height = 1 + max(nodes[a].height, nodes[keep].height);
+	return tall;
+}
+
+void scene3d::query_Frustum(const mat4x4& view_proj, std::vector<int>& out) const
+{
+	out.clear();
+	if (root == -1)return;
+
+	vec3d planes[5];
+	frustum_Planes(view_proj, planes);
+
+	std::vector<int> stack;
+	stack.push_back(root);
+	while (!stack.empty()) {
+		int n = stack.back(); stack.pop_back();
+		const bound_box& b = (nodes[n].left == -1) ? instances[nodes[n].instance].box : nodes[n].box;
+
+		bool outside = false;
+		for (int p = 0; p < 5 && !outside; p++) {
+			// farthest box corner along the plane normal
+			float px = (planes[p].x >= 0.0f) ? b.max.x : b.min.x;
+			float py = (planes[p].y >= 0.0f) ? b.max.y : b.min.y;
+			float pz = (planes[p].z >= 0.0f) ? b.max.z : b.min.z;
+			outside = (planes[p].x * px + planes[p].y * py + planes[p].z * pz + planes[p].w) < 0.0f;
+		}
+		if (outside)continue;
+
+		if (nodes[n].left == -1) out.push_back(nodes[n].instance);
+		else { stack.push_back(nodes[n].left); stack.push_back(nodes[n].right); }
+	}
+}
+
+static inline bool ray_Box(const bound_box& b, const vec3d& o, const vec3d& inv_d, float t_max)
+{
+	float t1 = (b.min.x - o.x) * inv_d.x, t2 = (b.max.x - o.x) * inv_d.x;
+	float t_near = min(t1, t2), t_far = max(t1, t2);
+	t1 = (b.min.y - o.y) * inv_d.y; t2 = (b.max.y - o.y) * inv_d.y;
+	t_near = max(t_near, min(t1, t2)); t_far = min(t_far, max(t1, t2));
+	t1 = (b.min.z - o.z) * inv_d.z; t2 = (b.max.z - o.z) * inv_d.z;
+	t_near = max(t_near, min(t1, t2)); t_far = min(t_far, max(t1, t2));
+	return t_far >= max(t_near, 0.0f) && t_near <= t_max;
+}
+
+bool scene3d::ray_Mesh(const mesh_instance& inst, const vec3d& origin, const vec3d& dir, ray_hit& hit) const
+{
+	// ray into object space; t stays comparable because the direction is not renormalised
+	vec3d o, d;
+	for (int j = 0; j < 3; j++) {
+		(&o.x)[j] = origin.x * inst.inv_world.mat[0][j] + origin.y * inst.inv_world.mat[1][j] + origin.z * inst.inv_world.mat[2][j] + inst.inv_world.mat[3][j];
+		(&d.x)[j] = dir.x * inst.inv_world.mat[0][j] + dir.y * inst.inv_world.mat[1][j] + dir.z * inst.inv_world.mat[2][j];
+	}
+	float dd = dot_vec3(d, d);
+	bool found = false;
+	const mesh3d* mesh = inst.mesh;
+
+	for (int m = 0; m < mesh->num_meshlets; m++) {
+		const meshlet& mlet = mesh->meshlets[m];
+		vec3d oc = { mlet.center.x - o.x, mlet.center.y - o.y, mlet.center.z - o.z };
+		float tc = dot_vec3(oc, d);
+		float dist2 = dot_vec3(oc, oc) - tc * tc / dd;
+		if (dist2 > mlet.radius * mlet.radius)continue;
+
+		tri_batch tb;
+		for (int i = mlet.first_tri; i < mlet.first_tri + mlet.n_tris; i++) {
+			int k = (i - mlet.first_tri) & 3;
+			if (k == 0) mesh->fetch_Batch(i, min(4, mlet.first_tri + mlet.n_tris - i), tb);
+
+			// Moller-Trumbore, both sides
+			const mat_tri& t = tb.t[k];
+			vec3d v0 = { t.mat[0][X], t.mat[0][Y], t.mat[0][Z] };
+			vec3d e1 = { t.mat[1][X] - v0.x, t.mat[1][Y] - v0.y, t.mat[1][Z] - v0.z };
+			vec3d e2 = { t.mat[2][X] - v0.x, t.mat[2][Y] - v0.y, t.mat[2][Z] - v0.z };
+			vec3d pv = cross_vec3(d, e2);
+			float det = dot_vec3(e1, pv);
+			if (_abs_(det) < 1e-12f)continue;
+			float inv_det = 1.0f / det;
+			vec3d tv = o - v0;
+			float u = dot_vec3(tv, pv) * inv_det;
+			if (u < 0.0f || u > 1.0f)continue;
+			vec3d qv = cross_vec3(tv, e1);
+			float v = dot_vec3(d, qv) * inv_det;
+			if (v < 0.0f || u + v > 1.0f)continue;
+			float dist = dot_vec3(e2, qv) * inv_det;
+			if (dist <= 0.0f || dist >= hit.distance)continue;
+
+			hit.distance = dist; hit.triangle = i; hit.u = u; hit.v = v;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool scene3d::ray_Cast(const vec3d& origin, const vec3d& dir, ray_hit& hit) const
+{
+	hit = ray_hit();
+	if (root == -1)return false;
+
+	vec3d inv_d = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+	std::vector<int> stack;
+	stack.push_back(root);
+	while (!stack.empty()) {
+		int n = stack.back(); stack.pop_back();
+		if (!ray_Box(nodes[n].box, origin, inv_d, hit.distance))continue;
+
+		if (nodes[n].left != -1) {
+			stack.push_back(nodes[n].left); stack.push_back(nodes[n].right);
+			continue;
+		}
+		const mesh_instance& inst = instances[nodes[n].instance];
+		if (!ray_Box(inst.box, origin, inv_d, hit.distance))continue;
+		if (ray_Mesh(inst, origin, dir, hit)) hit.instance = nodes[n].instance;
+	}
+	return hit.instance != -1;
+}
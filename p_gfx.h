@@ -3,19 +3,55 @@
 #include <d2d1_1.h>
 #include <cassert>
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <fstream>
-#include <strstream>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
+#include <future>
 #include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <climits>
 #include <immintrin.h>
 #include <jpeglib.h>
 
-#define NUM_THREADS 2
+#define MAX_THREADS 16
+#define CLAIM_MESHLETS 2
+#define MESHLET_SIZE 64
+#define VCACHE_SIZE 16
+#define OCC_SCALE 4
+#define BVH_MARGIN 0.1f
+#define LIGHT_CUTOFF (1.0f / 256.0f)
+#define GLYPH_SIZE 35
+#define NUM_GLYPHS 62
+#define FRAME_QUEUE_SIZE 3
+#define CLIP_MAX_TRIS 16
+#define ARENA_CHUNK (64 * 1024)
+#define POOL_BLOCK 256
+#define CHUNK_TRIS 16384
+#define CHUNK_ALIGN 64
+#define LOADER_THREADS 4
+#define VIS_EMPTY 0xFFFFFFFFu
+#define VIS_THREAD_SHIFT 28             // the top 4 bits hold the worker index, 0..15
+#define VIS_INDEX_MASK ((1u << VIS_THREAD_SHIFT) - 1)
+static_assert(MAX_THREADS <= (1 << (32 - VIS_THREAD_SHIFT)), "a visibility id has no room for every worker index");
+#define RESOLVE_ROWS 8
+#define SOA_ALIGN 64
+#define SOA_PAD 16
+// Lets one translation unit hold kernels for several instruction sets; the build itself
+// only assumes SSE2, wider variants are chosen at run time.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define GFX_TARGET(isa)
+#else
+#define GFX_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 #define _abs_(x)  (((x)<0)?-(x):(x))
 #define _swap_(x,y) { x = x + y; y = x - y; x = x - y; }
 
@@ -27,6 +63,53 @@ enum Draw_Type {
 	WIRE_FRAME = 0, SOLID, TEXTURED
 };
 
+enum Blit_Mode {
+	BLIT_OPAQUE = 0, BLIT_ALPHA
+};
+
+enum Blit_Filter {
+	FILTER_NEAREST = 0, FILTER_BILINEAR
+};
+
+enum Frame_Format {
+	FRAME_RAW_BGRA = 0, FRAME_Y4M
+};
+
+// DEPTH_PREPASS queues Draw_obj calls until Flush_Draws, which lays down depth for all of
+// them first and then shades each pixel once. Flushing also happens before 2D drawing,
+// Submit_Frame, UpdateScreen and get_Frame; ClearScreen drops anything still queued.
+// A queued draw is replayed with the camera, projection and lights it was made with.
+// VISIBILITY_BUFFER queues the same way, but the flush rasterizes only a triangle id and
+// depth per pixel and shades the whole screen afterwards in one parallel resolve.
+// SORT_LAST has every worker shade its triangles into colour and depth buffers of its own,
+// merged into the frame by depth at the flush, so no two threads write the same pixel.
+// Each worker takes a fixed run of every mesh's meshlets, so equal depths are settled the
+// same way every frame.
+// INCREMENTAL keeps the last frame's 3D image: the draws queued after ClearScreen are compared
+// with the previous frame's at the first flush, and only the screen rectangles covered by the old
+// and new bounds of the ones that changed are rasterized again. 2D drawing goes on top of the
+// restored image. A Draw_obj after that flush is drawn straight away and makes the next frame
+// a full one, as does a change of clear colour; a draw whose projection or lights changed is
+// redrawn like a moved one. Meshes must not be modified in place while they are drawn this way.
+enum Render_Mode {
+	RENDER_FORWARD = 0, RENDER_DEPTH_PREPASS, RENDER_VISIBILITY_BUFFER, RENDER_SORT_LAST, RENDER_INCREMENTAL
+};
+
+enum Raster_Pass {
+	PASS_FULL = 0, PASS_DEPTH, PASS_EQUAL, PASS_VISIBILITY, PASS_PRIVATE
+};
+
+enum Simd_Level {
+	SIMD_SCALAR = 0, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512
+};
+
+// Span, glyph, blend, half float and batch math kernels run in the widest variant CPUID
+// reports at startup. GFX_SIMD=scalar|sse2|avx2|avx512 in the environment lowers it;
+// set_Simd_Level does the same from code, before anything is drawn, and returns the level
+// in use.
+Simd_Level get_Simd_Level();
+Simd_Level set_Simd_Level(Simd_Level level);
+
 HWND Create_Window(const wchar_t* title, int wd, int ht, HINSTANCE hInst, int  nCmd, int* error, WNDPROC winproc);
 
 struct bgra8 {
@@ -64,16 +147,50 @@ namespace _3D {
 		vec3d v3;
 	};
 
-	struct mat4x4 {
+	struct alignas(16) mat4x4 {
 		float mat[4][4] = { 0 };
 	};
 
-	struct mat_tri {
+	struct alignas(16) mat_tri {
 		float mat[3][4] = { 0 };
 		vec2d tex_mat[3] = { 0 };
 		bgra8 color;
 	};
 
+	struct meshlet {
+		int first_tri = 0;
+		int n_tris = 0;
+		vec3d center;            // bounding sphere
+		float radius = 0;
+		vec3d cone_apex;         // normal cone, cone_cutoff > 1 disables the cone test
+		vec3d cone_axis;
+		float cone_cutoff = 2.0f;
+	};
+
+	struct mesh_edge {
+		int v0, v1;              // indices into mesh3d::vertices
+		int f0, f1;              // adjacent triangles, f1 is -1 on an open edge
+	};
+
+	// 48 bytes per triangle instead of 176 for mat_tri + face normal + vertex normals
+	struct alignas(16) quant_tri {
+		int16_t normals[4][2];   // octahedral, the three vertex normals then the face normal
+		uint16_t pos[3][3];      // unorm over the mesh's bounding box
+		uint16_t uv[3][2];       // half floats
+		uint16_t pad;
+	};
+
+	// Up to 4 triangles the way the pipeline consumes them; t/f/v point into the mesh,
+	// or at the decoded copies held here when the mesh is quantized.
+	struct tri_batch {
+		mat_tri tris[4];
+		vec3d f_normals[4];
+		vec3dx3 v_normals[4];
+		const mat_tri* t;
+		const vec3d* f;
+		const vec3dx3* v;
+	};
+
 	mat4x4 Identity4();
 	mat4x4 XRotation_mat4(float angle);
 	mat4x4 YRotation_mat4(float angle);
@@ -85,27 +202,27 @@ namespace _3D {
 	inline void vec4_mat4_mult(const vec3d& V, const mat4x4& M, vec3d& out);
 	void Transpose_mat4(mat4x4& matrix);
 
-	inline vec3d operator+(vec3d& v1, vec3d& v2) {
+	inline vec3d operator+(const vec3d& v1, const vec3d& v2) {
 		return { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
 	}
 
-	inline vec3d operator-(vec3d& v1, vec3d& v2) {
+	inline vec3d operator-(const vec3d& v1, const vec3d& v2) {
 		return { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
 	}
 
-	inline vec3d operator*(vec3d& v1, float k) {
+	inline vec3d operator*(const vec3d& v1, float k) {
 		return { v1.x * k, v1.y * k, v1.z * k };
 	}
 
-	inline vec3d operator/(vec3d& v1, float k) {
+	inline vec3d operator/(const vec3d& v1, float k) {
 		return { v1.x / k, v1.y / k, v1.z / k };
 	}
 
-	inline float dot_vec3(vec3d& v1, vec3d& v2) {
+	inline float dot_vec3(const vec3d& v1, const vec3d& v2) {
 		return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
 	}
 
-	inline float lenth_vec3(vec3d& v) {
+	inline float lenth_vec3(const vec3d& v) {
 		return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
 	}
 
@@ -118,10 +235,54 @@ namespace _3D {
 		return ((v1.x - v2.x) * (v1.x - v2.x) + (v1.y - v2.y) * (v1.y - v2.y) + (v1.z - v2.z) * (v1.z - v2.z));
 	}
 
-	vec3d cross_vec3(vec3d& v1, vec3d& v2);
-	mat4x4 pointAt_mat(vec3d& pos, vec3d& target, vec3d& up);
-	mat4x4 Camera_mat4(vec3d& camPostion);
-	mat4x4 rt_mat_inverse(mat4x4& m);
+	vec3d cross_vec3(const vec3d& v1, const vec3d& v2);
+	mat4x4 pointAt_mat(const vec3d& pos, const vec3d& target, const vec3d& up);
+	mat4x4 Camera_mat4(const vec3d& camPostion);
+	mat4x4 rt_mat_inverse(const mat4x4& m);
+	mat4x4 affine_mat_inverse(const mat4x4& m);
+	void frustum_Planes(const mat4x4& m, vec3d planes[5]);
+	int backface_Mask(const mat_tri* tris, const vec3d* f_normals, int count, const vec3d& eye);
+
+	inline int soa_Padded(int n) { return (n + SOA_PAD - 1) & ~(SOA_PAD - 1); }
+
+	// Components in separate arrays for the batch functions below. Each array starts on a
+	// SOA_ALIGN boundary and is padded to a multiple of SOA_PAD floats, so the kernels run
+	// whole vectors over [first, first + count) as long as first is a multiple of SOA_PAD.
+	class vec_soa {
+	private:
+		float* block;
+		int count;
+		int capacity;
+
+	public:
+		float* x;
+		float* y;
+		float* z;
+		float* w;
+
+		vec_soa() { block = nullptr; count = 0; capacity = 0; x = y = z = w = nullptr; }
+		~vec_soa() { delete[] block; }
+		vec_soa(const vec_soa&) = delete;
+		vec_soa& operator=(const vec_soa&) = delete;
+
+		void resize(int n);
+		inline int size() const { return count; }
+		void load(const vec3d* src, int first, int n);
+		void store(vec3d* dst, int first, int n) const;
+		inline vec3d get(int i) const { return { x[i], y[i], z[i], w[i] }; }
+		inline void set(int i, const vec3d& v) { x[i] = v.x; y[i] = v.y; z[i] = v.z; w[i] = v.w; }
+	};
+
+	// Batched versions of the single vector operations, in the widest SIMD level in use and
+	// giving the same results. Outputs must already hold first + count elements; count -1
+	// runs to the end of the input. Points go through the whole matrix (row vector * m),
+	// normals through its upper 3x3 with w kept; face normals are cross(p1 - p0, p2 - p0)
+	// normalised, w = 0. dot_Batch writes exactly count floats, from out + first.
+	void transform_Points(const mat4x4& m, const vec_soa& in, vec_soa& out, int first = 0, int count = -1);
+	void transform_Normals(const mat4x4& m, const vec_soa& in, vec_soa& out, int first = 0, int count = -1);
+	void normalise_Batch(vec_soa& v, int first = 0, int count = -1);
+	void dot_Batch(const vec_soa& a, const vec_soa& b, float* out, int first = 0, int count = -1);
+	void face_Normals_Batch(const vec_soa& p0, const vec_soa& p1, const vec_soa& p2, vec_soa& out, int first = 0, int count = -1);
 
 	int left_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2);
 	int top_Clipping(mat_tri& tri_in, mat_tri& tri_out1, mat_tri& tri_out2);
@@ -138,12 +299,14 @@ private:
 	int i_width;
 	int i_height;
 	bgra8* data;
+	std::atomic<bool> pending;   // set while an asset_loader fills it
 
 public:
 	Texture() {
 		i_width = 0;
 		i_height = 0;
 		data = nullptr;
+		pending = false;
 	}
 
 	~Texture() { delete[] data; }
@@ -151,8 +314,10 @@ public:
 	bool load_image_data(const char* jpeg_path);
 	inline int image_Width() { return i_width; }
 	inline int image_Heigt() { return i_height; }
+	inline bool is_Ready() const { return !pending.load(std::memory_order_acquire) && data != nullptr; }
 
 	friend class gfx;
+	friend class asset_loader;
 };
 
 class mesh3d {
@@ -162,6 +327,29 @@ private:
 	vec3d* face_normals;
 	vec3dx3* vertex_normals;
 	Texture* mtexture;
+	int num_meshlets;
+	meshlet* meshlets;
+	vec3d bb_min, bb_max;
+	int num_vertices;
+	vec3d* vertices;             // unique positions, shared through tri_vindx
+	int* tri_vindx;              // 3 per triangle
+	int num_edges;
+	mesh_edge* edges;
+	quant_tri* qtris;            // replaces the three float arrays after quantize()
+	vec3d q_offset, q_scale;
+	bool is_view;                // arrays point into a chunked_mesh mapping and are not freed here
+	std::atomic<bool> pending;   // set while an asset_loader fills it, Draw_obj skips the mesh
+
+	static vec3d face_Cross(const vec_tri& tri);
+	static void finish_Normal(vec3d& sum);
+	static void face_Normals(const std::vector<vec_tri>& tris, std::vector<vec3d>& f_normals);
+	static void build_Normals(const std::vector<vec_tri>& tris, const std::vector<int>& f_indx, int n_verts, std::vector<vec3d>& f_normals, std::vector<vec3d>& v_normals);
+	void assemble(const std::vector<vec_tri>& tris, const std::vector<int>& f_indx, const vec3d* f_normals, const vec3d* v_normals, const std::vector<vec3d>& verts);
+	void reorder_Triangles(const int* order);
+	void build_Meshlets();
+	void optimize_Order();
+	void build_Edges();
+	void fetch_Batch(int first, int count, tri_batch& out) const;
 
 public:
 	mesh3d() {
@@ -170,23 +358,144 @@ public:
 		face_normals = nullptr;
 		vertex_normals = nullptr;
 		mtexture = nullptr;
+		num_meshlets = 0;
+		meshlets = nullptr;
+		num_vertices = 0;
+		vertices = nullptr;
+		tri_vindx = nullptr;
+		num_edges = 0;
+		edges = nullptr;
+		qtris = nullptr;
+		is_view = false;
+		pending = false;
 	}
 
 	~mesh3d() {
+		mtexture = nullptr;
+		if (is_view)return;
 		delete[] triangles_list;
 		delete[] face_normals;
 		delete[] vertex_normals;
-		mtexture = nullptr;
+		delete[] meshlets;
+		delete[] vertices;
+		delete[] tri_vindx;
+		delete[] edges;
+		delete[] qtris;
 	}
 
 	bool load_obj(const char* file, bool isTextured);
 	void bind_Texture(Texture* tex) { mtexture = tex; }
 	inline int get_num_Triangles() { return num_triangles; }
+	inline int get_num_Meshlets() { return num_meshlets; }
+	inline int get_num_Edges() { return num_edges; }
+	// Switches to 16 bit positions, half float UVs and octahedral normals and frees the
+	// float triangle data. Call once the mesh is loaded.
+	bool quantize();
+	inline bool is_Quantized() const { return qtris != nullptr; }
+	inline bool is_Ready() const { return !pending.load(std::memory_order_acquire); }
 
 	friend class gfx;
+	friend class scene3d;
+	friend class chunked_mesh;
+	friend class asset_loader;
 
 };
 
+// For out-of-core meshes ///////////
+// File written by chunked_mesh::convert_obj: header, chunk data, then the chunk table.
+// Each chunk holds a mesh3d's arrays verbatim, every array starting on a CHUNK_ALIGN
+// boundary, so a mapped chunk is drawn in place.
+struct chunk_file_header {
+	char magic[4];               // "PGCM"
+	int version;
+	int num_chunks;
+	int num_triangles;
+	int sizes[4];                // mat_tri, meshlet, mesh_edge, chunk_info; a file from another build is refused
+	uint64_t table_offset;
+	vec3d bb_min, bb_max;
+};
+
+struct chunk_info {
+	uint64_t offset;
+	int num_triangles;
+	int num_meshlets;
+	int num_vertices;
+	int num_edges;
+	vec3d bb_min, bb_max;
+};
+
+// A chunk file mapped read only. Chunks are spatially compact and stored in Morton order;
+// open checks the table and every chunk's indices, the rest of a chunk's pages are only
+// read once it survives culling and is drawn.
+class chunked_mesh {
+private:
+	HANDLE file;
+	HANDLE mapping;
+	const unsigned char* base;
+	uint64_t file_size;
+	int num_chunks;
+	int num_triangles;
+	const chunk_info* chunks;
+	mesh3d* views;
+	vec3d bb_min, bb_max;
+
+	static bool indices_Valid(const mesh3d& m);
+
+public:
+	chunked_mesh() {
+		file = nullptr;
+		mapping = nullptr;
+		base = nullptr;
+		file_size = 0;
+		num_chunks = 0;
+		num_triangles = 0;
+		chunks = nullptr;
+		views = nullptr;
+	}
+
+	~chunked_mesh() { close(); }
+
+	// Streams the obj three times and never holds more than the per-vertex data plus
+	// one cell of triangles, so meshes too large to load whole can be converted.
+	static bool convert_obj(const char* obj_file, const char* out_file, bool isTextured, int chunk_tris = CHUNK_TRIS);
+	bool open(const char* path);
+	void close();
+	void bind_Texture(Texture* tex);
+	inline int get_num_Chunks() { return num_chunks; }
+	inline int get_num_Triangles() { return num_triangles; }
+
+	friend class gfx;
+};
+
+// For asset loading ///////////
+// Loads meshes and textures on a pool of threads. The caller keeps ownership; an asset
+// is marked pending until its job finishes, and Draw_obj skips a pending mesh and draws
+// a mesh whose texture is not ready as SOLID, so rendering can start straight away.
+// Submit from the thread that draws, and keep assets alive until the loader is destroyed
+// or wait_All returns.
+class asset_loader {
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex job_lock;
+	std::condition_variable job_cv;
+	int active;
+	bool stopping;
+
+	void worker_Loop();
+	std::shared_future<bool> submit(std::function<bool()> work);
+
+public:
+	asset_loader(int n_threads = LOADER_THREADS);
+	~asset_loader();             // finishes everything still queued
+
+	std::shared_future<bool> load_Texture(Texture* tex, const char* jpeg_path);
+	// tex, if given, is bound straight away; it may still be loading
+	std::shared_future<bool> load_Mesh(mesh3d* mesh, const char* obj_path, bool isTextured, Texture* tex = nullptr);
+	void wait_All();
+	int pending_Jobs();
+};
+
 class plane_Light {
 private:
 	vec3d position = { 0 };
@@ -210,14 +519,184 @@ public:
 	float get_Power() { return power; }
 	vec3d get_Position() { return position; }
 	vec3d get_Normal() { return normal; }
+	// distance at which the inverse-square term drops below LIGHT_CUTOFF
+	float get_Radius() { return sqrtf(power / (12.5663f * LIGHT_CUTOFF)); }
 
 };
 
-struct thread_data {
-	mat_tri* tris_list;
-	vec3d* f_normals;
-	vec3dx3* v_normals;
-	int n_triangles;
+struct light_data {
+	vec3d position;
+	vec3d direction;      // normalised
+	bgra8 color;
+	float power;
+	float radius;
+};
+
+// Bump allocator for data that lives at most one frame. rewind() gives back everything
+// allocated after a mark; reset() also folds overflow chunks into one, so a steady
+// workload stops touching the heap after its first frames.
+class frame_arena {
+private:
+	struct chunk {
+		unsigned char* base;
+		size_t size;
+	};
+	std::vector<chunk> chunks;
+	size_t offset;           // into chunks.back()
+	size_t before;           // bytes in the chunks before the current one
+
+public:
+	frame_arena() { offset = 0; before = 0; }
+	~frame_arena() { for (chunk& c : chunks) delete[] c.base; }
+	frame_arena(const frame_arena&) = delete;
+	frame_arena& operator=(const frame_arena&) = delete;
+
+	void* alloc(size_t bytes, size_t align);
+	template<class T> inline T* alloc_Array(size_t n) { return (T*)alloc(sizeof(T) * n, alignof(T) < 16 ? 16 : alignof(T)); }
+	inline size_t mark() const { return before + offset; }
+	// marks from an earlier chunk are kept until reset()
+	inline void rewind(size_t m) { if (m >= before) offset = m - before; }
+	void reset();
+};
+
+// Fixed-size records handed out by index. Storage grows in blocks of POOL_BLOCK, so live
+// records never move and released slots are reused first.
+template<class T>
+class record_pool {
+private:
+	std::vector<T*> blocks;
+	std::vector<int> free_slots;
+	int n_slots = 0;
+
+public:
+	record_pool() {}
+	~record_pool() { for (T* b : blocks) delete[] b; }
+	record_pool(const record_pool&) = delete;
+	record_pool& operator=(const record_pool&) = delete;
+
+	int acquire() {
+		int id;
+		if (!free_slots.empty()) { id = free_slots.back(); free_slots.pop_back(); }
+		else {
+			if (n_slots == (int)blocks.size() * POOL_BLOCK) blocks.push_back(new T[POOL_BLOCK]);
+			id = n_slots++;
+		}
+		(*this)[id] = T();
+		return id;
+	}
+	inline void release(int id) { free_slots.push_back(id); }
+	inline int size() const { return n_slots; }
+	inline T& operator[](int id) { return blocks[(unsigned)id / POOL_BLOCK][(unsigned)id % POOL_BLOCK]; }
+	inline const T& operator[](int id) const { return blocks[(unsigned)id / POOL_BLOCK][(unsigned)id % POOL_BLOCK]; }
+};
+
+struct bound_box {
+	vec3d min;
+	vec3d max;
+};
+
+struct mesh_instance {
+	mesh3d* mesh = nullptr;
+	mat4x4 world_mat;
+	mat4x4 inv_world;
+	Draw_Type type = SOLID;
+	bound_box box;            // world space
+	int node = -1;
+};
+
+struct ray_hit {
+	int instance = -1;
+	int triangle = -1;
+	float distance = FLT_MAX;
+	float u = 0, v = 0;       // barycentrics of the hit on that triangle
+};
+
+class scene3d {
+private:
+	struct bvh_node {
+		bound_box box;        // fattened by BVH_MARGIN for leaves
+		int parent = -1;
+		int left = -1;        // -1 => leaf
+		int right = -1;
+		int instance = -1;
+		int height = 0;
+	};
+
+	record_pool<bvh_node> nodes;
+	record_pool<mesh_instance> instances;
+	int root;
+
+	static bound_box world_Box(const mesh3d* mesh, const mat4x4& m);
+	static bound_box fat_Box(const bound_box& b);
+	void insert_Leaf(int leaf);
+	void remove_Leaf(int leaf);
+	void refit_Up(int index);
+	int balance(int a);
+	int rotate(int a, int tall, int other);
+	bool ray_Mesh(const mesh_instance& inst, const vec3d& origin, const vec3d& dir, ray_hit& hit) const;
+
+public:
+	scene3d() {
+		root = -1;
+	}
+
+	// -1 for a mesh an asset_loader has not finished, add it once is_Ready()
+	int add_Instance(mesh3d* mesh, const mat4x4& world_mat, Draw_Type type);
+	void remove_Instance(int id);
+	void set_Transform(int id, const mat4x4& world_mat);
+	void query_Frustum(const mat4x4& view_proj, std::vector<int>& out) const;
+	bool ray_Cast(const vec3d& origin, const vec3d& dir, ray_hit& hit) const;
+	inline const mesh_instance* get_Instance(int id) const { return &instances[id]; }
+
+};
+
+// endpoints are inclusive; anything off screen is clipped before rasterizing
+struct line2d {
+	int x1, y1;
+	int x2, y2;
+	bgra8 color;
+};
+
+struct circle2d {
+	int x, y;
+	int radius;
+	bgra8 color;
+};
+
+// pixels [x0, x1) x [y0, y1)
+struct screen_rect {
+	int x0, y0;
+	int x1, y1;
+};
+
+// a Draw_obj call held back until Flush_Draws, with the view it was made in
+struct draw_record {
+	mesh3d* mesh;
+	mat4x4 model_mat;
+	mat4x4 camera_mat;
+	mat4x4 projection_mat;
+	vec3d camera_pos;
+	Draw_Type type;
+	int first_light;          // n_lights entries of the light snapshots queued with it
+	int n_lights;
+};
+
+// A screen triangle written to the visibility buffer. u/w, v/w and 1/w are stored as planes
+// over screen x,y, so the resolve gets perspective correct UVs without redoing the setup.
+struct vis_tri {
+	float u_plane[3];
+	float v_plane[3];
+	float w_plane[3];
+	float intensity;
+	bgra8 color;             // shade for solid triangles, light colour for textured ones
+	const Texture* tex;      // nullptr when solid
+};
+
+// Per worker counts since the last ClearScreen, to check how evenly the work was spread
+struct thread_stats {
+	uint64_t meshlets;       // meshlets claimed, culled or not
+	uint64_t triangles;      // screen triangles handed to the rasterizer after culling and clipping
+	uint64_t pixels;         // pixels those triangles covered, before the depth test
 };
 
 class gfx {
@@ -237,63 +716,170 @@ private:
 	// For 3D stuff and calculations ////
 	mat4x4 camera_mat;
 	mat4x4 projection_mat;
-	plane_Light light;
+	std::vector<light_data> light_list;
+	std::vector<int> obj_lights;
+	float obj_scale;
 	vec3d camera_pos;
+	vec3d obj_cam_pos;
+	vec3d obj_frustum[5];
 	mat4x4 model_mat;
 	Draw_Type dtype;
 	Texture* obj_tex;
+	Render_Mode render_mode;
+	Raster_Pass raster_pass;
+	std::vector<draw_record> draw_queue;
+	std::vector<light_data> queued_lights;   // light_list as the queued draws saw it
 
 	// For Multi-threading  //////////
-	thread_data th_data[2];      
-	std::thread draw_thd;
+	int n_threads;                       // the caller plus n_threads - 1 pooled threads
+	thread_stats th_stats[MAX_THREADS];
+	frame_arena th_arena[MAX_THREADS];   // transient per-worker data, reset by ClearScreen
+	vec_soa th_normals[MAX_THREADS];     // one tri_batch's normals in world space
+	const mesh3d* job_mesh;
+	std::atomic<int> next_meshlet;       // claimed CLAIM_MESHLETS at a time by the workers
+	std::vector<std::thread> draw_thds;
 	std::mutex draw_lock;
 	std::condition_variable draw_cv;
-	std::atomic<bool> done;
-	std::atomic<bool> ready;
+	uint64_t job_gen;                    // bumped under draw_lock for every run_Workers call
+	std::atomic<int> pending;
 	std::atomic<bool> kp_running;
+	const std::function<void(int)>* worker_task;
+	std::vector<line2d> clipped_lines;
+
+	// For Wireframes /////////////
+	std::vector<unsigned char> face_vis;
+	vec_soa view_verts;
+	std::vector<line2d> wire_lines[MAX_THREADS];
+
+	// For the Visibility buffer //
+	uint32_t* vis_Buffer;            // thread << VIS_THREAD_SHIFT | index into vis_tris, or VIS_EMPTY
+	std::vector<vis_tri> vis_tris[MAX_THREADS];
+
+	void resolve_Visibility();
+
+	// For Sort-last rendering ////
+	std::vector<bgra8> sl_color[MAX_THREADS];
+	std::vector<float> sl_depth[MAX_THREADS];
+
+	void composite_Private();
+
+	// For Incremental rendering //
+	int raster_x0, raster_x1;            // scissor the triangle and line rasterizers may write
+	int raster_y0, raster_y1;
+	bgra8* inc_color;                    // last frame's 3D image, without the 2D drawn over it
+	bool inc_open;                       // ClearScreen was called and the frame is not flushed yet
+	bool inc_valid;                      // inc_color, zBuffer and the inc_ state describe one frame
+	unsigned char inc_clear;
+	unsigned char inc_prev_clear;
+	std::vector<light_data> inc_lights;  // the light snapshots inc_draws index
+	std::vector<draw_record> inc_draws;
+
+	screen_rect draw_Rect(const draw_record& d);
+	void flush_Incremental();
+	int queue_Lights();
+	void replay_Draw(const draw_record& d, const std::vector<light_data>& lights);
+
+	// For Frame output ///////////
+	FILE* sink_file;
+	Frame_Format sink_format;
+	std::thread sink_thd;
+	std::mutex sink_lock;
+	std::condition_variable sink_cv;
+	std::deque<bgra8*> sink_queue;   // finished frames waiting for the writer
+	std::vector<bgra8*> sink_free;   // spare frames to swap in for scr_Buff
+	bool sink_running;
+	bool sink_error;
+	unsigned char* yuv_Buff;
+
+	void sink_Writer();
+	void bgra_to_I420(const bgra8* src, unsigned char* dst);
+
+	// For Occlusion culling //////
+	float* occ_Buffer;
+	float* occ_Temp;
+	int occ_Width;
+	int occ_Height;
+	bool occ_enabled;
+	bool occ_dirty;
 
 	// For Drawing Strings /////
-	bool* capital_alphs;
-	bool* smaller_alphs;
-	bool* digits;
+	const uint64_t* glyph_rows;      // embedded table, or font_file_rows when loaded from disk
+	uint64_t* font_file_rows;
 
 	void init_font_system();
+	void blit_Glyph(int glyph, int x, int y, bgra8 color);
 
-	void Textured_Triangle(int x1, int y1, float u1, float v1, float w1,
+	int Textured_Triangle(bgra8* frame, float* depth, int x1, int y1, float u1, float v1, float w1,
 		int x2, int y2, float u2, float v2, float w2,
 		int x3, int y3, float u3, float v3, float w3,
-		float _If, float _I1, float _I2, float _I3);
-	void Solid_Triangle(int x1, int y1, float w1,
+		float _If, float _I1, float _I2, float _I3, bgra8 light_col);
+	int Solid_Triangle(bgra8* frame, float* depth, int x1, int y1, float w1,
 		int x2, int y2, float w2,
 		int x3, int y3, float w3,
-		float intensity, bgra8 color);
+		float intensity, bgra8 color, uint32_t vis_id = 0);
+	bool cull_Meshlet(const meshlet& mlet);
+	void Depth_Triangle(float* depth, int stride,
+		int x1, int y1, float w1,
+		int x2, int y2, float w2,
+		int x3, int y3, float w3);
+	int screen_Clip(mat_tri* tris, int count, mat_tri* scratch, float wd, float ht);
+	void erode_Occlusion();
+	bool is_Occluded(mesh3d* mesh, const mat4x4& mdl_mat);
+	void render_Draw(mesh3d* mesh, const mat4x4& model_mat, Draw_Type type);
 	void main_Rasterizer(const int id);
+	void Draw_Wireframe(mesh3d* mesh);
 	void pooled_draw(const int id);
+	void start_Workers();
+	int claim_Meshlet(int id, int m, int& claim_end);
+	void run_Workers(const std::function<void(int)>& task);
+	bool clip_Line(line2d& ln);
+	void raster_Line(const line2d& ln, int band_y0, int band_y1);
+	void raster_Circle(const circle2d& c, int band_y0, int band_y1);
+	void blend_Row(bgra8* dst, const bgra8* src, int n);
+	void init_State();
 
 public:
 	
 	gfx(HWND handle, bool sync);
+	gfx(int width, int height);
 	~gfx();
 
 	bool Init();
 
 	bool gfx_terminate()
 	{
-		kp_running = false; 
-		draw_cv.notify_one();
-		if (draw_thd.joinable()) {
-			draw_thd.join();
-			return true;
+		{
+			std::lock_guard<std::mutex> lk1(draw_lock);
+			kp_running = false;
+		}
+		draw_cv.notify_all();
+		bool joined = false;
+		for (std::thread& t : draw_thds) {
+			if (!t.joinable())continue;
+			t.join();
+			joined = true;
 		}
-		else return false;
+		draw_thds.clear();
+		return joined;
+	}
+
+	// Threads that rasterize, the caller included; defaults to the hardware thread count,
+	// at most MAX_THREADS. Can be changed at any time, the pool is restarted if it runs.
+	void set_Thread_Count(int count);
+	inline int get_Thread_Count() { return n_threads; }
+	inline const thread_stats& get_Thread_Stats(int id) {
+		assert(0 <= id && id < n_threads);
+		return th_stats[id];
 	}
 
 	void set_Frame_Variables(mat4x4* cam_mat, vec3d* cam_pos, plane_Light* light_p) {
 		camera_mat = *cam_mat;
-		light = *light_p;
 		camera_pos = *cam_pos;
+		if (light_p) set_Lights(light_p, 1);
 	}
 
+	void set_Lights(plane_Light* light_p, int n_lights);
+
 	void set_Projection_Matrices(mat4x4* proj_mat) {
 		projection_mat = *proj_mat;
 	}
@@ -301,16 +887,13 @@ public:
 	inline void Begin_draw() { render_target->BeginDraw();  }
 	inline void End_draw() { render_target->EndDraw(); }
 
-	inline void ClearScreen(bgra8 color) {
-		float lumen = color.r * 0.29 + color.g * 0.58 + color.b * 0.13;
-		memset(scr_Buff, (unsigned char)lumen, sizeof(bgra8) * wHeight * wWidth);
-		memset(zBuffer, 0, sizeof(float) * wHeight * wWidth);
-	}
+	void ClearScreen(bgra8 color);
 
 	inline void ClearScreen_D2D(float r, float g, float b, float a) { render_target->Clear(D2D1::ColorF(r, g, b, a)); }
 	inline void set_Title(const char* title){ SetWindowTextA(win_handle, title); }
 
 	inline void UpdateScreen() {
+		Flush_Draws();
 		bitmap->CopyFromMemory(NULL, scr_Buff, wWidth * 4);
 
 		render_target->DrawBitmap(bitmap, D2D1::RectF(0.0f, 0.0f, bmp_Size.width, bmp_Size.height), 1.0f,
@@ -320,6 +903,7 @@ public:
 
 	inline int get_Height() { return wHeight; }
 	inline int get_Width() { return wWidth; }
+	inline const bgra8* get_Frame() { Flush_Draws(); return scr_Buff; }
 
 	inline void set_Pixel(int x, int y, bgra8 color) {
 		assert((x >= 0 && x <= wWidth) && (y >= 0 && y <= wHeight));
@@ -328,9 +912,26 @@ public:
 
 	void Line(int x1, int y1, int x2, int y2, bgra8 color);
 	void Circle(int x0, int y0, int radius, bgra8 color);
+	void Draw_Lines(const line2d* lines, int count);
+	void Draw_Circles(const circle2d* circles, int count);
 	void Triangle(const int& x1, const int& y1, const int& x2, const int& y2, const int& x3, const int& y3, const bgra8& color);
 	bool Draw_obj(mesh3d* mesh, const mat4x4& model_mat, Draw_Type type);
+	bool Draw_Chunked(chunked_mesh* cmesh, const mat4x4& model_mat, Draw_Type type);
+	void set_Render_Mode(Render_Mode mode);
+	inline Render_Mode get_Render_Mode() { return render_mode; }
+	void Flush_Draws();
+	bool Draw_Scene(scene3d* scene);
+	void Draw_Occluder(mesh3d* mesh, const mat4x4& model_mat);
+	inline void set_Occlusion_Culling(bool enable) { occ_enabled = enable; }
+	bool set_Font_Path(const char* dir);
 	void Draw_String(const char* str, int x, int y, bgra8 color);
-	void Draw_Image(const Texture* img, int x, int y);
+	void Draw_Image(const Texture* img, int x, int y, Blit_Mode mode = BLIT_OPAQUE);
+	void Draw_Image_Scaled(const Texture* img, int x, int y, int dst_w, int dst_h, Blit_Filter filter, Blit_Mode mode = BLIT_OPAQUE);
+
+	// Frames handed to Submit_Frame are written by a background thread. scr_Buff is swapped
+	// with a spare buffer rather than copied, so its contents are undefined afterwards.
+	bool open_Frame_Sink(const char* path, Frame_Format format, int fps = 30);
+	bool Submit_Frame();
+	bool close_Frame_Sink();
 
 };
@@ -0,0 +1,29 @@
+// Converts an obj into a chunk file for chunked_mesh, for meshes too large to load whole.
+// usage: obj2chunks <obj file> <plain|uv> <output file> [triangles per chunk]
+
+#include <Windows.h>
+#include <cstdio>
+#include <cstring>
+#include "../p_gfx.h"
+
+int main(int argc, char** argv)
+{
+	if (argc < 4 || argc > 5 || (strcmp(argv[2], "plain") != 0 && strcmp(argv[2], "uv") != 0)) {
+		fprintf(stderr, "usage: obj2chunks <obj file> <plain|uv> <output file> [triangles per chunk]\n");
+		return 1;
+	}
+
+	int chunk_tris = (argc == 5) ? atoi(argv[4]) : CHUNK_TRIS;
+	if (!chunked_mesh::convert_obj(argv[1], argv[3], strcmp(argv[2], "uv") == 0, chunk_tris)) {
+		fprintf(stderr, "obj2chunks: cannot convert %s\n", argv[1]);
+		return 1;
+	}
+
+	chunked_mesh check;
+	if (!check.open(argv[3])) {
+		fprintf(stderr, "obj2chunks: cannot read back %s\n", argv[3]);
+		return 1;
+	}
+	printf("%d triangles in %d chunks\n", check.get_num_Triangles(), check.get_num_Chunks());
+	return 0;
+}
@@ -0,0 +1,63 @@
+// Build step: packs the font sheets in dpnds/ into font_glyphs.h so the glyphs are compiled into the binary.
+// usage: sht2glyphs <sheet dir> <output header>
+
+#include <cstdio>
+#include <cstdint>
+
+#define GLYPH_SIZE 35
+#define NUM_GLYPHS 62
+
+int main(int argc, char** argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: sht2glyphs <sheet dir> <output header>\n");
+		return 1;
+	}
+
+	// same order as gfx::init_font_system: a-z, A-Z, 0-9
+	const char* sheets[3] = { "a-z_smaller.sht", "a-z_capital.sht", "dgt_punc.sht" };
+	const int count[3] = { 26, 26, 10 };
+	static uint64_t rows[NUM_GLYPHS * GLYPH_SIZE];
+	char temp_buff[GLYPH_SIZE * GLYPH_SIZE];
+	int glyph = 0;
+
+	for (int s = 0; s < 3; s++) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", argv[1], sheets[s]);
+		FILE* f_sheet = fopen(path, "rb");
+		if (!f_sheet) {
+			fprintf(stderr, "sht2glyphs: cannot open %s\n", path);
+			return 1;
+		}
+		for (int k = 0; k < count[s]; k++, glyph++) {
+			if (fread(temp_buff, sizeof(char), GLYPH_SIZE * GLYPH_SIZE, f_sheet) != GLYPH_SIZE * GLYPH_SIZE) {
+				fprintf(stderr, "sht2glyphs: %s is truncated\n", path);
+				fclose(f_sheet);
+				return 1;
+			}
+			for (int i = 0; i < GLYPH_SIZE; i++) {
+				uint64_t row = 0;
+				for (int j = 0; j < GLYPH_SIZE; j++)
+					if (temp_buff[i * GLYPH_SIZE + j] == 'Y') row |= (1ull << j);
+				rows[glyph * GLYPH_SIZE + i] = row;
+			}
+		}
+		fclose(f_sheet);
+	}
+
+	FILE* out = fopen(argv[2], "w");
+	if (!out) {
+		fprintf(stderr, "sht2glyphs: cannot write %s\n", argv[2]);
+		return 1;
+	}
+	fprintf(out, "// generated by tools/sht2glyphs from dpnds/*.sht, do not edit\n#pragma once\n#include <cstdint>\n\n");
+	fprintf(out, "constexpr uint64_t embedded_glyph_rows[%d] = {\n", NUM_GLYPHS * GLYPH_SIZE);
+	for (int g = 0; g < NUM_GLYPHS; g++) {
+		fprintf(out, "\t");
+		for (int i = 0; i < GLYPH_SIZE; i++)
+			fprintf(out, "0x%llxull,%s", (unsigned long long)rows[g * GLYPH_SIZE + i], (i + 1 < GLYPH_SIZE) ? " " : "\n");
+	}
+	fprintf(out, "};\n");
+	fclose(out);
+	return 0;
+}